@@ -2,7 +2,7 @@
 	Sparse data structure 
 
 	Author:   Steffen Rendle, http://www.libfm.org/
-	modified: 2012-01-04
+	modified: 2013-09-09
 
 	Copyright 2010-2012 Steffen Rendle, see license.txt for more information
 */
@@ -12,4 +12,12 @@
 
 typedef float FM_FLOAT;
 
+// precision of the model parameters w0, w, v and of the factor sums in the prediction;
+// build with -DFM_MODEL_SINGLE_PRECISION for a float model (half the memory, twice the SIMD width)
+#ifdef FM_MODEL_SINGLE_PRECISION
+typedef float FM_MODEL_FLOAT;
+#else
+typedef double FM_MODEL_FLOAT;
+#endif
+
 #endif /*FM_DATA_H_*/
@@ -5,7 +5,7 @@
 	Steffen Rendle (2010): Factorization Machines, in Proceedings of the 10th IEEE International Conference on Data Mining (ICDM 2010), Sydney, Australia.
 
 	Author:   Steffen Rendle, http://www.libfm.org/
-	modified: 2012-01-04
+	modified: 2013-09-09
 
 	Copyright 2010-2012 Steffen Rendle, see license.txt for more information
 */
@@ -17,15 +17,43 @@
 #include "../util/fmatrix.h"
 
 #include "fm_data.h"
-
+#include "fm_simd.h"
+#include "fm_model_file.h"
+
+// Storage layout of the pairwise factors v(f,i):
+// default: factor-major, v(f,.) is a contiguous row of num_attribute values (best for MCMC/ALS,
+//          which sweep one factor over all attributes)
+// FM_V_FEATURE_MAJOR: v(.,i) holds the num_factor values of attribute i contiguously, padded to
+//          64 bytes (best for SGD and prediction, which touch all factors of a few attributes)
+#ifdef FM_V_FEATURE_MAJOR
+typedef DMatrixColumnMajor<FM_MODEL_FLOAT> fm_v_matrix;
+inline uint64 fm_v_attr_step(const fm_v_matrix& v) { return v.stride; } // distance between v(f,i) and v(f,i+1)
+inline uint64 fm_v_factor_step(const fm_v_matrix& v) { return 1; }      // distance between v(f,i) and v(f+1,i)
+// uses the factors of a model file in place if they are stored in this layout and precision
+inline bool fm_v_set_external(fm_v_matrix& v, FM_MODEL_FLOAT* data, const fm_model_file_section& s) {
+	if ((data == NULL) || (s.step1 != 1) || (s.step2 != fm_v_matrix::stride_for(s.dim1))) { return false; }
+	v.setExternal(data, s.dim1, s.dim2, s.step2);
+	return true;
+}
+#else
+typedef DMatrixReal<FM_MODEL_FLOAT> fm_v_matrix;
+inline uint64 fm_v_attr_step(const fm_v_matrix& v) { return 1; }
+inline uint64 fm_v_factor_step(const fm_v_matrix& v) { return v.dim2; }
+inline bool fm_v_set_external(fm_v_matrix& v, FM_MODEL_FLOAT* data, const fm_model_file_section& s) {
+	if ((data == NULL) || (s.step1 != s.dim2) || (s.step2 != 1)) { return false; }
+	v.setExternal(data, s.dim1, s.dim2);
+	return true;
+}
+#endif
 
 class fm_model {
 	private:
-		DVector<double> m_sum, m_sum_sqr; //k维（因子维度）
+		DVector<FM_MODEL_FLOAT> m_sum, m_sum_sqr; //k维（因子维度）
+		fm_model_file* file; // loaded model; w and v might point into it
 	public:
-		double w0;          //w0
-		DVectorDouble w;    //w1 ~ wp
-		DMatrixDouble v;    //v<1,1> ~ v<p,k>
+		FM_MODEL_FLOAT w0;  //w0
+		DVectorReal<FM_MODEL_FLOAT> w; //w1 ~ wp
+		fm_v_matrix v;      //v<1,1> ~ v<p,k>
 
 	public:
 		// the following values should be set:
@@ -41,10 +69,17 @@ class fm_model {
 		double init_mean;
 		
 		fm_model();
+		~fm_model();
 		void debug();
 		void init();
-		double predict(sparse_row<FM_FLOAT>& x);
-		double predict(sparse_row<FM_FLOAT>& x, DVector<double> &sum, DVector<double> &sum_sqr);
+		void save(fm_model_file_writer& out);
+		void load(fm_model_file* in);
+		// continues from a previous model: call init() first, then w0, w and v of the attributes
+		// 0 ... prev.num_attribute-1 are copied; newly appearing attributes keep their initial values
+		void warm_start(fm_model& prev);
+		// binary: all values of x are 1.0 (see Data::is_binary); the result is the same, but faster
+		double predict(sparse_row<FM_FLOAT>& x, bool binary = false);
+		double predict(sparse_row<FM_FLOAT>& x, DVector<FM_MODEL_FLOAT> &sum, DVector<FM_MODEL_FLOAT> &sum_sqr, bool binary = false);
 	
 };
 
@@ -59,6 +94,15 @@ fm_model::fm_model() {
 	regv = 0.0; 
 	k0 = true;
 	k1 = true;
+	file = NULL;
+}
+
+fm_model::~fm_model() {
+	w.release();
+	v.release();
+	if (file != NULL) {
+		delete file;
+	}
 }
 
 void fm_model::debug() {
@@ -82,30 +126,103 @@ void fm_model::init() {
 	m_sum_sqr.setSize(num_factor);
 }
 
-double fm_model::predict(sparse_row<FM_FLOAT>& x) {
-	return predict(x, m_sum, m_sum_sqr);		
+void fm_model::save(fm_model_file_writer& out) {
+	out.addScalar("num_attribute", num_attribute);
+	out.addScalar("k0", k0);
+	out.addScalar("k1", k1);
+	out.addScalar("num_factor", num_factor);
+	out.addScalar("reg0", reg0);
+	out.addScalar("regw", regw);
+	out.addScalar("regv", regv);
+	out.addScalar("w0", w0);
+	out.addVector("w", w);
+	out.addMatrix("v", v);
+}
+
+// takes the ownership of the file; w and v are used in place if the file has the
+// precision and the layout of this build, otherwise they are copied
+void fm_model::load(fm_model_file* in) {
+	w.release();
+	v.release();
+	if (file != NULL) {
+		delete file;
+	}
+	file = in;
+
+	num_attribute = (uint) in->getScalar("num_attribute");
+	k0 = in->getScalar("k0") != 0;
+	k1 = in->getScalar("k1") != 0;
+	num_factor = (int) in->getScalar("num_factor");
+	reg0 = in->getScalar("reg0");
+	regw = in->getScalar("regw");
+	regv = in->getScalar("regv");
+	w0 = in->getScalar("w0");
+
+	const fm_model_file_section& sw = in->getSection("w");
+	if ((sw.dim1 != num_attribute) || (sw.dim2 != 1)) {
+		throw "the model file has an inconsistent size of w";
+	}
+	FM_MODEL_FLOAT* pw = in->getData<FM_MODEL_FLOAT>(sw);
+	if ((pw != NULL) && (sw.step1 == 1)) {
+		w.setExternal(pw, sw.dim1);
+	} else {
+		in->getVector("w", w);
+	}
+	const fm_model_file_section& sv = in->getSection("v");
+	if ((sv.dim1 != (uint) num_factor) || (sv.dim2 != num_attribute)) {
+		throw "the model file has an inconsistent size of v";
+	}
+	if (! fm_v_set_external(v, in->getData<FM_MODEL_FLOAT>(sv), sv)) {
+		in->getMatrix("v", v);
+	}
+	m_sum.setSize(num_factor);
+	m_sum_sqr.setSize(num_factor);
 }
 
-double fm_model::predict(sparse_row<FM_FLOAT>& x, DVector<double> &sum, DVector<double> &sum_sqr) {
+void fm_model::warm_start(fm_model& prev) {
+	if (prev.num_factor != num_factor) {
+		throw "the model to warm start from has a different number of factors";
+	}
+	if (prev.num_attribute > num_attribute) {
+		throw "the model to warm start from has more attributes than the data";
+	}
+	w0 = prev.w0;
+	for (uint i = 0; i < prev.num_attribute; i++) {
+		w(i) = prev.w(i);
+	}
+	for (int f = 0; f < num_factor; f++) {
+		for (uint i = 0; i < prev.num_attribute; i++) {
+			v(f,i) = prev.v(f,i);
+		}
+	}
+}
+
+double fm_model::predict(sparse_row<FM_FLOAT>& x, bool binary) {
+	return predict(x, m_sum, m_sum_sqr, binary);
+}
+
+double fm_model::predict(sparse_row<FM_FLOAT>& x, DVector<FM_MODEL_FLOAT> &sum, DVector<FM_MODEL_FLOAT> &sum_sqr, bool binary) {
 	double result = 0;
 	if (k0) {	
 		result += w0;
 	}
-	if (k1) {
+	if (k1 && binary) {
+		for (uint i = 0; i < x.size; i++) {
+			assert(x.data[i].id < num_attribute);
+			result += w(x.data[i].id);
+		}
+	} else if (k1) {
 		for (uint i = 0; i < x.size; i++) {
 			assert(x.data[i].id < num_attribute);
 			result += w(x.data[i].id) * x.data[i].value;//w[i] * x[i] and i from 1 to p
 		}
 	}
 	//use formula 5
-	for (int f = 0; f < num_factor; f++) {//f = 1 to k
-		sum(f) = 0;
-		sum_sqr(f) = 0;
-		for (uint i = 0; i < x.size; i++) {//j = 1 to p
-			double d = v(f,x.data[i].id) * x.data[i].value;
-			sum(f) += d;
-			sum_sqr(f) += d*d;
-		}
+	if (num_factor > 0) {
+		fm_sum_factors_func sum_factors = binary ? fm_simd::getInstance().sum_factors_binary : fm_simd::getInstance().sum_factors;
+		sum_factors(&v(0,0), fm_v_attr_step(v), fm_v_factor_step(v), x, sum.value, sum_sqr.value, num_factor);
+	}
+	for (int f = 0; f < num_factor; f++) {
 		result += 0.5 * (sum(f)*sum(f) - sum_sqr(f));
 	}
 	return result;
@@ -0,0 +1,365 @@
+/*
+	Binary file format for FM models
+
+	A model file consists of a header, a table of named sections and the data of
+	the sections. Every section is a dense (dim1 x dim2) array of float or double
+	values where element (i,j) is stored at position i*step1 + j*step2; the data of
+	each section starts at a 64 byte boundary. Because of this, w and v can be used
+	directly from the (memory mapped) file without parsing or copying.
+
+	The header stores a checksum over everything that follows the header. It is
+	verified when the file is read into memory; memory mapped files are only
+	checked for consistency of the header and the section table.
+*/
+
+#ifndef FM_MODEL_FILE_H_
+#define FM_MODEL_FILE_H_
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include "../util/matrix.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+const uint FM_MODEL_FILE_ID = 0x4d464d4c; // "LMFM"
+const uint FM_MODEL_FILE_VERSION = 1;
+const uint FM_MODEL_FILE_ALIGNMENT = 64;
+const uint FM_MODEL_FILE_NAME_LENGTH = 16;
+
+struct fm_model_file_header {
+	uint id;
+	uint version;
+	uint num_sections;
+	uint reserved;
+	uint64 file_size;
+	uint64 checksum; // of all bytes behind the header
+};
+
+struct fm_model_file_section {
+	char name[FM_MODEL_FILE_NAME_LENGTH];
+	uint type_size; // 4 (float) or 8 (double)
+	uint dim1, dim2;
+	uint reserved;
+	uint64 step1, step2; // element (i,j) is at position i*step1 + j*step2
+	uint64 offset;       // from the beginning of the file
+	uint64 size;         // in bytes
+};
+
+// 64 bit FNV-1a over 8 byte words; the last word is zero padded
+class fm_model_file_checksum {
+	private:
+		uint64 hash;
+		uint64 word;
+		uint filled;
+		void addWord(uint64 w) {
+			hash ^= w;
+			hash *= 0x100000001b3ULL;
+		}
+	public:
+		fm_model_file_checksum() {
+			hash = 0xcbf29ce484222325ULL;
+			word = 0;
+			filled = 0;
+		}
+		void add(const char* data, uint64 size) {
+			while ((filled != 0) && (size > 0)) {
+				word |= (uint64) (unsigned char) *data << (8*filled);
+				data++; size--;
+				if (++filled == 8) { addWord(word); word = 0; filled = 0; }
+			}
+			for (; size >= 8; data += 8, size -= 8) {
+				uint64 w;
+				memcpy(&w, data, 8);
+				addWord(w);
+			}
+			while (size > 0) {
+				word |= (uint64) (unsigned char) *data << (8*filled);
+				data++; size--;
+				filled++;
+			}
+		}
+		uint64 value() {
+			uint64 result = hash;
+			if (filled > 0) {
+				result ^= word;
+				result *= 0x100000001b3ULL;
+			}
+			return result;
+		}
+};
+
+
+// collects the sections of a model and writes them to a file
+class fm_model_file_writer {
+	private:
+		struct section_data {
+			fm_model_file_section section;
+			const char* data;
+			std::vector<char> copy; // for values that do not outlive the writer (scalars)
+		};
+		std::vector<section_data> sections;
+
+		template <typename T> void add(const std::string& name, const T* data, uint dim1, uint dim2, uint64 step1, uint64 step2, uint64 num_values) {
+			if (name.size() >= FM_MODEL_FILE_NAME_LENGTH) {
+				throw "section name " + name + " is too long";
+			}
+			section_data s;
+			memset(&s.section, 0, sizeof(s.section));
+			memcpy(s.section.name, name.c_str(), name.size()); // zero terminated by the memset
+			s.section.type_size = sizeof(T);
+			s.section.dim1 = dim1;
+			s.section.dim2 = dim2;
+			s.section.step1 = step1;
+			s.section.step2 = step2;
+			s.section.size = num_values * sizeof(T);
+			s.data = reinterpret_cast<const char*>(data);
+			sections.push_back(s);
+		}
+
+	public:
+		void addScalar(const std::string& name, double value) {
+			add(name, &value, 1, 1, 1, 1, 1);
+			section_data& s = sections.back();
+			s.copy.assign(reinterpret_cast<const char*>(&value), reinterpret_cast<const char*>(&value) + sizeof(value));
+			s.data = NULL;
+		}
+		// the data of vectors and matrices is referenced until write() is called
+		template <typename T> void addVector(const std::string& name, const DVector<T>& v) {
+			add(name, v.value, v.dim, 1, 1, 0, v.dim);
+		}
+		template <typename T> void addMatrix(const std::string& name, const DMatrix<T>& m) {
+			// the rows of a DMatrix are allocated as one block
+			add(name, (m.dim1 > 0) ? m.value[0] : (T*) NULL, m.dim1, m.dim2, m.dim2, 1, (uint64) m.dim1 * m.dim2);
+		}
+		template <typename T> void addMatrix(const std::string& name, const DMatrixColumnMajor<T>& m) {
+			add(name, m.value, m.dim1, m.dim2, 1, m.stride, (uint64) m.stride * m.dim2);
+		}
+
+		void write(const std::string& filename) {
+			uint64 offset = sizeof(fm_model_file_header) + sections.size() * sizeof(fm_model_file_section);
+			for (uint i = 0; i < sections.size(); i++) {
+				offset = ((offset + FM_MODEL_FILE_ALIGNMENT - 1) / FM_MODEL_FILE_ALIGNMENT) * FM_MODEL_FILE_ALIGNMENT;
+				sections[i].section.offset = offset;
+				offset += sections[i].section.size;
+			}
+			fm_model_file_header header;
+			memset(&header, 0, sizeof(header));
+			header.id = FM_MODEL_FILE_ID;
+			header.version = FM_MODEL_FILE_VERSION;
+			header.num_sections = sections.size();
+			header.file_size = offset;
+
+			std::ofstream out(filename.c_str(), std::ios_base::out | std::ios_base::binary);
+			if (! out.is_open()) {
+				throw "unable to open " + filename;
+			}
+			fm_model_file_checksum checksum;
+			out.write(reinterpret_cast<char*>(&header), sizeof(header)); // checksum is written at the end
+			uint64 pos = sizeof(header);
+			for (uint i = 0; i < sections.size(); i++) {
+				const char* p = reinterpret_cast<const char*>(&(sections[i].section));
+				out.write(p, sizeof(fm_model_file_section));
+				checksum.add(p, sizeof(fm_model_file_section));
+				pos += sizeof(fm_model_file_section);
+			}
+			const char padding[FM_MODEL_FILE_ALIGNMENT] = { 0 };
+			for (uint i = 0; i < sections.size(); i++) {
+				uint64 gap = sections[i].section.offset - pos;
+				out.write(padding, gap);
+				checksum.add(padding, gap);
+				const char* data = (sections[i].data != NULL) ? sections[i].data : &(sections[i].copy[0]);
+				out.write(data, sections[i].section.size);
+				checksum.add(data, sections[i].section.size);
+				pos = sections[i].section.offset + sections[i].section.size;
+			}
+			header.checksum = checksum.value();
+			out.seekp(0, std::ios_base::beg);
+			out.write(reinterpret_cast<char*>(&header), sizeof(header));
+			out.close();
+			if (out.fail()) {
+				throw "error writing " + filename;
+			}
+		}
+};
+
+
+// read access to a model file; the file is either memory mapped or read into memory
+class fm_model_file {
+	private:
+		std::string filename;
+		char* data;
+		uint64 data_size;
+		char* memory;
+		bool is_mapped;
+		fm_model_file_header header;
+		fm_model_file_section* section_table;
+
+		void check() {
+			if (data_size < sizeof(fm_model_file_header)) {
+				throw "file " + filename + " is not an FM model";
+			}
+			memcpy(&header, data, sizeof(header));
+			if (header.id != FM_MODEL_FILE_ID) {
+				throw "file " + filename + " is not an FM model";
+			}
+			if (header.version != FM_MODEL_FILE_VERSION) {
+				throw "model file " + filename + " has an unsupported version";
+			}
+			if ((header.file_size != data_size) || (sizeof(header) + (uint64) header.num_sections * sizeof(fm_model_file_section) > data_size)) {
+				throw "model file " + filename + " is truncated";
+			}
+			section_table = reinterpret_cast<fm_model_file_section*>(data + sizeof(header));
+			for (uint i = 0; i < header.num_sections; i++) {
+				const fm_model_file_section& s = section_table[i];
+				if ((s.offset % FM_MODEL_FILE_ALIGNMENT != 0) || (s.offset + s.size > data_size) || ((s.type_size != sizeof(float)) && (s.type_size != sizeof(double)))) {
+					throw "model file " + filename + " has a corrupt section table";
+				}
+				if ((s.dim1 > 0) && (s.dim2 > 0) && (((uint64) (s.dim1-1) * s.step1 + (uint64) (s.dim2-1) * s.step2 + 1) * s.type_size > s.size)) {
+					throw "model file " + filename + " has a corrupt section table";
+				}
+			}
+		}
+
+		template <typename T> T value_at(const fm_model_file_section& s, uint64 pos) {
+			if (s.type_size == sizeof(double)) {
+				double d;
+				memcpy(&d, data + s.offset + pos*sizeof(double), sizeof(double));
+				return (T) d;
+			} else {
+				float f;
+				memcpy(&f, data + s.offset + pos*sizeof(float), sizeof(float));
+				return (T) f;
+			}
+		}
+
+	public:
+		// use_mmap: map the file copy-on-write instead of reading it; the checksum is not verified
+		fm_model_file(const std::string& filename, bool use_mmap = false) {
+			this->filename = filename;
+			data = NULL;
+			memory = NULL;
+			data_size = 0;
+			is_mapped = false;
+			if (use_mmap) {
+				#ifdef _WIN32
+				throw "memory mapped files are not supported on this platform";
+				#else
+				int fd = open(filename.c_str(), O_RDONLY);
+				if (fd < 0) {
+					throw "could not open " + filename;
+				}
+				struct stat st;
+				fstat(fd, &st);
+				data_size = st.st_size;
+				// private mapping: the parameters can be changed (e.g. by further training) without touching the file
+				void* m = (data_size > 0) ? mmap(NULL, data_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+				close(fd);
+				if (m == MAP_FAILED) {
+					throw "could not map " + filename;
+				}
+				data = static_cast<char*>(m);
+				is_mapped = true;
+				#endif
+				check();
+			} else {
+				std::ifstream in(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+				if (! in.is_open()) {
+					throw "unable to open " + filename;
+				}
+				in.seekg(0, std::ios_base::end);
+				data_size = in.tellg();
+				in.seekg(0, std::ios_base::beg);
+				memory = new char[data_size + FM_MODEL_FILE_ALIGNMENT];
+				data = memory;
+				while (((size_t) data) % FM_MODEL_FILE_ALIGNMENT != 0) { data++; }
+				in.read(data, data_size);
+				if ((uint64) in.gcount() != data_size) {
+					throw "error reading " + filename;
+				}
+				in.close();
+				check();
+				fm_model_file_checksum checksum;
+				checksum.add(data + sizeof(header), data_size - sizeof(header));
+				if (checksum.value() != header.checksum) {
+					throw "model file " + filename + " is corrupt (checksum mismatch)";
+				}
+			}
+		}
+
+		~fm_model_file() {
+			#ifndef _WIN32
+			if (is_mapped) {
+				munmap(data, data_size);
+			}
+			#endif
+			if (memory != NULL) {
+				delete [] memory;
+			}
+		}
+
+		bool hasSection(const std::string& name) {
+			for (uint i = 0; i < header.num_sections; i++) {
+				if (strncmp(section_table[i].name, name.c_str(), FM_MODEL_FILE_NAME_LENGTH) == 0) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		const fm_model_file_section& getSection(const std::string& name) {
+			for (uint i = 0; i < header.num_sections; i++) {
+				if (strncmp(section_table[i].name, name.c_str(), FM_MODEL_FILE_NAME_LENGTH) == 0) {
+					return section_table[i];
+				}
+			}
+			throw "model file " + filename + " has no section " + name;
+		}
+
+		// pointer to the data of a section if it can be used as an array of T in place
+		template <typename T> T* getData(const fm_model_file_section& s) {
+			if (s.type_size != sizeof(T)) {
+				return NULL;
+			}
+			return reinterpret_cast<T*>(data + s.offset);
+		}
+
+		double getScalar(const std::string& name) {
+			const fm_model_file_section& s = getSection(name);
+			if ((s.dim1 != 1) || (s.dim2 != 1)) {
+				throw "section " + name + " of model file " + filename + " is not a scalar";
+			}
+			return value_at<double>(s, 0);
+		}
+
+		// copies a section into v (converting the precision if necessary)
+		template <typename T> void getVector(const std::string& name, DVector<T>& v) {
+			const fm_model_file_section& s = getSection(name);
+			if (s.dim2 != 1) {
+				throw "section " + name + " of model file " + filename + " is not a vector";
+			}
+			v.setSize(s.dim1);
+			for (uint i = 0; i < s.dim1; i++) {
+				v(i) = value_at<T>(s, i * s.step1);
+			}
+		}
+
+		// copies a section into m (any layout, converting the precision if necessary)
+		template <typename M> void getMatrix(const std::string& name, M& m) {
+			const fm_model_file_section& s = getSection(name);
+			m.setSize(s.dim1, s.dim2);
+			for (uint i = 0; i < s.dim1; i++) {
+				for (uint j = 0; j < s.dim2; j++) {
+					m(i,j) = value_at<double>(s, i * s.step1 + j * s.step2);
+				}
+			}
+		}
+};
+
+#endif /*FM_MODEL_FILE_H_*/
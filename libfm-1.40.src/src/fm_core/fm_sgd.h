@@ -5,7 +5,7 @@
 	Steffen Rendle (2010): Factorization Machines, in Proceedings of the 10th IEEE International Conference on Data Mining (ICDM 2010), Sydney, Australia.
 
 	Author:   Steffen Rendle, http://www.libfm.org/
-	modified: 2012-06-08
+	modified: 2013-09-09
 
 	Copyright 2010-2012 Steffen Rendle, see license.txt for more information
 */
@@ -13,31 +13,264 @@
 #ifndef FM_SGD_H_
 #define FM_SGD_H_
 
+#include <cmath>
+#include <string>
+#include <atomic>
 #include "fm_model.h"
 
-void fm_SGD(fm_model* fm, const double& learn_rate, sparse_row<DATA_FLOAT> &x, const double multiplier, DVector<double> &sum) {
+// binary: all values of x are 1.0, so the value loads and multiplications are left out
+void fm_SGD(fm_model* fm, const double& learn_rate, sparse_row<DATA_FLOAT> &x, const double multiplier, DVector<FM_MODEL_FLOAT> &sum, bool binary = false) {
 	if (fm->k0) {
-		double& w0 = fm->w0;
+		FM_MODEL_FLOAT& w0 = fm->w0;
 		w0 -= learn_rate * (multiplier + fm->reg0 * w0);//x.data[i].value disapear after derivative
 	}
+	if (binary) {
+		if (fm->k1) {
+			for (uint i = 0; i < x.size; i++) {
+				FM_MODEL_FLOAT& w = fm->w(x.data[i].id);
+				w -= learn_rate * (multiplier + fm->regw * w);
+			}
+		}
+		for (uint i = 0; i < x.size; i++) {
+			uint id = x.data[i].id;
+			for (int f = 0; f < fm->num_factor; f++) {
+				FM_MODEL_FLOAT& v = fm->v(f,id);
+				double grad = sum(f) - v;
+				v -= learn_rate * (multiplier * grad + fm->regv * v);
+			}
+		}
+		return;
+	}
 	if (fm->k1) {
 		for (uint i = 0; i < x.size; i++) {
-			double& w = fm->w(x.data[i].id);
+			FM_MODEL_FLOAT& w = fm->w(x.data[i].id);
 			w -= learn_rate * (multiplier * x.data[i].value + fm->regw * w);
 		}
 	}	
-	for (int f = 0; f < fm->num_factor; f++) {
-		for (uint i = 0; i < x.size; i++) {
-			double& v = fm->v(f,x.data[i].id);
-			double grad = sum(f) * x.data[i].value - v * x.data[i].value * x.data[i].value; 
+	for (uint i = 0; i < x.size; i++) {
+		uint id = x.data[i].id;
+		double x_i = x.data[i].value;
+		for (int f = 0; f < fm->num_factor; f++) {
+			FM_MODEL_FLOAT& v = fm->v(f,id);
+			double grad = sum(f) * x_i - v * x_i * x_i; 
 			v -= learn_rate * (multiplier * grad + fm->regv * v);
 		}
 	}	
 }
 		
-void fm_pairSGD(fm_model* fm, const double& learn_rate, sparse_row<DATA_FLOAT> &x_pos, sparse_row<DATA_FLOAT> &x_neg, const double multiplier, DVector<double> &sum_pos, DVector<double> &sum_neg, DVector<bool> &grad_visited, DVector<double> &grad) {
+// Lazy L2 regularization: the L2 term of the objective decays every parameter in every step,
+// theta <- (1 - learn_rate*reg) * theta, but fm_SGD and fm_pairSGD regularize only the attributes of
+// the current case. fm_lazy_reg applies the decay of the steps in which an attribute did not occur
+// in closed form, (1 - learn_rate*reg)^n, just before the attribute is used again, and catches up
+// all attributes at the end of an epoch. The cost stays that of the sparse update.
+class fm_lazy_reg {
+	public:
+		DVector<uint64> last_step; // last step whose decay has been applied to w(i) and v(.,i)
+		uint64 step;
+
+		void init(fm_model* fm, double learn_rate) {
+			last_step.setSize(fm->num_attribute);
+			last_step.init(0);
+			step = 0;
+			if ((learn_rate * fm->regw >= 1.0) || (learn_rate * fm->regv >= 1.0)) {
+				throw "lazy regularization needs learn_rate*reg < 1";
+			}
+			log_decay_w = std::log(1.0 - learn_rate * fm->regw);
+			log_decay_v = std::log(1.0 - learn_rate * fm->regv);
+			for (uint n = 0; n < DECAY_TABLE_SIZE; n++) {
+				decay_w[n] = std::exp(n * log_decay_w);
+				decay_v[n] = std::exp(n * log_decay_v);
+			}
+		}
+
+		// starts the next step; its own decay is applied by the SGD step to the attributes it touches
+		void next_step() { step++; }
+
+		// applies the pending decay of the attributes of x; call before x is predicted
+		void catch_up(fm_model* fm, sparse_row<DATA_FLOAT> &x) {
+			for (uint i = 0; i < x.size; i++) {
+				catch_up(fm, x.data[i].id);
+			}
+		}
+		void catch_up(fm_model* fm, uint id) {
+			if (last_step(id) + 1 < step) {
+				decay(fm, id, step - 1 - last_step(id));
+			}
+			last_step(id) = step;
+		}
+
+		// applies the pending decay of all attributes, e.g. at the end of an epoch
+		void catch_up_all(fm_model* fm) {
+			for (uint id = 0; id < fm->num_attribute; id++) {
+				if (last_step(id) < step) {
+					decay(fm, id, step - last_step(id));
+					last_step(id) = step;
+				}
+			}
+		}
+
+	protected:
+		static const uint DECAY_TABLE_SIZE = 1024; // the decay of short gaps is looked up
+		double log_decay_w, log_decay_v;
+		double decay_w[DECAY_TABLE_SIZE], decay_v[DECAY_TABLE_SIZE];
+
+		void decay(fm_model* fm, uint id, uint64 num_steps) {
+			bool in_table = (num_steps < DECAY_TABLE_SIZE);
+			if (fm->k1) {
+				fm->w(id) *= in_table ? decay_w[num_steps] : std::exp(num_steps * log_decay_w);
+			}
+			FM_MODEL_FLOAT factor_v = in_table ? decay_v[num_steps] : std::exp(num_steps * log_decay_v);
+			for (int f = 0; f < fm->num_factor; f++) {
+				fm->v(f,id) *= factor_v;
+			}
+		}
+};
+
+// Adaptive per-parameter learning rates for the elementwise SGD step. Every parameter has two
+// state values; the state of w(i) and v(.,i) is stored in one contiguous row
+//   state(i) = [ w(i): s0 s1 | v(0,i): s0 s1 | v(1,i): s0 s1 | ... ]
+// so a step on case x touches one state row per attribute of x, next to the same attributes of w/v.
+//  AdaGrad (Duchi et al., 2011): s0 = sum of squared gradients.
+//  FTRL-proximal (McMahan et al., 2013): s0 = n (sum of squared gradients), s1 = z. w0 and w are
+//    solved in closed form with l1 (exact zeros for w) and the L2 regularization regw/reg0; the
+//    closed form would start v at zero, where its gradient vanishes, so v uses AdaGrad.
+//  Adam (Kingma and Ba, 2015): s0 = first moment, s1 = second moment. Only the moments of the
+//    attributes of a case are updated (lazy Adam); the bias correction uses the number of steps.
+const int FM_OPT_SGD = 0;
+const int FM_OPT_ADAGRAD = 1;
+const int FM_OPT_FTRL = 2;
+const int FM_OPT_ADAM = 3;
+
+class fm_optimizer {
+	public:
+		int method;
+		double l1;        // FTRL: L1 regularization of w
+		double ftrl_beta; // FTRL: the learning rate of a parameter is learn_rate / (ftrl_beta + sqrt(n))
+		double beta1, beta2; // Adam: decay of the first and second moment
+		double epsilon;   // AdaGrad, Adam: added to the denominator
+		FM_MODEL_FLOAT w0_state[2];
+		DMatrix<FM_MODEL_FLOAT> state; // num_attribute x 2*(num_factor+1)
+		std::atomic<uint64> num_steps; // Adam: steps of all threads (Hogwild)
+
+		fm_optimizer() {
+			method = FM_OPT_SGD;
+			l1 = 0;
+			ftrl_beta = 1.0;
+			beta1 = 0.9;
+			beta2 = 0.999;
+			epsilon = 1e-8;
+			num_steps = 0;
+		}
+
+		// learn_rate is needed by FTRL: its z starts at the value that reproduces the current w0 and
+		// w (e.g. of a warm start) in the closed form with n = 0; for a new model w = 0 and z = 0
+		void init(fm_model* fm, double learn_rate) {
+			w0_state[0] = w0_state[1] = 0;
+			state.setSize(fm->num_attribute, 2 * (fm->num_factor + 1));
+			state.init(0);
+			num_steps = 0;
+			if (method == FM_OPT_FTRL) {
+				if (fm->k0) {
+					w0_state[1] = ftrl_z(fm->w0, learn_rate, 0, fm->reg0);
+				}
+				if (fm->k1) {
+					for (uint i = 0; i < fm->num_attribute; i++) {
+						state(i)[1] = ftrl_z(fm->w(i), learn_rate, l1, fm->regw);
+					}
+				}
+			}
+		}
+
+		std::string name() {
+			switch (method) {
+				case FM_OPT_ADAGRAD: return "adagrad";
+				case FM_OPT_FTRL: return "ftrl";
+				case FM_OPT_ADAM: return "adam";
+				default: return "sgd";
+			}
+		}
+
+		// the update of one parameter p with state s; g is the gradient of the loss plus the L2 term
+		inline void adagrad(FM_MODEL_FLOAT& p, FM_MODEL_FLOAT* s, double g, double learn_rate) {
+			s[0] += g*g;
+			p -= learn_rate * g / (std::sqrt((double) s[0]) + epsilon);
+		}
+		// learn_rate_t includes the bias correction of step t
+		inline void adam(FM_MODEL_FLOAT& p, FM_MODEL_FLOAT* s, double g, double learn_rate_t) {
+			s[0] = beta1 * s[0] + (1.0-beta1) * g;
+			s[1] = beta2 * s[1] + (1.0-beta2) * g*g;
+			p -= learn_rate_t * s[0] / (std::sqrt((double) s[1]) + epsilon);
+		}
+		// g is the gradient of the loss only; reg_l1 and reg_l2 enter the closed form
+		inline void ftrl(FM_MODEL_FLOAT& p, FM_MODEL_FLOAT* s, double g, double learn_rate, double reg_l1, double reg_l2) {
+			double n = s[0];
+			double sigma = (std::sqrt(n + g*g) - std::sqrt(n)) / learn_rate;
+			s[1] += g - sigma * p;
+			s[0] = n + g*g;
+			double z = s[1];
+			if (std::abs(z) <= reg_l1) {
+				p = 0;
+			} else {
+				p = -(z - ((z > 0) ? reg_l1 : -reg_l1)) / ((ftrl_beta + std::sqrt((double) s[0])) / learn_rate + reg_l2);
+			}
+		}
+
+		// the inverse of the closed form of ftrl for n = 0
+		inline double ftrl_z(double p, double learn_rate, double reg_l1, double reg_l2) {
+			if (p == 0) {
+				return 0;
+			}
+			return -p * (ftrl_beta / learn_rate + reg_l2) - ((p > 0) ? reg_l1 : -reg_l1);
+		}
+
+		// one step on case x; same arguments as fm_SGD
+		void SGD(fm_model* fm, const double& learn_rate, sparse_row<DATA_FLOAT> &x, const double multiplier, DVector<FM_MODEL_FLOAT> &sum) {
+			switch (method) {
+				case FM_OPT_ADAGRAD: step<FM_OPT_ADAGRAD>(fm, learn_rate, x, multiplier, sum); break;
+				case FM_OPT_FTRL: step<FM_OPT_FTRL>(fm, learn_rate, x, multiplier, sum); break;
+				case FM_OPT_ADAM: step<FM_OPT_ADAM>(fm, learn_rate, x, multiplier, sum); break;
+				default: throw "unknown optimizer";
+			}
+		}
+
+	protected:
+		template <int METHOD> void step(fm_model* fm, double learn_rate, sparse_row<DATA_FLOAT> &x, const double multiplier, DVector<FM_MODEL_FLOAT> &sum) {
+			if (METHOD == FM_OPT_ADAM) {
+				double t = num_steps.fetch_add(1, std::memory_order_relaxed) + 1;
+				learn_rate *= std::sqrt(1.0 - std::pow(beta2, t)) / (1.0 - std::pow(beta1, t));
+			}
+			if (fm->k0) {
+				FM_MODEL_FLOAT& w0 = fm->w0;
+				if (METHOD == FM_OPT_ADAGRAD) { adagrad(w0, w0_state, multiplier + fm->reg0 * w0, learn_rate); }
+				if (METHOD == FM_OPT_FTRL) { ftrl(w0, w0_state, multiplier, learn_rate, 0, fm->reg0); }
+				if (METHOD == FM_OPT_ADAM) { adam(w0, w0_state, multiplier + fm->reg0 * w0, learn_rate); }
+			}
+			for (uint i = 0; i < x.size; i++) {
+				uint id = x.data[i].id;
+				double x_i = x.data[i].value;
+				FM_MODEL_FLOAT* s = state(id);
+				if (fm->k1) {
+					FM_MODEL_FLOAT& w = fm->w(id);
+					if (METHOD == FM_OPT_ADAGRAD) { adagrad(w, s, multiplier * x_i + fm->regw * w, learn_rate); }
+					if (METHOD == FM_OPT_FTRL) { ftrl(w, s, multiplier * x_i, learn_rate, l1, fm->regw); }
+					if (METHOD == FM_OPT_ADAM) { adam(w, s, multiplier * x_i + fm->regw * w, learn_rate); }
+				}
+				for (int f = 0; f < fm->num_factor; f++) {
+					FM_MODEL_FLOAT& v = fm->v(f,id);
+					double grad = multiplier * (sum(f) * x_i - v * x_i * x_i) + fm->regv * v;
+					if (METHOD == FM_OPT_ADAM) {
+						adam(v, s + 2*(f+1), grad, learn_rate);
+					} else {
+						adagrad(v, s + 2*(f+1), grad, learn_rate);
+					}
+				}
+			}
+		}
+};
+
+void fm_pairSGD(fm_model* fm, const double& learn_rate, sparse_row<DATA_FLOAT> &x_pos, sparse_row<DATA_FLOAT> &x_neg, const double multiplier, DVector<FM_MODEL_FLOAT> &sum_pos, DVector<FM_MODEL_FLOAT> &sum_neg, DVector<bool> &grad_visited, DVector<double> &grad) {
 	if (fm->k0) {
-		double& w0 = fm->w0;
+		FM_MODEL_FLOAT& w0 = fm->w0;
 		w0 -= fm->reg0 * w0; // w0 should always be 0			
 	}
 	if (fm->k1) {
@@ -58,7 +291,7 @@ void fm_pairSGD(fm_model* fm, const double& learn_rate, sparse_row<DATA_FLOAT> &
 		for (uint i = 0; i < x_pos.size; i++) {
 			uint& attr_id = x_pos.data[i].id;
 			if (! grad_visited(attr_id)) {
-				double& w = fm->w(attr_id);
+				FM_MODEL_FLOAT& w = fm->w(attr_id);
 				w -= learn_rate * (multiplier * grad(attr_id) + fm->regw * w);
 				grad_visited(attr_id) = true;
 			}
@@ -66,7 +299,7 @@ void fm_pairSGD(fm_model* fm, const double& learn_rate, sparse_row<DATA_FLOAT> &
 		for (uint i = 0; i < x_neg.size; i++) {
 			uint& attr_id = x_neg.data[i].id;
 			if (! grad_visited(attr_id)) {
-				double& w = fm->w(attr_id);
+				FM_MODEL_FLOAT& w = fm->w(attr_id);
 				w -= learn_rate * (multiplier * grad(attr_id) + fm->regw * w);
 				grad_visited(attr_id) = true;
 			}
@@ -91,7 +324,7 @@ void fm_pairSGD(fm_model* fm, const double& learn_rate, sparse_row<DATA_FLOAT> &
 		for (uint i = 0; i < x_pos.size; i++) {
 			uint& attr_id = x_pos.data[i].id;
 			if (! grad_visited(attr_id)) {
-				double& v = fm->v(f,attr_id);
+				FM_MODEL_FLOAT& v = fm->v(f,attr_id);
 				v -= learn_rate * (multiplier * grad(attr_id) + fm->regv * v);
 				grad_visited(attr_id) = true;
 			}
@@ -99,7 +332,7 @@ void fm_pairSGD(fm_model* fm, const double& learn_rate, sparse_row<DATA_FLOAT> &
 		for (uint i = 0; i < x_neg.size; i++) {
 			uint& attr_id = x_neg.data[i].id;
 			if (! grad_visited(attr_id)) {
-				double& v = fm->v(f,attr_id);
+				FM_MODEL_FLOAT& v = fm->v(f,attr_id);
 				v -= learn_rate * (multiplier * grad(attr_id) + fm->regv * v);
 				grad_visited(attr_id) = true;
 			}
@@ -0,0 +1,364 @@
+/*
+	Vectorized kernels for Factorization Machines
+
+	The kernels compute sum_f = \sum_i v_if x_i and sum_sqr_f = \sum_i (v_if x_i)^2
+	for all factors f of a sparse case x (the inner part of fm_model::predict).
+	The factor v_if is read from v0[i*attr_step + f*factor_step], so the kernels
+	work for the factor-major (attr_step=1) and feature-major (factor_step=1)
+	layout of v. The vector kernels keep a block of factors in registers while
+	the nonzeros of x are traversed, so they need the factors of an attribute
+	to be contiguous: they are only selected if libFM is built with
+	FM_V_FEATURE_MAJOR (as libFM-predict is). For the default factor-major
+	layout, the scalar kernel is used and reported; gathering the factors of
+	an attribute from num_factor rows of v was measured to be slower than
+	sweeping the rows.
+
+	With BINARY, all values of x are 1.0 and the kernels skip the loads and
+	multiplications of the values; as x_i*v_if = v_if, the result is the same.
+
+	The kernels work on FM_MODEL_FLOAT, i.e. on double or, for a single precision
+	model, on float (twice as many factors per register).
+
+	The best kernel for the CPU is selected at runtime (AVX-512, AVX2, SSE2 or
+	scalar). No kernel uses fused multiply-add and every sum is accumulated in
+	the order of the nonzeros, so all kernels return exactly the same result.
+*/
+
+#ifndef FM_SIMD_H_
+#define FM_SIMD_H_
+
+#include <string>
+#include "../util/fmatrix.h"
+#include "fm_data.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define FM_SIMD_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*fm_sum_factors_func)(const FM_MODEL_FLOAT* v0, const uint64 attr_step, const uint64 factor_step, const sparse_row<FM_FLOAT>& x, FM_MODEL_FLOAT* sum, FM_MODEL_FLOAT* sum_sqr, const int num_factor);
+
+template <bool BINARY> void fm_sum_factors_scalar(const FM_MODEL_FLOAT* v0, const uint64 attr_step, const uint64 factor_step, const sparse_row<FM_FLOAT>& x, FM_MODEL_FLOAT* sum, FM_MODEL_FLOAT* sum_sqr, const int num_factor) {
+	if (attr_step == 1) {
+		// factor-major: sweep each row of v
+		for (int f = 0; f < num_factor; f++) {
+			const FM_MODEL_FLOAT* v = v0 + f * factor_step;
+			FM_MODEL_FLOAT s = 0, q = 0;
+			for (uint i = 0; i < x.size; i++) {
+				FM_MODEL_FLOAT d = BINARY ? v[x.data[i].id] : v[x.data[i].id] * x.data[i].value;
+				s += d;
+				q += d*d;
+			}
+			sum[f] = s;
+			sum_sqr[f] = q;
+		}
+		return;
+	}
+	for (int f = 0; f < num_factor; f++) {
+		sum[f] = 0;
+		sum_sqr[f] = 0;
+	}
+	for (uint i = 0; i < x.size; i++) {
+		const FM_MODEL_FLOAT* v = v0 + x.data[i].id * attr_step;
+		FM_MODEL_FLOAT x_i = x.data[i].value;
+		for (int f = 0; f < num_factor; f++) {
+			FM_MODEL_FLOAT d = BINARY ? v[f*factor_step] : v[f*factor_step] * x_i;
+			sum[f] += d;
+			sum_sqr[f] += d*d;
+		}
+	}
+}
+
+#ifdef FM_SIMD_X86
+
+// fp-contract=off: the compiler must not merge mul+add into fma (which AVX-512 implies)
+#define FM_SIMD_TARGET(isa) __attribute__((target(isa), optimize("fp-contract=off")))
+
+#ifndef FM_MODEL_SINGLE_PRECISION
+
+template <bool BINARY> FM_SIMD_TARGET("sse2")
+void fm_sum_factors_sse2(const double* v0, const uint64 attr_step, const uint64 factor_step, const sparse_row<FM_FLOAT>& x, double* sum, double* sum_sqr, const int num_factor) {
+	if (factor_step != 1) {
+		fm_sum_factors_scalar<BINARY>(v0, attr_step, factor_step, x, sum, sum_sqr, num_factor);
+		return;
+	}
+	int f = 0;
+	// blocks of 8 factors in 4 registers
+	for (; f + 8 <= num_factor; f += 8) {
+		__m128d s[4], q[4];
+		for (int r = 0; r < 4; r++) { s[r] = _mm_setzero_pd(); q[r] = _mm_setzero_pd(); }
+		for (uint i = 0; i < x.size; i++) {
+			const double* v = v0 + x.data[i].id * attr_step + f;
+			const __m128d vx = _mm_set1_pd(BINARY ? 1.0 : x.data[i].value);
+			for (int r = 0; r < 4; r++) {
+				__m128d d = _mm_loadu_pd(v + 2*r);
+				if (! BINARY) { d = _mm_mul_pd(d, vx); }
+				s[r] = _mm_add_pd(s[r], d);
+				q[r] = _mm_add_pd(q[r], _mm_mul_pd(d, d));
+			}
+		}
+		for (int r = 0; r < 4; r++) {
+			_mm_storeu_pd(sum + f + 2*r, s[r]);
+			_mm_storeu_pd(sum_sqr + f + 2*r, q[r]);
+		}
+	}
+	if (f < num_factor) {
+		fm_sum_factors_scalar<BINARY>(v0 + f, attr_step, factor_step, x, sum + f, sum_sqr + f, num_factor - f);
+	}
+}
+
+template <bool BINARY> FM_SIMD_TARGET("avx2")
+void fm_sum_factors_avx2(const double* v0, const uint64 attr_step, const uint64 factor_step, const sparse_row<FM_FLOAT>& x, double* sum, double* sum_sqr, const int num_factor) {
+	if (factor_step != 1) {
+		fm_sum_factors_scalar<BINARY>(v0, attr_step, factor_step, x, sum, sum_sqr, num_factor);
+		return;
+	}
+	int f = 0;
+	// blocks of 16 factors in 4 registers
+	for (; f + 16 <= num_factor; f += 16) {
+		__m256d s[4], q[4];
+		for (int r = 0; r < 4; r++) { s[r] = _mm256_setzero_pd(); q[r] = _mm256_setzero_pd(); }
+		for (uint i = 0; i < x.size; i++) {
+			const double* v = v0 + x.data[i].id * attr_step + f;
+			const __m256d vx = _mm256_set1_pd(BINARY ? 1.0 : x.data[i].value);
+			for (int r = 0; r < 4; r++) {
+				__m256d d = _mm256_loadu_pd(v + 4*r);
+				if (! BINARY) { d = _mm256_mul_pd(d, vx); }
+				s[r] = _mm256_add_pd(s[r], d);
+				q[r] = _mm256_add_pd(q[r], _mm256_mul_pd(d, d));
+			}
+		}
+		for (int r = 0; r < 4; r++) {
+			_mm256_storeu_pd(sum + f + 4*r, s[r]);
+			_mm256_storeu_pd(sum_sqr + f + 4*r, q[r]);
+		}
+	}
+	// blocks of 4 factors
+	for (; f + 4 <= num_factor; f += 4) {
+		__m256d s = _mm256_setzero_pd(), q = _mm256_setzero_pd();
+		for (uint i = 0; i < x.size; i++) {
+			const double* v = v0 + x.data[i].id * attr_step + f;
+			__m256d d = _mm256_loadu_pd(v);
+			if (! BINARY) { d = _mm256_mul_pd(d, _mm256_set1_pd(x.data[i].value)); }
+			s = _mm256_add_pd(s, d);
+			q = _mm256_add_pd(q, _mm256_mul_pd(d, d));
+		}
+		_mm256_storeu_pd(sum + f, s);
+		_mm256_storeu_pd(sum_sqr + f, q);
+	}
+	if (f < num_factor) {
+		fm_sum_factors_scalar<BINARY>(v0 + f, attr_step, factor_step, x, sum + f, sum_sqr + f, num_factor - f);
+	}
+}
+
+template <bool BINARY> FM_SIMD_TARGET("avx512f")
+void fm_sum_factors_avx512(const double* v0, const uint64 attr_step, const uint64 factor_step, const sparse_row<FM_FLOAT>& x, double* sum, double* sum_sqr, const int num_factor) {
+	if (factor_step != 1) {
+		fm_sum_factors_scalar<BINARY>(v0, attr_step, factor_step, x, sum, sum_sqr, num_factor);
+		return;
+	}
+	int f = 0;
+	// blocks of 32 factors in 4 registers
+	for (; f + 32 <= num_factor; f += 32) {
+		__m512d s[4], q[4];
+		for (int r = 0; r < 4; r++) { s[r] = _mm512_setzero_pd(); q[r] = _mm512_setzero_pd(); }
+		for (uint i = 0; i < x.size; i++) {
+			const double* v = v0 + x.data[i].id * attr_step + f;
+			const __m512d vx = _mm512_set1_pd(BINARY ? 1.0 : x.data[i].value);
+			for (int r = 0; r < 4; r++) {
+				__m512d d = _mm512_loadu_pd(v + 8*r);
+				if (! BINARY) { d = _mm512_mul_pd(d, vx); }
+				s[r] = _mm512_add_pd(s[r], d);
+				q[r] = _mm512_add_pd(q[r], _mm512_mul_pd(d, d));
+			}
+		}
+		for (int r = 0; r < 4; r++) {
+			_mm512_storeu_pd(sum + f + 8*r, s[r]);
+			_mm512_storeu_pd(sum_sqr + f + 8*r, q[r]);
+		}
+	}
+	// blocks of up to 8 factors (masked)
+	for (; f < num_factor; f += 8) {
+		__mmask8 mask = (num_factor - f >= 8) ? (__mmask8) 0xFF : (__mmask8) ((1 << (num_factor - f)) - 1);
+		__m512d s = _mm512_setzero_pd(), q = _mm512_setzero_pd();
+		for (uint i = 0; i < x.size; i++) {
+			const double* v = v0 + x.data[i].id * attr_step + f;
+			__m512d d = _mm512_maskz_loadu_pd(mask, v);
+			if (! BINARY) { d = _mm512_mul_pd(d, _mm512_set1_pd(x.data[i].value)); }
+			s = _mm512_add_pd(s, d);
+			q = _mm512_add_pd(q, _mm512_mul_pd(d, d));
+		}
+		_mm512_mask_storeu_pd(sum + f, mask, s);
+		_mm512_mask_storeu_pd(sum_sqr + f, mask, q);
+	}
+}
+
+#else
+
+template <bool BINARY> FM_SIMD_TARGET("sse2")
+void fm_sum_factors_sse2(const float* v0, const uint64 attr_step, const uint64 factor_step, const sparse_row<FM_FLOAT>& x, float* sum, float* sum_sqr, const int num_factor) {
+	if (factor_step != 1) {
+		fm_sum_factors_scalar<BINARY>(v0, attr_step, factor_step, x, sum, sum_sqr, num_factor);
+		return;
+	}
+	int f = 0;
+	// blocks of 16 factors in 4 registers
+	for (; f + 16 <= num_factor; f += 16) {
+		__m128 s[4], q[4];
+		for (int r = 0; r < 4; r++) { s[r] = _mm_setzero_ps(); q[r] = _mm_setzero_ps(); }
+		for (uint i = 0; i < x.size; i++) {
+			const float* v = v0 + x.data[i].id * attr_step + f;
+			const __m128 vx = _mm_set1_ps(BINARY ? 1.0 : x.data[i].value);
+			for (int r = 0; r < 4; r++) {
+				__m128 d = _mm_loadu_ps(v + 4*r);
+				if (! BINARY) { d = _mm_mul_ps(d, vx); }
+				s[r] = _mm_add_ps(s[r], d);
+				q[r] = _mm_add_ps(q[r], _mm_mul_ps(d, d));
+			}
+		}
+		for (int r = 0; r < 4; r++) {
+			_mm_storeu_ps(sum + f + 4*r, s[r]);
+			_mm_storeu_ps(sum_sqr + f + 4*r, q[r]);
+		}
+	}
+	if (f < num_factor) {
+		fm_sum_factors_scalar<BINARY>(v0 + f, attr_step, factor_step, x, sum + f, sum_sqr + f, num_factor - f);
+	}
+}
+
+template <bool BINARY> FM_SIMD_TARGET("avx2")
+void fm_sum_factors_avx2(const float* v0, const uint64 attr_step, const uint64 factor_step, const sparse_row<FM_FLOAT>& x, float* sum, float* sum_sqr, const int num_factor) {
+	if (factor_step != 1) {
+		fm_sum_factors_scalar<BINARY>(v0, attr_step, factor_step, x, sum, sum_sqr, num_factor);
+		return;
+	}
+	int f = 0;
+	// blocks of 32 factors in 4 registers
+	for (; f + 32 <= num_factor; f += 32) {
+		__m256 s[4], q[4];
+		for (int r = 0; r < 4; r++) { s[r] = _mm256_setzero_ps(); q[r] = _mm256_setzero_ps(); }
+		for (uint i = 0; i < x.size; i++) {
+			const float* v = v0 + x.data[i].id * attr_step + f;
+			const __m256 vx = _mm256_set1_ps(BINARY ? 1.0 : x.data[i].value);
+			for (int r = 0; r < 4; r++) {
+				__m256 d = _mm256_loadu_ps(v + 8*r);
+				if (! BINARY) { d = _mm256_mul_ps(d, vx); }
+				s[r] = _mm256_add_ps(s[r], d);
+				q[r] = _mm256_add_ps(q[r], _mm256_mul_ps(d, d));
+			}
+		}
+		for (int r = 0; r < 4; r++) {
+			_mm256_storeu_ps(sum + f + 8*r, s[r]);
+			_mm256_storeu_ps(sum_sqr + f + 8*r, q[r]);
+		}
+	}
+	// blocks of 8 factors
+	for (; f + 8 <= num_factor; f += 8) {
+		__m256 s = _mm256_setzero_ps(), q = _mm256_setzero_ps();
+		for (uint i = 0; i < x.size; i++) {
+			const float* v = v0 + x.data[i].id * attr_step + f;
+			__m256 d = _mm256_loadu_ps(v);
+			if (! BINARY) { d = _mm256_mul_ps(d, _mm256_set1_ps(x.data[i].value)); }
+			s = _mm256_add_ps(s, d);
+			q = _mm256_add_ps(q, _mm256_mul_ps(d, d));
+		}
+		_mm256_storeu_ps(sum + f, s);
+		_mm256_storeu_ps(sum_sqr + f, q);
+	}
+	if (f < num_factor) {
+		fm_sum_factors_scalar<BINARY>(v0 + f, attr_step, factor_step, x, sum + f, sum_sqr + f, num_factor - f);
+	}
+}
+
+template <bool BINARY> FM_SIMD_TARGET("avx512f")
+void fm_sum_factors_avx512(const float* v0, const uint64 attr_step, const uint64 factor_step, const sparse_row<FM_FLOAT>& x, float* sum, float* sum_sqr, const int num_factor) {
+	if (factor_step != 1) {
+		fm_sum_factors_scalar<BINARY>(v0, attr_step, factor_step, x, sum, sum_sqr, num_factor);
+		return;
+	}
+	int f = 0;
+	// blocks of 64 factors in 4 registers
+	for (; f + 64 <= num_factor; f += 64) {
+		__m512 s[4], q[4];
+		for (int r = 0; r < 4; r++) { s[r] = _mm512_setzero_ps(); q[r] = _mm512_setzero_ps(); }
+		for (uint i = 0; i < x.size; i++) {
+			const float* v = v0 + x.data[i].id * attr_step + f;
+			const __m512 vx = _mm512_set1_ps(BINARY ? 1.0 : x.data[i].value);
+			for (int r = 0; r < 4; r++) {
+				__m512 d = _mm512_loadu_ps(v + 16*r);
+				if (! BINARY) { d = _mm512_mul_ps(d, vx); }
+				s[r] = _mm512_add_ps(s[r], d);
+				q[r] = _mm512_add_ps(q[r], _mm512_mul_ps(d, d));
+			}
+		}
+		for (int r = 0; r < 4; r++) {
+			_mm512_storeu_ps(sum + f + 16*r, s[r]);
+			_mm512_storeu_ps(sum_sqr + f + 16*r, q[r]);
+		}
+	}
+	// blocks of up to 16 factors (masked)
+	for (; f < num_factor; f += 16) {
+		__mmask16 mask = (num_factor - f >= 16) ? (__mmask16) 0xFFFF : (__mmask16) ((1 << (num_factor - f)) - 1);
+		__m512 s = _mm512_setzero_ps(), q = _mm512_setzero_ps();
+		for (uint i = 0; i < x.size; i++) {
+			const float* v = v0 + x.data[i].id * attr_step + f;
+			__m512 d = _mm512_maskz_loadu_ps(mask, v);
+			if (! BINARY) { d = _mm512_mul_ps(d, _mm512_set1_ps(x.data[i].value)); }
+			s = _mm512_add_ps(s, d);
+			q = _mm512_add_ps(q, _mm512_mul_ps(d, d));
+		}
+		_mm512_mask_storeu_ps(sum + f, mask, s);
+		_mm512_mask_storeu_ps(sum_sqr + f, mask, q);
+	}
+}
+
+#endif
+
+#endif
+
+class fm_simd {
+	public:
+		fm_sum_factors_func sum_factors;
+		fm_sum_factors_func sum_factors_binary; // for rows whose values are all 1.0
+		std::string name;
+
+		static fm_simd& getInstance() {
+			static fm_simd instance;
+			return instance;
+		}
+
+		// isa: "auto", "avx512", "avx2", "sse2" or "scalar"; falls back to the best one the CPU supports
+		// and to scalar for the factor-major layout of v
+		void select(const std::string& isa) {
+			if ((isa != "auto") && (isa != "avx512") && (isa != "avx2") && (isa != "sse2") && (isa != "scalar")) {
+				throw "unknown simd instruction set " + isa;
+			}
+			sum_factors = &fm_sum_factors_scalar<false>;
+			sum_factors_binary = &fm_sum_factors_scalar<true>;
+			name = "scalar";
+			if (isa == "scalar") { return; }
+			#if defined(FM_SIMD_X86) && defined(FM_V_FEATURE_MAJOR)
+			__builtin_cpu_init();
+			if (__builtin_cpu_supports("sse2")) {
+				sum_factors = &fm_sum_factors_sse2<false>;
+				sum_factors_binary = &fm_sum_factors_sse2<true>;
+				name = "sse2";
+			}
+			if (__builtin_cpu_supports("avx2") && (isa != "sse2")) {
+				sum_factors = &fm_sum_factors_avx2<false>;
+				sum_factors_binary = &fm_sum_factors_avx2<true>;
+				name = "avx2";
+			}
+			if (__builtin_cpu_supports("avx512f") && (isa != "sse2") && (isa != "avx2")) {
+				sum_factors = &fm_sum_factors_avx512<false>;
+				sum_factors_binary = &fm_sum_factors_avx512<true>;
+				name = "avx512";
+			}
+			#endif
+		}
+
+	private:
+		fm_simd() { select("auto"); }
+};
+
+#endif /*FM_SIMD_H_*/
@@ -30,6 +30,8 @@
 #include "src/fm_learn_sgd.h"
 #include "src/fm_learn_sgd_element.h"
 #include "src/fm_learn_sgd_element_adapt_reg.h"
+#include "src/fm_learn_sgd_batch.h"
+#include "src/fm_learn_sgd_pair.h"
 #include "src/fm_learn_mcmc_simultaneous.h"
 
 
@@ -37,7 +39,6 @@ using namespace std;
 
 int main(int argc, char **argv) {
     
-    srand ( time(NULL) );
     try {
         CMDLine cmdline(argc, argv);
         std::cout << "----------------------------------------------------------------------------" << std::endl;
@@ -61,7 +62,16 @@ int main(int argc, char **argv) {
         const std::string param_num_iter	= cmdline.registerParameter("iter", "number of iterations; default=100");
         const std::string param_learn_rate	= cmdline.registerParameter("learn_rate", "learn_rate for SGD; default=0.1");
         
-        const std::string param_method		= cmdline.registerParameter("method", "learning method (SGD, SGDA, ALS, MCMC); default=MCMC");
+        const std::string param_method		= cmdline.registerParameter("method", "learning method (SGD, SGD_BATCH, SGD_PAIR, SGDA, ADAGRAD, FTRL, ADAM, ALS, MCMC); default=MCMC");
+        const std::string param_batch_size	= cmdline.registerParameter("batch_size", "number of rows per update for SGD_BATCH; default=256");
+        const std::string param_item_group	= cmdline.registerParameter("item_group", "SGD_PAIR: attribute group (see meta) of the item attributes; negatives replace the item of a positive row; default=none, negatives are rows with a non-positive target");
+        const std::string param_neg_sampling	= cmdline.registerParameter("neg_sampling", "SGD_PAIR: 'uniform' or 'popularity' (items by their number of positive rows, needs item_group); default=uniform");
+        const std::string param_rank_k	= cmdline.registerParameter("rank_k", "SGD_PAIR: cutoff k of Precision@k and NDCG@k (reported with item_group; without it, accuracy and AUC over all rows); default=10");
+        const std::string param_l1		= cmdline.registerParameter("l1", "L1 regularization of the 1-way interactions for FTRL; default=0");
+        const std::string param_lazy_reg	= cmdline.registerParameter("lazy_reg", "1=apply the L2 regularization of SGD, SGD_BATCH and SGD_PAIR to all parameters in every step (lazily, in closed form when an attribute is used again) instead of only to the attributes of the current case; default=0");
+        const std::string param_eval_train	= cmdline.registerParameter("eval_train", "SGD methods: compute the training error every N iterations (and after the last one); 0=never; default=1");
+        const std::string param_eval_train_sample	= cmdline.registerParameter("eval_train_sample", "SGD methods: compute the training error on a fixed random sample of this many rows; default=all rows");
+        const std::string param_ftrl_beta	= cmdline.registerParameter("ftrl_beta", "beta of the per-coordinate learning rate learn_rate/(beta+sqrt(n)) for FTRL; default=1");
         
         const std::string param_verbosity	= cmdline.registerParameter("verbosity", "how much infos to print; default=0");
         const std::string param_r_log		= cmdline.registerParameter("rlog", "write measurements within iterations to a file; default=''");
@@ -70,6 +80,15 @@ int main(int argc, char **argv) {
         const std::string param_relation	= cmdline.registerParameter("relation", "BS: filenames for the relations, default=''");
         
         const std::string param_cache_size = cmdline.registerParameter("cache_size", "cache size for data storage (only applicable if data is in binary format), default=infty");
+        const std::string param_mmap = cmdline.registerParameter("mmap", "1=map binary data files into memory instead of reading them through the cache; default=0");
+        const std::string param_prefetch_buffers = cmdline.registerParameter("prefetch_buffers", "number of buffers the cache is split into if the binary data does not fit into it; the next buffers are read in the background; default=2");
+        const std::string param_direct_io = cmdline.registerParameter("direct_io", "1=read binary data that does not fit into the cache with O_DIRECT (bypassing the page cache); default=0");
+        const std::string param_simd = cmdline.registerParameter("simd", "vector instructions for prediction: auto, avx512, avx2, sse2 or scalar; default=auto");
+        const std::string param_threads = cmdline.registerParameter("threads", "number of threads for loading, SGD (Hogwild), evaluation and MCMC/ALS sampling; default=all cores for loading, 1 for learning");
+        const std::string param_seed = cmdline.registerParameter("seed", "seed of the random number generator (initialization, sampling); default=current time");
+        const std::string param_save_model = cmdline.registerParameter("save_model", "filename for writing the learned model (binary)");
+        const std::string param_load_model = cmdline.registerParameter("load_model", "filename of a model written with save_model; the test data is predicted with it without learning (the model is mapped if mmap=1)");
+        const std::string param_warm_start = cmdline.registerParameter("warm_start", "filename of a model written with save_model to continue learning from (SGD, ALS and MCMC incl. its hyperparameters; ADAGRAD, FTRL and ADAM start with empty gradient sums, FTRL from the loaded bias and 1-way interactions); attributes that are not in the model are initialized like a new model");
         
         
         const std::string param_do_sampling	= "do_sampling";
@@ -96,6 +115,34 @@ int main(int argc, char **argv) {
                 cmdline.setValue(param_do_multilevel, "0");
             }
         }
+        unsigned long long seed = time(NULL);
+        if (cmdline.hasParameter(param_seed)) {
+            seed = strtoull(cmdline.getValue(param_seed).c_str(), NULL, 10);
+        }
+        ran_seed(seed);
+        if (cmdline.hasParameter(param_threads)) {
+            int num_threads = cmdline.getValue(param_threads, 1);
+            if (num_threads < 1) { throw "threads has to be at least 1"; }
+            set_num_threads(num_threads);
+        }
+        if (cmdline.hasParameter(param_simd)) {
+            fm_simd::getInstance().select(cmdline.getValue(param_simd));
+        }
+        if (cmdline.hasParameter(param_prefetch_buffers)) {
+            int num_buffers = cmdline.getValue(param_prefetch_buffers, 2);
+            if (num_buffers < 1) { throw "prefetch_buffers has to be at least 1"; }
+            fmatrix_io_settings::getInstance().num_buffers = num_buffers;
+        }
+        fmatrix_io_settings::getInstance().direct_io = cmdline.getValue(param_direct_io, 0) != 0;
+        if (cmdline.getValue(param_verbosity, 0) > 0) {
+            std::cout << "simd=" << fm_simd::getInstance().name << std::endl;
+            std::cout << "seed=" << seed << std::endl;
+        }
+        
+        // the SGD methods learn from the rows only
+        const bool sgd_method =
+            ! cmdline.getValue(param_method).compare("sgd") || ! cmdline.getValue(param_method).compare("sgd_batch") || ! cmdline.getValue(param_method).compare("sgd_pair") || ! cmdline.getValue(param_method).compare("sgda") ||
+            ! cmdline.getValue(param_method).compare("adagrad") || ! cmdline.getValue(param_method).compare("ftrl") || ! cmdline.getValue(param_method).compare("adam");
         
         /* (1) Load the data    */
         std::cout << "Loading train...\t" << std::endl;
@@ -107,7 +154,8 @@ int main(int argc, char **argv) {
         Data train(
                    cmdline.getValue(param_cache_size, 0),
                    ! (!cmdline.getValue(param_method).compare("mcmc")), // no original data for mcmc
-                   ! (!cmdline.getValue(param_method).compare("sgd") || !cmdline.getValue(param_method).compare("sgda")) // no transpose data for sgd, sgda
+                   ! sgd_method, // no transpose data for the SGD methods
+                   cmdline.getValue(param_mmap, 0) != 0
                    );
         train.load(cmdline.getValue(param_train_file));
         if (cmdline.getValue(param_verbosity, 0) > 0) { train.debug(); }
@@ -115,8 +163,9 @@ int main(int argc, char **argv) {
         std::cout << "Loading test... \t" << std::endl;
         Data test(
                   cmdline.getValue(param_cache_size, 0),
-                  ! (!cmdline.getValue(param_method).compare("mcmc")), // no original data for mcmc
-                  ! (!cmdline.getValue(param_method).compare("sgd") || !cmdline.getValue(param_method).compare("sgda")) // no transpose data for sgd, sgda
+                  ! (!cmdline.getValue(param_method).compare("mcmc")) || cmdline.hasParameter(param_load_model), // no original data for mcmc (unless a loaded model predicts it)
+                  ! sgd_method, // no transpose data for the SGD methods
+                  cmdline.getValue(param_mmap, 0) != 0
                   );
         test.load(cmdline.getValue(param_test_file));
         if (cmdline.getValue(param_verbosity, 0) > 0) { test.debug(); }
@@ -131,7 +180,8 @@ int main(int argc, char **argv) {
                 validation = new Data(
                                       cmdline.getValue(param_cache_size, 0),
                                       ! (!cmdline.getValue(param_method).compare("mcmc")), // no original data for mcmc
-                                      ! (!cmdline.getValue(param_method).compare("sgd") || !cmdline.getValue(param_method).compare("sgda")) // no transpose data for sgd, sgda
+                                      ! sgd_method, // no transpose data for the SGD methods
+                                      cmdline.getValue(param_mmap, 0) != 0
                                       );
                 validation->load(cmdline.getValue(param_val_file));
                 if (cmdline.getValue(param_verbosity, 0) > 0) { validation->debug(); }
@@ -152,12 +202,16 @@ int main(int argc, char **argv) {
             relation(i) = new RelationData(
                                            cmdline.getValue(param_cache_size, 0),
                                            ! (!cmdline.getValue(param_method).compare("mcmc")), // no original data for mcmc
-                                           ! (!cmdline.getValue(param_method).compare("sgd") || !cmdline.getValue(param_method).compare("sgda")) // no transpose data for sgd, sgda
+                                           ! sgd_method, // no transpose data for the SGD methods
+                                           cmdline.getValue(param_mmap, 0) != 0
                                            );
             relation(i)->load(rel[i]);
             train.relation(i).data = relation(i);
             test.relation(i).data = relation(i);
             train.relation(i).load(rel[i] + ".train", train.num_cases);
+            if (! sgd_method) {
+                train.relation(i).build_inverse_index(); // grouped aggregation of the MCMC/ALS caches
+            }
             test.relation(i).load(rel[i] + ".test", test.num_cases);
         }
         
@@ -169,6 +223,21 @@ int main(int argc, char **argv) {
         if (validation != NULL) {
             num_all_attribute = std::max(num_all_attribute, (uint) validation->num_feature);
         }
+        // a model to continue from covers at least its own attributes
+        const bool warm_start = cmdline.hasParameter(param_warm_start);
+        fm_model warm_model;
+        fm_model_file* warm_file = NULL;
+        if (warm_start) {
+            if (cmdline.hasParameter(param_load_model)) {
+                throw "load_model and warm_start can not be used together";
+            }
+            std::cout << "Loading model for warm start...\t" << std::endl;
+            warm_file = new fm_model_file(cmdline.getValue(param_warm_start), false);
+            warm_model.load(warm_file); // warm_model owns the file
+            if (relation.dim == 0) {
+                num_all_attribute = std::max(num_all_attribute, warm_model.num_attribute);
+            }
+        }
         DataMetaInfo meta_main(num_all_attribute);
         if (cmdline.hasParameter(param_meta_file)) {
             meta_main.loadGroupsFromFile(cmdline.getValue(param_meta_file));
@@ -206,6 +275,10 @@ int main(int argc, char **argv) {
         
         
         meta.num_relations = train.relation.dim;
+        if (warm_start && (relation.dim > 0) && (warm_model.num_attribute != num_all_attribute)) {
+            // the attributes of the relations follow the ones of the main table
+            throw "with relations, warm_start needs data with the same attributes as the model";
+        }
         
         /* (2) Setup the factorization machine */
         fm_model fm;
@@ -223,7 +296,17 @@ int main(int argc, char **argv) {
         //w0 = 0
         //w1~wp = 0
         //v<1,1> ~ v<p,k> = ran_gaussian(mean, stdev);
-        fm.init();
+        fm_model_file* model_file = NULL;
+        if (cmdline.hasParameter(param_load_model)) {
+            std::cout << "Loading model...\t" << std::endl;
+            model_file = new fm_model_file(cmdline.getValue(param_load_model), cmdline.getValue(param_mmap, 0) != 0);
+            fm.load(model_file); // fm owns the file
+            if (fm.num_attribute < num_all_attribute) {
+                throw "the data has more attributes than the loaded model";
+            }
+        } else {
+            fm.init();
+        }
         
         // (3) Setup the learning method:
         fm_learn* fml;
@@ -231,6 +314,40 @@ int main(int argc, char **argv) {
             fml = new fm_learn_sgd_element();
             ((fm_learn_sgd*)fml)->num_iter = cmdline.getValue(param_num_iter, 100);
             
+        } else if (! cmdline.getValue(param_method).compare("sgd_batch")) {
+            fml = new fm_learn_sgd_batch();
+            ((fm_learn_sgd*)fml)->num_iter = cmdline.getValue(param_num_iter, 100);
+            int batch_size = cmdline.getValue(param_batch_size, 256);
+            if (batch_size < 1) { throw "batch_size has to be at least 1"; }
+            ((fm_learn_sgd_batch*)fml)->batch_size = batch_size;
+            
+        } else if (! cmdline.getValue(param_method).compare("sgd_pair")) {
+            fml = new fm_learn_sgd_pair();
+            ((fm_learn_sgd*)fml)->num_iter = cmdline.getValue(param_num_iter, 100);
+            ((fm_learn_sgd_pair*)fml)->item_group = cmdline.getValue(param_item_group, -1);
+            std::string neg_sampling = cmdline.getValue(param_neg_sampling, "uniform");
+            if (neg_sampling.compare("uniform") && neg_sampling.compare("popularity")) {
+                throw "neg_sampling has to be uniform or popularity";
+            }
+            ((fm_learn_sgd_pair*)fml)->neg_popularity = ! neg_sampling.compare("popularity");
+            int rank_k = cmdline.getValue(param_rank_k, 10);
+            if (rank_k < 1) { throw "rank_k has to be at least 1"; }
+            ((fm_learn_sgd_pair*)fml)->rank_k = rank_k;
+            
+        } else if (! cmdline.getValue(param_method).compare("adagrad") || ! cmdline.getValue(param_method).compare("ftrl") || ! cmdline.getValue(param_method).compare("adam")) {
+            fml = new fm_learn_sgd_element();
+            ((fm_learn_sgd*)fml)->num_iter = cmdline.getValue(param_num_iter, 100);
+            fm_optimizer& optimizer = ((fm_learn_sgd*)fml)->optimizer;
+            if (! cmdline.getValue(param_method).compare("adagrad")) {
+                optimizer.method = FM_OPT_ADAGRAD;
+            } else if (! cmdline.getValue(param_method).compare("ftrl")) {
+                optimizer.method = FM_OPT_FTRL;
+                optimizer.l1 = cmdline.getValue(param_l1, 0.0);
+                optimizer.ftrl_beta = cmdline.getValue(param_ftrl_beta, 1.0);
+            } else {
+                optimizer.method = FM_OPT_ADAM;
+            }
+            
         } else if (! cmdline.getValue(param_method).compare("sgda")) {
             assert(validation != NULL);
             fml = new fm_learn_sgd_element_adapt_reg();
@@ -240,7 +357,9 @@ int main(int argc, char **argv) {
         } else if (! cmdline.getValue(param_method).compare("mcmc")) {
             //use mcmc method
             //init w1 ~ wp via N(μ,σ2)
-            fm.w.init_normal(fm.init_mean, fm.init_stdev);
+            if (model_file == NULL) {
+                fm.w.init_normal(fm.init_mean, fm.init_stdev);
+            }
             fml = new fm_learn_mcmc_simultaneous(); //fm_learn_mcmc_simultaneous inherits from fm_learn_mcmc
             fml->validation = validation;
             ((fm_learn_mcmc*)fml)->num_iter = cmdline.getValue(param_num_iter, 100);//默认迭代一百次
@@ -250,36 +369,28 @@ int main(int argc, char **argv) {
         } else {
             throw "unknown method";
         }
+        if (warm_start) {
+            fm.warm_start(warm_model);
+        }
         fml->fm = &fm;//set the fm model
         fml->max_target = train.max_target;
         fml->min_target = train.min_target;
         fml->meta = &meta;
+        fml->num_threads = cmdline.getValue(param_threads, 1);
         if (! cmdline.getValue("task").compare("r") ) {//regression
             fml->task = 0;
         } else if (! cmdline.getValue("task").compare("c") ) {//classfication
             fml->task = 1;
             //遍历所有target的值，如果是分类问题，将target < 0.0的设置为1
             for (uint i = 0; i < train.target.dim; i++){
-                if (train.target(i) <= 0.0){
-                    train.target(i) = -1.0;
-                } else{
-                    train.target(i) = 1.0;
-                }
+                train.target(i) = binary_metrics::is_positive(train.target(i)) ? 1.0 : -1.0;
             }
             for (uint i = 0; i < test.target.dim; i++) {
-                if (test.target(i) <= 0.0) {
-                    test.target(i) = -1.0;
-                } else {
-                    test.target(i) = 1.0;
-                }
+                test.target(i) = binary_metrics::is_positive(test.target(i)) ? 1.0 : -1.0;
             }
             if (validation != NULL) {
                 for (uint i = 0; i < validation->target.dim; i++) {
-                    if (validation->target(i) <= 0.0) {
-                        validation->target(i) = -1.0;
-                    } else {
-                        validation->target(i) = 1.0;
-                    }
+                    validation->target(i) = binary_metrics::is_positive(validation->target(i)) ? 1.0 : -1.0;
                 }
             }
         } else {
@@ -385,9 +496,28 @@ int main(int argc, char **argv) {
                 fmlsgd->learn_rates(1) = lr[1];
                 fmlsgd->learn_rates(2) = lr[2];
             }
+            fmlsgd->eval_train_every = cmdline.getValue(param_eval_train, 1);
+            fmlsgd->eval_train_sample = cmdline.getValue(param_eval_train_sample, 0);
+            if (cmdline.getValue(param_lazy_reg, 0) != 0) {
+                if (cmdline.getValue(param_method).compare("sgd") && cmdline.getValue(param_method).compare("sgd_batch") && cmdline.getValue(param_method).compare("sgd_pair")) {
+                    throw "lazy_reg is only supported for SGD, SGD_BATCH and SGD_PAIR";
+                }
+                fmlsgd->lazy_reg = true;
+            }
             
         }
         
+        if (model_file != NULL) {
+            fml->load(*model_file);
+        }
+        if (warm_start) {
+            // hyperparameters of MCMC; the range of the targets covers the old and the new data
+            double min_target = fml->min_target, max_target = fml->max_target;
+            fml->load(*warm_file);
+            fml->min_target = std::min(min_target, fml->min_target);
+            fml->max_target = std::max(max_target, fml->max_target);
+        }
+        
         if (rlog != NULL) {
             rlog->init();
         }
@@ -399,20 +529,49 @@ int main(int argc, char **argv) {
         
         // () learn，MCMC调用的是fm_learn_mcmc.h
         //如果是mcmc，将使用上文 fml = new fm_learn_mcmc_simultaneous(); //fm_learn_mcmc_simultaneous inherits from fm_learn_mcmc
-        fml->learn(train, test);
+        if (model_file == NULL) {
+            fml->learn(train, test);
+        }
+        
+        // () I/O of data that is streamed through the cache
+        {
+            Data* streamed[2] = { &train, &test };
+            const char* name[2] = { "train", "test" };
+            for (int i = 0; i < 2; i++) {
+                fmatrix_io_stats io;
+                LargeSparseMatrix<DATA_FLOAT>* m = (streamed[i]->data != NULL) ? streamed[i]->data : streamed[i]->data_t;
+                if ((m != NULL) && m->getIOStats(io)) {
+                    std::cout << "I/O " << name[i] << ":\tpasses=" << io.passes << "\tread=" << (io.bytes_read / (1024.0*1024.0)) << "MB in " << io.read_time << "s"
+                              << "\tstall=" << io.stall_time << "s\tcompute=" << (io.pass_time - io.stall_time) << "s" << std::endl;
+                }
+            }
+        }
         
         // () Prediction at the end  (not for mcmc and als)
         if (cmdline.getValue(param_method).compare("mcmc")) {
-            std::cout << "Final\t" << "Train=" << fml->evaluate(train) << "\tTest=" << fml->evaluate(test) << std::endl;
+            std::cout << "Final\t" << "Train" << fml->evaluate_label() << "=" << fml->evaluate(train) << "\tTest" << fml->evaluate_label() << "=" << fml->evaluate(test) << fml->report_metrics() << std::endl;
         }
         
         // () Save prediction
         if (cmdline.hasParameter(param_out)) {
             DVector<double> pred;
             pred.setSize(test.num_cases);
-            fml->predict(test, pred);
+            if (model_file == NULL) {
+                fml->predict(test, pred);
+            } else {
+                fml->predict_model(test, pred);
+            }
             pred.save(cmdline.getValue(param_out));
         }
+        
+        // () Save the model
+        if (cmdline.hasParameter(param_save_model)) {
+            fm_model_file_writer out;
+            fm.save(out);
+            fml->save(out);
+            out.write(cmdline.getValue(param_save_model));
+            std::cout << "Model written to " << cmdline.getValue(param_save_model) << std::endl;
+        }
     } catch (std::string &e) {
         std::cerr << std::endl << "ERROR: " << e << std::endl;
     } catch (char const* &e) {
@@ -11,6 +11,7 @@
 #define DATA_H_
 
 #include <limits>
+#include "../../util/util.h"
 #include "../../util/matrix.h"
 #include "../../util/fmatrix.h"
 #include "../../fm_core/fm_data.h"
@@ -56,24 +57,33 @@ public:
 };
 
 #include "relation.h"
+#include "text_parser.h"
 
 class Data {
 protected:
     uint64 cache_size;
     bool has_xt;
     bool has_x;
+    bool use_mmap;
+    
+    LargeSparseMatrix<DATA_FLOAT>* openBinaryFile(std::string filename, uint64 cache_size) {
+        return openLargeSparseMatrix<DATA_FLOAT>(filename, cache_size, use_mmap);
+    }
 public:
-    Data(uint64 cache_size, bool has_x, bool has_xt) {
+    Data(uint64 cache_size, bool has_x, bool has_xt, bool use_mmap = false) {
         this->data_t = NULL;
         this->data = NULL;
         this->cache_size = cache_size;
         this->has_x = has_x;
         this->has_xt = has_xt;
+        this->use_mmap = use_mmap;
+        this->is_binary = false;
     }
     
     LargeSparseMatrix<DATA_FLOAT>* data_t;//data的转置，【猜测】：每一个column应该代表一个instance，每个row代表一个feature吧，猜测
     LargeSparseMatrix<DATA_FLOAT>* data;//保存所有的feature id和value的值，
     DVector<DATA_FLOAT> target;//保存所有instance的y值
+    bool is_binary; // all values of x are 1.0, the learners use the kernels for binary features
     
     int num_feature;
     uint num_cases;
@@ -95,15 +105,16 @@ void Data::load(std::string filename) {
 	std::cout << "has xt = " << has_xt << std::endl;
 	assert(has_x || has_xt);
     
+	// with memory mapped files, a missing transpose file is created in memory from the mapped x
 	int load_from = 0;
 	if ((! has_x || fileexists(filename + ".data")) &&
-        (! has_xt || fileexists(filename + ".datat")) &&
+        (! has_xt || fileexists(filename + ".datat") || (use_mmap && fileexists(filename + ".data"))) &&
         fileexists(filename + ".target")) {
         
 		load_from = 1;
         
 	} else if ((! has_x || fileexists(filename + ".x")) &&
-               (! has_xt || fileexists(filename + ".xt")) &&
+               (! has_xt || fileexists(filename + ".xt") || (use_mmap && fileexists(filename + ".x"))) &&
                fileexists(filename + ".y")) {
         
 		load_from = 2;
@@ -112,24 +123,23 @@ void Data::load(std::string filename) {
     
     //如果不是从二进制文件读进来，load_from = 0
 	if (load_from > 0) {
-		uint num_values = 0;
+		uint64 num_values = 0;
 		uint64 this_cs = cache_size;
 		if (has_xt && has_x) {
             this_cs /= 2;
         }
+		std::string filename_x = filename + ((load_from == 1) ? ".data" : ".x");
+		std::string filename_xt = filename + ((load_from == 1) ? ".datat" : ".xt");
+		bool do_create_data_t = has_xt && ! fileexists(filename_xt);
 		
 		if (load_from == 1) {
 			this->target.loadFromBinaryFile(filename + ".target");//为什么从二进制文件里面读？
 		} else {
 			this->target.loadFromBinaryFile(filename + ".y");
 		}
-		if (has_x) {
+		if (has_x || do_create_data_t) {
 			std::cout << "data... ";
-			if (load_from == 1) {
-				this->data = new LargeSparseMatrixHD<DATA_FLOAT>(filename + ".data", this_cs);
-			} else {
-				this->data = new LargeSparseMatrixHD<DATA_FLOAT>(filename + ".x", this_cs);
-			}
+			this->data = openBinaryFile(filename_x, this_cs);
 			assert(this->target.dim == this->data->getNumRows());
 			this->num_feature = this->data->getNumCols();
 			num_values = this->data->getNumValues();
@@ -138,10 +148,10 @@ void Data::load(std::string filename) {
 		}
 		if (has_xt) {
 			std::cout << "data transpose... ";
-			if (load_from == 1) {
-				this->data_t = new LargeSparseMatrixHD<DATA_FLOAT>(filename + ".datat", this_cs);
+			if (do_create_data_t) {
+				create_data_t();
 			} else {
-				this->data_t = new LargeSparseMatrixHD<DATA_FLOAT>(filename + ".xt", this_cs);
+				this->data_t = openBinaryFile(filename_xt, this_cs);
 			}
 			this->num_feature = this->data_t->getNumRows();
 			num_values = this->data_t->getNumValues();
@@ -161,8 +171,9 @@ void Data::load(std::string filename) {
 			max_target = std::max(this->target(i), max_target);
 		}
 		num_cases = target.dim;
+		is_binary = (has_x ? this->data : this->data_t)->isBinary();
         
-		std::cout << "num_cases=" << this->num_cases << "\tnum_values=" << num_values << "\tnum_features=" << this->num_feature << "\tmin_target=" << min_target << "\tmax_target=" << max_target << std::endl;
+		std::cout << "num_cases=" << this->num_cases << "\tnum_values=" << num_values << "\tnum_features=" << this->num_feature << "\tmin_target=" << min_target << "\tmax_target=" << max_target << "\tbinary=" << is_binary << std::endl;
 		return;
 	}
     
@@ -170,120 +181,95 @@ void Data::load(std::string filename) {
 	
 	DVector< sparse_row<DATA_FLOAT> >& data = ((LargeSparseMatrixMemory<DATA_FLOAT>*)this->data)->data;
     
-	int num_rows = 0;//记录train数据有多少行
-	uint64 num_values = 0;//记录 稀疏的数据 中一共有多少位置有值 （放心，有生之年这个值应该不会溢出）
-	num_feature = 0;
-	bool has_feature = false;
-	min_target = +std::numeric_limits<DATA_FLOAT>::max();
-	max_target = -std::numeric_limits<DATA_FLOAT>::max();
+	double load_time = getwalltime();
 	
-	// (1) determine the number of rows and the maximum feature_id
-	{
-		std::ifstream fData(filename.c_str());
-		if (! fData.is_open()) {
-			throw "unable to open " + filename;
+	// (1) split the file into ranges of complete lines and count their rows and values in parallel (no parsing)
+	uint64 file_size = text_file_size(filename);
+	int num_chunks = get_num_threads();
+	DVector<uint64> chunk_begin(num_chunks+1);
+	for (int i = 0; i < num_chunks; i++) {
+		chunk_begin(i) = text_find_line_begin(filename, file_size / num_chunks * i, file_size);
+	}
+	chunk_begin(num_chunks) = file_size;
+	
+	std::vector<text_chunk> chunk(num_chunks);
+	std::vector<std::string> chunk_error(num_chunks);
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (int i = 0; i < num_chunks; i++) {
+		try {
+			chunk[i].count_only = true;
+			chunk[i].parseFile(filename, chunk_begin(i), chunk_begin(i+1));
+		} catch (std::string &e) {
+			chunk_error[i] = e;
 		}
-		DATA_FLOAT _value;
-		int nchar, _feature;
-		while (!fData.eof()) {
-			std::string line;
-			std::getline(fData, line);
-			const char *pline = line.c_str();
-			while ((*pline == ' ')  || (*pline == 9)) {// skip leading spaces
-                pline++;
-            }
-			if ((*pline == 0)  || (*pline == '#')) { // skip empty rows
-                continue;
-            }
-            
-            //处理每一行的时候，先读取target，然后读取每一个feature，注意这里只是搜索检查一遍数据，并未真正保存
-			if (sscanf(pline, "%f%n", &_value, &nchar) >=1) {//%n 的含义是返回从该次 XXscanf 调用开始到此读了多少个字节
-				pline += nchar;
-				min_target = std::min(_value, min_target);
-				max_target = std::max(_value, max_target);
-				num_rows++;
-				while (sscanf(pline, "%d:%f%n", &_feature, &_value, &nchar) >= 2) {
-					pline += nchar;
-					num_feature = std::max(_feature, num_feature);//_feature是第x特征的的编号
-					has_feature = true;
-					num_values++;
-				}
-				while ((*pline != 0) && ((*pline == ' ')  || (*pline == 9))) { pline++; } // skip trailing spaces
-				if ((*pline != 0)  && (*pline != '#')) {
-					throw "cannot parse line \"" + line + "\" at character " + pline[0];
-				}
-			} else {
-				throw "cannot parse line \"" + line + "\" at character " + pline[0];
-			}
+	}
+	for (int i = 0; i < num_chunks; i++) {
+		if (chunk_error[i].size() > 0) {
+			throw chunk_error[i];
 		}
-		fData.close();
 	}
-    
-	if (has_feature) {
-		num_feature++; // number of feature is bigger (by one) than the largest value，因为从0开始
+	
+	// (2) prefix sums over the chunks give the position of each chunk in the row table and in the cache
+	DVector<uint> chunk_row_offset(num_chunks+1);
+	DVector<uint64> chunk_value_offset(num_chunks+1);
+	chunk_row_offset(0) = 0;
+	chunk_value_offset(0) = 0;
+	for (int i = 0; i < num_chunks; i++) {
+		chunk_row_offset(i+1) = chunk_row_offset(i) + chunk[i].num_rows;
+		chunk_value_offset(i+1) = chunk_value_offset(i) + chunk[i].num_values;
 	}
-	std::cout << "num_rows=" << num_rows << "\tnum_values=" << num_values << "\tnum_features=" << num_feature << "\tmin_target=" << min_target << "\tmax_target=" << max_target << std::endl;
+	uint num_rows = chunk_row_offset(num_chunks);
+	uint64 num_values = chunk_value_offset(num_chunks);
+	
 	data.setSize(num_rows);
 	target.setSize(num_rows);
 	
-	((LargeSparseMatrixMemory<DATA_FLOAT>*)this->data)->num_cols = num_feature;
-	((LargeSparseMatrixMemory<DATA_FLOAT>*)this->data)->num_values = num_values;
-    
 	MemoryLog::getInstance().logNew("data_float", sizeof(sparse_entry<DATA_FLOAT>), num_values);
 	sparse_entry<DATA_FLOAT>* cache = new sparse_entry<DATA_FLOAT>[num_values];//cache相当于data的缓存，用来读入feature:value数据
 	
-	// (2) read the data
+	// (3) parse each chunk directly to its position
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (int i = 0; i < num_chunks; i++) {
+		try {
+			uint rows = chunk_row_offset(i+1) - chunk_row_offset(i);
+			uint64 values = chunk_value_offset(i+1) - chunk_value_offset(i);
+			chunk[i].count_only = false;
+			chunk[i].setOutput(target.value + chunk_row_offset(i), data.value + chunk_row_offset(i), cache + chunk_value_offset(i), rows, values);
+			chunk[i].parseFile(filename, chunk_begin(i), chunk_begin(i+1));
+			if ((chunk[i].num_rows != rows) || (chunk[i].num_values != values)) {
+				throw std::string("the file has changed while reading");
+			}
+		} catch (std::string &e) {
+			chunk_error[i] = e;
+		}
+	}
+	for (int i = 0; i < num_chunks; i++) {
+		if (chunk_error[i].size() > 0) {
+			throw chunk_error[i];
+		}
+	}
+	num_feature = 0;
+	min_target = +std::numeric_limits<DATA_FLOAT>::max();
+	max_target = -std::numeric_limits<DATA_FLOAT>::max();
+	for (int i = 0; i < num_chunks; i++) {
+		num_feature = std::max((int) chunk[i].num_feature, num_feature);
+		min_target = std::min(chunk[i].min_target, min_target);
+		max_target = std::max(chunk[i].max_target, max_target);
+	}
+	std::cout << "num_rows=" << num_rows << "\tnum_values=" << num_values << "\tnum_features=" << num_feature << "\tmin_target=" << min_target << "\tmax_target=" << max_target << std::endl;
+	((LargeSparseMatrixMemory<DATA_FLOAT>*)this->data)->num_cols = num_feature;
+	((LargeSparseMatrixMemory<DATA_FLOAT>*)this->data)->num_values = num_values;
+	
+	bool has_value = false; // a value that is not 1.0
+	#pragma omp parallel for reduction(||:has_value)
+	for (long long i = 0; i < (long long) num_values; i++) {
+		has_value = has_value || (cache[i].value != 1.0);
+	}
+	is_binary = ! has_value;
 	
-    std::ifstream fData(filename.c_str());
-    if (! fData.is_open()) {
-        throw "unable to open " + filename;
-    }
-    int row_id = 0;
-    uint64 cache_id = 0;
-    DATA_FLOAT _value;
-    int nchar, _feature;
-    
-    //依次读取每一行
-    while (!fData.eof()) {
-        std::string line;
-        std::getline(fData, line);
-        const char *pline = line.c_str();
-        while ((*pline == ' ')  || (*pline == 9)) { pline++; } // skip leading spaces
-        if ((*pline == 0)  || (*pline == '#')) { continue; }  // skip empty rows
-        if (sscanf(pline, "%f%n", &_value, &nchar) >=1) {
-            pline += nchar;
-            assert(row_id < num_rows);
-            target.value[row_id] = _value;
-            
-            //cache用来缓存读取到data
-            data.value[row_id].data = &(cache[cache_id]);
-            data.value[row_id].size = 0;
-            
-            //依次读取每一个feature_id:value
-            while (sscanf(pline, "%d:%f%n", &_feature, &_value, &nchar) >= 2) {
-                pline += nchar;
-                assert(cache_id < num_values);
-                cache[cache_id].id = _feature;
-                cache[cache_id].value = _value;
-                cache_id++;
-                data.value[row_id].size++;
-            }
-            row_id++;
-            
-            while ((*pline != 0) && ((*pline == ' ')  || (*pline == 9))) { pline++; } // skip trailing spaces
-            if ((*pline != 0)  && (*pline != '#')) {
-                throw "cannot parse line \"" + line + "\" at character " + pline[0];
-            }
-        } else {
-            throw "cannot parse line \"" + line + "\" at character " + pline[0];
-        }
-    }
-    fData.close();
-    
-    assert(num_rows == row_id);
-    assert(num_values == cache_id);
+	load_time = getwalltime() - load_time;
+	std::cout << "load time=" << load_time << "s\tthroughput=" << (file_size / (1024.0*1024.0)) / load_time << " MB/s\tthreads=" << num_chunks << "\tbinary=" << is_binary << std::endl;
 	
-    
 	num_cases = target.dim;
     
     //如果是MCMC，那么有data_t，就是在这里创建
@@ -293,9 +279,11 @@ void Data::load(std::string filename) {
 }
 
 void Data::create_data_t() {
-    //这里还没有研究data_t的具体结构
-	// for creating transpose data, the data has to be memory-data because we use random access
-	DVector< sparse_row<DATA_FLOAT> >& data = ((LargeSparseMatrixMemory<DATA_FLOAT>*)this->data)->data;
+	// for creating transpose data, the data has to support random access (memory or memory mapped data)
+	assert(this->data->hasRandomAccess());
+	LargeSparseMatrix<DATA_FLOAT>& data = *(this->data);
+	uint num_rows = data.getNumRows();
+	num_feature = data.getNumCols();
     
 	data_t = new LargeSparseMatrixMemory<DATA_FLOAT>();
     
@@ -309,15 +297,16 @@ void Data::create_data_t() {
 	num_values_per_column.setSize(num_feature);
 	num_values_per_column.init(0);
 	long long num_values = 0;
-	for (uint i = 0; i < data.dim; i++) {
-		for (uint j = 0; j < data(i).size; j++) {
-			num_values_per_column(data(i).data[j].id)++;
+	for (uint i = 0; i < num_rows; i++) {
+		sparse_row<DATA_FLOAT> row = data.getRowAt(i);
+		for (uint j = 0; j < row.size; j++) {
+			num_values_per_column(row.data[j].id)++;
 			num_values++;
 		}
 	}
     
     
-	((LargeSparseMatrixMemory<DATA_FLOAT>*)this->data_t)->num_cols = data.dim;
+	((LargeSparseMatrixMemory<DATA_FLOAT>*)this->data_t)->num_cols = num_rows;
 	((LargeSparseMatrixMemory<DATA_FLOAT>*)this->data_t)->num_values = num_values;
     
 	// create data structure for values
@@ -331,13 +320,14 @@ void Data::create_data_t() {
 	}
 	// write the data into the transpose matrix
 	num_values_per_column.init(0); // num_values per column now contains the pointer on the first empty field
-	for (uint i = 0; i < data.dim; i++) {
-		for (uint j = 0; j < data(i).size; j++) {
-			uint f_id = data(i).data[j].id;
+	for (uint i = 0; i < num_rows; i++) {
+		sparse_row<DATA_FLOAT> row = data.getRowAt(i);
+		for (uint j = 0; j < row.size; j++) {
+			uint f_id = row.data[j].id;
 			uint cntr = num_values_per_column(f_id);
 			assert(cntr < (uint) data_t(f_id).size);
 			data_t(f_id).data[cntr].id = i;
-			data_t(f_id).data[cntr].value = data(i).data[j].value;
+			data_t(f_id).data[cntr].value = row.data[j].value;
 			num_values_per_column(f_id)++;
 		}
 	}
@@ -11,20 +11,22 @@
 #define FM_LEARN_H_
 
 #include <cmath>
+#include <vector>
 #include "Data.h"
 #include "../../fm_core/fm_model.h"
 #include "../../util/rlog.h"
+#include "../../util/metrics.h"
 #include "../../util/util.h"
 
 
 class fm_learn {
 	protected:
-		DVector<double> sum, sum_sqr;
+		DVector<FM_MODEL_FLOAT> sum, sum_sqr;
 		DMatrix<double> pred_q_term;
 		
 		// this function can be overwritten (e.g. for MCMC)
 		virtual double predict_case(Data& data) {
-			return fm->predict(data.data->getRow());
+			return fm->predict(data.data->getRow(), data.is_binary);
 		}
 		
 	public:
@@ -40,10 +42,14 @@ class fm_learn {
  
 		Data* validation;	
 
+		int num_threads; // number of worker threads for learning
+
+		binary_metrics eval_metrics; // metrics of the last evaluate of a classification task
+
 
 		RLog* log;
 
-		fm_learn() { log = NULL; task = 0; meta = NULL;} 
+		fm_learn() { log = NULL; task = 0; meta = NULL; num_threads = 1; } 
 		
 		
 		virtual void init() {
@@ -53,6 +59,10 @@ class fm_learn {
 					log->addField("mae", std::numeric_limits<double>::quiet_NaN());
 				} else if (task == TASK_CLASSIFICATION) {
 					log->addField("accuracy", std::numeric_limits<double>::quiet_NaN());
+					log->addField("auc", std::numeric_limits<double>::quiet_NaN());
+					log->addField("logloss", std::numeric_limits<double>::quiet_NaN());
+					log->addField("ne", std::numeric_limits<double>::quiet_NaN());
+					log->addField("calibration", std::numeric_limits<double>::quiet_NaN());
 				} else {
 					throw "unknown task";
 				}
@@ -77,11 +87,87 @@ class fm_learn {
 			}
 		}
 
+		// RMSE (regression) or accuracy (classification) of the rows 'rows' of data, e.g. a sample;
+		// unlike evaluate, nothing is logged
+		double evaluate_rows(Data& data, const std::vector<uint>& rows) {
+			double sum_sqr_err, sum_abs_err;
+			uint num_correct;
+			evaluate_sums(data, &rows, sum_sqr_err, sum_abs_err, num_correct, NULL);
+			if (task == TASK_REGRESSION) {
+				return std::sqrt(sum_sqr_err / rows.size());
+			} else {
+				return (double) num_correct / rows.size();
+			}
+		}
+
 	public:
+		// AUC, logloss, NE and calibration of the last evaluate for the iteration report; empty for regression
+		virtual std::string report_metrics() {
+			if (task != TASK_CLASSIFICATION) {
+				return "";
+			}
+			return "\t" + eval_metrics.report("Test");
+		}
+
+		// what evaluate returns if it is neither the RMSE nor the accuracy, e.g. "(NDCG@10)"; added to the Train=/Test= labels
+		virtual std::string evaluate_label() {
+			return "";
+		}
+
 		virtual void learn(Data& train, Data& test) { }
 		
 		virtual void predict(Data& data, DVector<double>& out) = 0;
 		
+		// predicts with the current parameters of the model only (e.g. a loaded model);
+		// MCMC and ALS use the average over all samples in predict instead
+		virtual void predict_model(Data& data, DVector<double>& out) {
+			assert(data.data != NULL);
+			assert(data.data->getNumRows() == out.dim);
+			if (predict_parallel(data)) {
+				#pragma omp parallel num_threads(num_threads)
+				{
+					DVector<FM_MODEL_FLOAT> thread_sum(fm->num_factor), thread_sum_sqr(fm->num_factor);
+					#pragma omp for schedule(static)
+					for (int i = 0; i < (int) data.data->getNumRows(); i++) {
+						sparse_row<DATA_FLOAT> x = data.data->getRowAt(i);
+						out(i) = transform_prediction(fm->predict(x, thread_sum, thread_sum_sqr, data.is_binary));
+					}
+				}
+				return;
+			}
+			for (data.data->begin(); !data.data->end(); data.data->next()) {
+				out(data.data->getRowIndex()) = transform_prediction(fm->predict(data.data->getRow(), data.is_binary));
+			}
+		}
+		
+		// maps the output of the model to a prediction of the task
+		virtual double transform_prediction(double p) {
+			if (task == TASK_REGRESSION ) {
+				p = std::min(max_target, p);
+				p = std::max(min_target, p);
+			} else if (task == TASK_CLASSIFICATION) {
+				p = 1.0/(1.0 + exp(-p));
+			} else {
+				throw "task not supported";
+			}
+			return p;
+		}
+		
+		// the model parameters are written by fm_model::save; this adds what the learner needs for prediction
+		virtual void save(fm_model_file_writer& out) {
+			out.addScalar("task", task);
+			out.addScalar("min_target", min_target);
+			out.addScalar("max_target", max_target);
+		}
+		
+		virtual void load(fm_model_file& in) {
+			if ((int) in.getScalar("task") != task) {
+				throw "the model was learned for a different task";
+			}
+			min_target = in.getScalar("min_target");
+			max_target = in.getScalar("max_target");
+		}
+		
 		virtual void debug() { 
 			std::cout << "task=" << task << std::endl;
 			std::cout << "min_target=" << min_target << std::endl;
@@ -89,37 +175,93 @@ class fm_learn {
 		}
 
 	protected:
+		// rows are predicted by several threads (with fm->predict like the default predict_case)
+		// if the learner has more than one thread and the rows of the data can be accessed directly
+		bool predict_parallel(Data& data) {
+			return (num_threads > 1) && data.data->hasRandomAccess();
+		}
+
+		// sums of the squared and absolute errors (regression; the prediction is clipped to the
+		// target range) and the number of correct signs (classification) of the rows 'rows' of data;
+		// all rows if rows is NULL. If metrics is not NULL, the probabilities are added to it.
+		void evaluate_sums(Data& data, const std::vector<uint>* rows, double& sum_sqr_err, double& sum_abs_err, uint& num_correct, binary_metrics* metrics) {
+			double err_sqr = 0, err_abs = 0;
+			uint correct = 0;
+			if (predict_parallel(data) || (rows != NULL)) {
+				if (! data.data->hasRandomAccess()) {
+					throw "evaluating selected rows needs data with random access";
+				}
+				int num_rows = (rows != NULL) ? rows->size() : data.data->getNumRows();
+				#pragma omp parallel num_threads(num_threads) reduction(+:err_sqr,err_abs,correct)
+				{
+					DVector<FM_MODEL_FLOAT> thread_sum(fm->num_factor), thread_sum_sqr(fm->num_factor);
+					binary_metrics* thread_metrics = (metrics != NULL) ? new binary_metrics() : NULL;
+					#pragma omp for schedule(static)
+					for (int i = 0; i < num_rows; i++) {
+						uint row_index = (rows != NULL) ? (*rows)[i] : i;
+						sparse_row<DATA_FLOAT> x = data.data->getRowAt(row_index);
+						double p = fm->predict(x, thread_sum, thread_sum_sqr, data.is_binary);
+						add_error(p, data.target(row_index), err_sqr, err_abs, correct);
+						if (thread_metrics != NULL) {
+							thread_metrics->add(transform_prediction(p), binary_metrics::is_positive(data.target(row_index)));
+						}
+					}
+					if (thread_metrics != NULL) {
+						#pragma omp critical
+						metrics->merge(*thread_metrics);
+						delete thread_metrics;
+					}
+				}
+			} else {
+				for (data.data->begin(); !data.data->end(); data.data->next()) {
+					double p = predict_case(data);
+					add_error(p, data.target(data.data->getRowIndex()), err_sqr, err_abs, correct);
+					if (metrics != NULL) {
+						metrics->add(transform_prediction(p), binary_metrics::is_positive(data.target(data.data->getRowIndex())));
+					}
+				}
+			}
+			sum_sqr_err = err_sqr;
+			sum_abs_err = err_abs;
+			num_correct = correct;
+		}
+
+		inline void add_error(double p, double target, double& err_sqr, double& err_abs, uint& correct) {
+			if (((p >= 0) && (target >= 0)) || ((p < 0) && (target < 0))) {
+				correct++;
+			}
+			p = std::min(max_target, p);
+			p = std::max(min_target, p);
+			double err = p - target;
+			err_sqr += err*err;
+			err_abs += std::abs(err);
+		}
+
 		virtual double evaluate_classification(Data& data) {
-			int num_correct = 0;
-			double eval_time = getusertime();
-			for (data.data->begin(); !data.data->end(); data.data->next()) {
-				double p = predict_case(data);
-				if (((p >= 0) && (data.target(data.data->getRowIndex()) >= 0)) || ((p < 0) && (data.target(data.data->getRowIndex()) < 0))) {
-					num_correct++;
-				}	
-			}	
-			eval_time = (getusertime() - eval_time);
+			double sum_sqr_err, sum_abs_err;
+			uint num_correct;
+			double eval_time = getwalltime();
+			eval_metrics.clear();
+			evaluate_sums(data, NULL, sum_sqr_err, sum_abs_err, num_correct, &eval_metrics);
+			eval_time = (getwalltime() - eval_time);
 			// log the values
 			if (log != NULL) {
 				log->log("accuracy", (double) num_correct / (double) data.data->getNumRows());
+				log->log("auc", eval_metrics.auc());
+				log->log("logloss", eval_metrics.logloss());
+				log->log("ne", eval_metrics.normalized_entropy());
+				log->log("calibration", eval_metrics.calibration());
 				log->log("time_pred", eval_time);
 			}
 
 			return (double) num_correct / (double) data.data->getNumRows();
 		}
 		virtual double evaluate_regression(Data& data) {
-			double rmse_sum_sqr = 0;
-			double mae_sum_abs = 0;
-			double eval_time = getusertime();
-			for (data.data->begin(); !data.data->end(); data.data->next()) {
-				double p = predict_case(data); 
-				p = std::min(max_target, p);
-				p = std::max(min_target, p);
-				double err = p - data.target(data.data->getRowIndex());
-				rmse_sum_sqr += err*err;
-				mae_sum_abs += std::abs((double)err);	
-			}	
-			eval_time = (getusertime() - eval_time);
+			double rmse_sum_sqr, mae_sum_abs;
+			uint num_correct;
+			double eval_time = getwalltime();
+			evaluate_sums(data, NULL, rmse_sum_sqr, mae_sum_abs, num_correct, NULL);
+			eval_time = (getwalltime() - eval_time);
 			// log the values
 			if (log != NULL) {
 				log->log("rmse", std::sqrt(rmse_sum_sqr/data.data->getNumRows()));
@@ -22,19 +22,60 @@
 #include <sstream>
 
 
-struct e_q_term {
-	double e;
-	double q;
+// The per-case terms are stored as structure of arrays: most passes touch only one of them
+// (e.g. draw_w reads only e), so no memory bandwidth is spent on the others.
+// Compile with -DMCMC_CACHE_SINGLE_PRECISION to store them as float (half the memory).
+#ifdef MCMC_CACHE_SINGLE_PRECISION
+typedef float MCMC_CACHE_FLOAT;
+#else
+typedef double MCMC_CACHE_FLOAT;
+#endif
+
+struct e_q_cache {
+	MCMC_CACHE_FLOAT* e;
+	MCMC_CACHE_FLOAT* q;
+
+	void allocate(uint num_cases) {
+		MemoryLog::getInstance().logNew("e_q_cache", 2 * sizeof(MCMC_CACHE_FLOAT), num_cases);
+		e = new MCMC_CACHE_FLOAT[num_cases];
+		q = new MCMC_CACHE_FLOAT[num_cases];
+	}
+	void free(uint num_cases) {
+		MemoryLog::getInstance().logFree("e_q_cache", 2 * sizeof(MCMC_CACHE_FLOAT), num_cases);
+		delete[] e;
+		delete[] q;
+	}
 };
 
 struct relation_cache {
-	double /*uint*/ wnum;      // #
-	double q;      // q_if^B
-	double wc;      // c_if^B
-	double wc_sqr;  // c_if^B,S
-	double y;      // y_i^B
-	double we;      // e_i
-	double weq;     // e_if^B,q
+	MCMC_CACHE_FLOAT* /*uint*/ wnum;      // #
+	MCMC_CACHE_FLOAT* q;      // q_if^B
+	MCMC_CACHE_FLOAT* wc;      // c_if^B
+	MCMC_CACHE_FLOAT* wc_sqr;  // c_if^B,S
+	MCMC_CACHE_FLOAT* y;      // y_i^B
+	MCMC_CACHE_FLOAT* we;      // e_i
+	MCMC_CACHE_FLOAT* weq;     // e_if^B,q
+
+	void allocate(uint num_cases) {
+		MemoryLog::getInstance().logNew("relation_cache", 7 * sizeof(MCMC_CACHE_FLOAT), num_cases);
+		wnum = new MCMC_CACHE_FLOAT[num_cases];
+		q = new MCMC_CACHE_FLOAT[num_cases];
+		wc = new MCMC_CACHE_FLOAT[num_cases];
+		wc_sqr = new MCMC_CACHE_FLOAT[num_cases];
+		y = new MCMC_CACHE_FLOAT[num_cases];
+		we = new MCMC_CACHE_FLOAT[num_cases];
+		weq = new MCMC_CACHE_FLOAT[num_cases];
+	}
+	void free(uint num_cases) {
+		MemoryLog::getInstance().logFree("relation_cache", 7 * sizeof(MCMC_CACHE_FLOAT), num_cases);
+		delete[] wnum;
+		delete[] q;
+		delete[] wc;
+		delete[] wc_sqr;
+		delete[] y;
+		delete[] we;
+		delete[] weq;
+	}
 };
 
 class fm_learn_mcmc : public fm_learn {
@@ -45,6 +86,13 @@ protected:
         throw "not supported for MCMC and ALS";
     }
 public:
+    // classification uses the probit link
+    virtual double transform_prediction(double p) {
+        if (task == TASK_CLASSIFICATION) {
+            return cdf_gaussian(p);
+        }
+        return fm_learn::transform_prediction(p);
+    }
     uint num_iter;//默认迭代一百次
     uint num_eval_cases;//目前是test instances 的数量
     
@@ -74,10 +122,20 @@ protected:
     DVector<double> pred_sum_all_but5;  //维数 = test集 instances 数，初始化为全 0.0，第五轮之后开始累加
     DVector<double> pred_this;          //维数 = test集 instances 数，初始化为全 0.0，当前这一轮的e，不累加
     
-    e_q_term* cache;
-    e_q_term* cache_test;
+    e_q_cache cache;
+    e_q_cache cache_test;
+    
+    DVector<relation_cache> rel_cache;
     
-    DVector<relation_cache*> rel_cache;
+    // colour classes of the features of the main table for parallel sampling (num_threads > 1):
+    // colour c consists of the features colour_feature(colour_begin(c)) ... colour_feature(colour_begin(c+1)-1)
+    static const uint MAX_COLOURS = 64; // features that get no colour form one more class that is drawn sequentially
+    DVector<uint> colour_feature;
+    DVector<uint> colour_begin;
+    uint num_colours;
+    bool has_uncoloured;
+    
+    bool binary_train; // all values of the training data are 1.0: draw_w and draw_v skip the multiplications with x
     
     virtual void _learn(Data& train, Data& test) {};
 	
@@ -87,9 +145,54 @@ protected:
      It stores the prediction in the e-term.对，证实了我的猜测，将\hat{y}保存在e中
 
      这里的predict的计算应该是公式（5）
+     Without relations, a dataset whose rows are in memory (text data or -mmap) is predicted row by
+     row in one pass with fm_model::predict (k-wide scratch per thread, cases in parallel). Otherwise
+     the transpose data is traversed once per factor (see predict_data_t_and_write_to_eterms).
      */
-    void predict_data_and_write_to_eterms(DVector<Data*>& main_data, DVector<e_q_term*>& main_cache) {
+    void predict_data_and_write_to_eterms(DVector<Data*>& main_data, DVector<e_q_cache>& main_cache) {
+        
+        assert(main_data.dim == main_cache.dim);
+        if (main_data.dim == 0) { return ; }
         
+        DVector<RelationJoin>& relation = main_data(0)->relation;
+        if (relation.dim > 0) {
+            predict_data_t_and_write_to_eterms(main_data, main_cache);
+            return;
+        }
+        // the datasets without rows in memory are predicted from the transpose data
+        uint num_t = 0;
+        for (uint ds = 0; ds < main_data.dim; ds++) {
+            if ((main_data(ds)->data == NULL) || ! main_data(ds)->data->hasRandomAccess()) { num_t++; }
+        }
+        DVector<Data*> t_data(num_t);
+        DVector<e_q_cache> t_cache(num_t);
+        num_t = 0;
+        for (uint ds = 0; ds < main_cache.dim; ds++) {
+            Data* m_data = main_data(ds);
+            if ((m_data->data == NULL) || ! m_data->data->hasRandomAccess()) {
+                t_data(num_t) = m_data;
+                t_cache(num_t) = main_cache(ds);
+                num_t++;
+                continue;
+            }
+            e_q_cache& m_cache = main_cache(ds);
+            #pragma omp parallel num_threads(num_threads) if (num_threads > 1)
+            {
+                DVector<FM_MODEL_FLOAT> thread_sum(fm->num_factor), thread_sum_sqr(fm->num_factor);
+                #pragma omp for schedule(static)
+                for (int c = 0; c < (int) m_data->num_cases; c++) {
+                    sparse_row<DATA_FLOAT> x = m_data->data->getRowAt(c);
+                    m_cache.e[c] = fm->predict(x, thread_sum, thread_sum_sqr, m_data->is_binary);
+                    m_cache.q[c] = 0.0;
+                }
+            }
+        }
+        predict_data_t_and_write_to_eterms(t_data, t_cache);
+    }
+    
+    // predicts the datasets from their transpose copies: one traversal per factor f computes the
+    // q_f-terms and, in the same pass, -1/2 sum_i v_if^2 x_i^2 and (in the first pass) the w-terms
+    void predict_data_t_and_write_to_eterms(DVector<Data*>& main_data, DVector<e_q_cache>& main_cache) {
         
         assert(main_data.dim == main_cache.dim);
         if (main_data.dim == 0) { return ; }
@@ -98,81 +201,80 @@ protected:
         
         // do this using only the transpose copy of the training data:
         for (uint ds = 0; ds < main_cache.dim; ds++) {
-            //只有2维，第一维是train的data和e_q_term数据，第二维是test的data和e_q_term数据
+            //只有2维，第一维是train的data和e_q_cache数据，第二维是test的data和e_q_cache数据
             //初始化e 和 q 都为0
-            e_q_term* m_cache = main_cache(ds);
+            e_q_cache& m_cache = main_cache(ds);
             Data* m_data = main_data(ds);
             for (uint i = 0; i < m_data->num_cases; i++) {
-                m_cache[i].e = 0.0;
-                m_cache[i].q = 0.0;
+                m_cache.e[i] = 0.0;
+                m_cache.q[i] = 0.0;
             }
         }
         
+        // rel_lin(r) collects the w-terms and -1/2 sum_f sum_i v^B_if^2 x^B_i^2 of the relation rows
+        DVector< DVector<double> > rel_lin(relation.dim);
         for (uint r = 0; r < relation.dim; r++) {
+            rel_lin(r).setSize(relation(r).data->num_cases);
+            rel_lin(r).init(0.0);
             for (uint c = 0; c < relation(r).data->num_cases; c++) {
-                rel_cache(r)[c].y = 0.0;
-                rel_cache(r)[c].q = 0.0;
+                rel_cache(r).y[c] = 0.0;
+                rel_cache(r).q[c] = 0.0;
             }
         }
         /**************************************************************************
-         下面开始了大量的计算，我要看看它到底干了神马
-         (1) do the 1/2 sum_f (sum_i v_if x_i)^2 and store it in the e/y-term （公式5.5 第3项）
-         (2) do -1/2 sum_f (sum_i v_if^2 x_i^2) and store it in the q-term （公式5.5 第4项）
-         (3) add the w's to the q-term，相当于q<c> = sum_j{ x<c>(j) * wj}   （这一步是加上公式5的第二项）
-         (3) merge both for getting the prediction: w0+e(c)+q(c)
+         per factor f:
+         (1) q_f = sum_i v_if x_i, e += -1/2 sum_i v_if^2 x_i^2 (+ sum_i w_i x_i in the first pass)
+         (2) e += 1/2 (q_f + sum_R q^R_f)^2 and y^R += 1/2 (q^R_f)^2
+         finally e = w0 + e + sum_R rel_lin and y^R += rel_lin
          **************************************************************************/
-        
-        // (1) do the 1/2 sum_f (sum_i v_if x_i)^2 and store it in the e/y-term
-        // (1.1) e_j = 1/2 sum_f (q_jf+ sum_R q^R_jf)^2
-        // (1.2) y^R_j = 1/2 sum_f q^R_jf^2
-        // Complexity: O(N_z(X^M) + \sum_{B} N_z(X^B) + n*|B| + \sum_B n^B) = O(\mathcal{C})
-        for (int f = 0; f < fm->num_factor; f++) {//遍历因子的每一维 f = 1~k
-            
-            double* v = fm->v.value[f];//v是第f维度上每个features的值
+        // Complexity per factor: O(N_z(X^M) + \sum_{B} N_z(X^B) + n*|B| + \sum_B n^B) = O(\mathcal{C})
+        int num_passes = std::max(fm->num_factor, 1); // the w-terms need a pass even without factors
+        for (int f = 0; f < num_passes; f++) {
+            bool add_w = fm->k1 && (f == 0);
             
-            // calculate cache[i].q = sum_i v_if x_i (== q_f-term)
             // Complexity: O(N_z(X^M))
             for (uint ds = 0; ds < main_cache.dim; ds++) {
-                e_q_term* m_cache = main_cache(ds);
+                e_q_cache& m_cache = main_cache(ds);
                 Data* m_data = main_data(ds);
                 m_data->data_t->begin();
                 uint row_index;
                 sparse_row<DATA_FLOAT>* feature_data;
-                for (uint i = 0; i < m_data->data_t->getNumRows(); i++) {//遍历每一个instance
+                for (uint i = 0; i < m_data->data_t->getNumRows(); i++, m_data->data_t->next()) {
                     {
                         row_index = m_data->data_t->getRowIndex();
                         feature_data = &(m_data->data_t->getRow());
-                        m_data->data_t->next();
                     }
-                    double& v_if = v[row_index];
+                    double v_if = (f < fm->num_factor) ? fm->v(f,row_index) : 0.0;
+                    double w_i = add_w ? fm->w(row_index) : 0.0;
 					
                     for (uint i_fd = 0; i_fd < feature_data->size; i_fd++) {
                         uint& train_case_index = feature_data->data[i_fd].id;
                         FM_FLOAT& x_li = feature_data->data[i_fd].value;
-                        m_cache[train_case_index].q += v_if * x_li;
+                        m_cache.q[train_case_index] += v_if * x_li;
+                        m_cache.e[train_case_index] += (w_i - 0.5 * v_if * v_if * x_li) * x_li;
                     }
                 }
             }
             
-            // calculate block_cache[i].q = sum_i v^B_if x^B_i (== q^B_f-term)
             // Complexity: O(\sum_{B} N_z(X^B))
             for (uint r = 0; r < relation.dim; r++) {
                 uint attr_offset = relation(r).data->attr_offset;
                 relation(r).data->data_t->begin();
                 uint row_index;
                 sparse_row<DATA_FLOAT>* feature_data;
-                for (uint i = 0; i < relation(r).data->data_t->getNumRows(); i++) {
+                for (uint i = 0; i < relation(r).data->data_t->getNumRows(); i++, relation(r).data->data_t->next()) {
                     {
                         row_index = relation(r).data->data_t->getRowIndex();
                         feature_data = &(relation(r).data->data_t->getRow());
-                        relation(r).data->data_t->next();
                     }
-                    double& v_if = v[row_index + attr_offset];
+                    double v_if = (f < fm->num_factor) ? fm->v(f,row_index + attr_offset) : 0.0;
+                    double w_i = add_w ? fm->w(row_index + attr_offset) : 0.0;
 					
                     for (uint i_fd = 0; i_fd < feature_data->size; i_fd++) {
                         uint& train_case_index = feature_data->data[i_fd].id;
                         FM_FLOAT& x_li = feature_data->data[i_fd].value;
-                        rel_cache(r)[train_case_index].q += v_if * x_li;
+                        rel_cache(r).q[train_case_index] += v_if * x_li;
+                        rel_lin(r)(train_case_index) += (w_i - 0.5 * v_if * v_if * x_li) * x_li;
                     }
                 }
                 
@@ -181,15 +283,15 @@ protected:
             // add 0.5*q^2 to e and set q to zero.
             // O(n*|B|)
             for (uint ds = 0; ds < main_cache.dim; ds++) {
-                e_q_term* m_cache = main_cache(ds);
+                e_q_cache& m_cache = main_cache(ds);
                 Data* m_data = main_data(ds);
                 for (uint c = 0; c < m_data->num_cases; c++) {
-                    double q_all = m_cache[c].q;
+                    double q_all = m_cache.q[c];
                     for (uint r = 0; r < m_data->relation.dim; r++) {
-                        q_all += rel_cache(r)[m_data->relation(r).data_row_to_relation_row(c)].q;
+                        q_all += rel_cache(r).q[m_data->relation(r).data_row_to_relation_row(c)];
                     }
-                    m_cache[c].e += 0.5 * q_all*q_all;
-                    m_cache[c].q = 0.0;
+                    m_cache.e[c] += 0.5 * q_all*q_all;
+                    m_cache.q[c] = 0.0;
                 }
             }
             
@@ -199,135 +301,32 @@ protected:
             for (uint r = 0; r < relation.dim; r++) {
                 // add 0.5*q^2 to y and set q to zero.
                 for (uint c = 0; c <  relation(r).data->num_cases; c++) {
-                    rel_cache(r)[c].y += 0.5 * rel_cache(r)[c].q * rel_cache(r)[c].q;
-                    rel_cache(r)[c].q = 0.0;
-                }
-            }
-        }
-        
-        // (2) do -1/2 sum_f (sum_i v_if^2 x_i^2) and store it in the q-term
-        for (int f = 0; f < fm->num_factor; f++) {
-            double* v = fm->v.value[f];
-            
-            // sum up the q^S_f terms in the main-q-cache: 0.5*sum_i (v_if x_i)^2 (== q^S_f-term)
-            // Complexity: O(N_z(X^M))
-            for (uint ds = 0; ds < main_cache.dim; ds++) {
-                e_q_term* m_cache = main_cache(ds);
-                Data* m_data = main_data(ds);
-                
-                m_data->data_t->begin();
-                uint row_index;
-                sparse_row<DATA_FLOAT>* feature_data;
-                for (uint i = 0; i < m_data->data_t->getNumRows(); i++) {
-                    {
-                        row_index = m_data->data_t->getRowIndex();
-                        feature_data = &(m_data->data_t->getRow());
-                        m_data->data_t->next();
-                    }
-                    double& v_if = v[row_index];
-                    
-                    for (uint i_fd = 0; i_fd < feature_data->size; i_fd++) {
-                        uint& train_case_index = feature_data->data[i_fd].id;
-                        FM_FLOAT& x_li = feature_data->data[i_fd].value;
-                        m_cache[train_case_index].q -= 0.5 * v_if * v_if * x_li * x_li;
-                    }
-                }
-            }
-            
-            // sum up the q^B,S_f terms in the block_cache.q: 0.5* sum_i (v^B_if x^B_i)^2 (== q^B,S_f-term)
-            // Complexity: O(\sum_{B} N_z(X^B))
-            for (uint r = 0; r < relation.dim; r++) {
-                uint attr_offset = relation(r).data->attr_offset;
-                relation(r).data->data_t->begin();
-                uint row_index;
-                sparse_row<DATA_FLOAT>* feature_data;
-                for (uint i = 0; i < relation(r).data->data_t->getNumRows(); i++) {
-                    {
-                        row_index = relation(r).data->data_t->getRowIndex();
-                        feature_data = &(relation(r).data->data_t->getRow());
-                        relation(r).data->data_t->next();
-                    }
-                    double& v_if = v[row_index + attr_offset];
-                    
-                    for (uint i_fd = 0; i_fd < feature_data->size; i_fd++) {
-                        uint& train_case_index = feature_data->data[i_fd].id;
-                        FM_FLOAT& x_li = feature_data->data[i_fd].value;
-                        rel_cache(r)[train_case_index].q -= 0.5 * v_if * v_if * x_li * x_li;
-                    }
+                    rel_cache(r).y[c] += 0.5 * rel_cache(r).q[c] * rel_cache(r).q[c];
+                    rel_cache(r).q[c] = 0.0;
                 }
             }
         }
         
-        // (3) add the w's to the q-term
-        if (fm->k1) {
-            for (uint ds = 0; ds < main_cache.dim; ds++) {
-                e_q_term* m_cache = main_cache(ds);
-                Data* m_data = main_data(ds);
-                m_data->data_t->begin();
-                uint row_index;
-                sparse_row<DATA_FLOAT>* feature_data;
-                for (uint i = 0; i < m_data->data_t->getNumRows(); i++) {//遍历每一个instance ，所以i = 1~N
-                    {
-                        row_index = m_data->data_t->getRowIndex();
-                        feature_data = &(m_data->data_t->getRow());
-                        m_data->data_t->next();
-                    }
-                    double& w_i = fm->w(row_index);
-                    
-                    for (uint i_fd = 0; i_fd < feature_data->size; i_fd++) {//遍历每一个feature，所以f = 1~k
-                        uint& train_case_index = feature_data->data[i_fd].id;//获取当前是第几个instance
-                        FM_FLOAT& x_li = feature_data->data[i_fd].value;
-                        m_cache[train_case_index].q += w_i * x_li;
-                    }
-                }
-            }
-            for (uint r = 0; r < relation.dim; r++) {
-                uint attr_offset = relation(r).data->attr_offset;
-                relation(r).data->data_t->begin();
-                uint row_index;
-                sparse_row<DATA_FLOAT>* feature_data;
-                for (uint i = 0; i < relation(r).data->data_t->getNumRows(); i++) {
-                    {
-                        row_index = relation(r).data->data_t->getRowIndex();
-                        feature_data = &(relation(r).data->data_t->getRow());
-                        relation(r).data->data_t->next();
-                    }
-                    double& w_i = fm->w(row_index + attr_offset);
-                    
-                    for (uint i_fd = 0; i_fd < feature_data->size; i_fd++) {
-                        uint& train_case_index = feature_data->data[i_fd].id;
-                        FM_FLOAT& x_li = feature_data->data[i_fd].value;
-                        rel_cache(r)[train_case_index].q += w_i * x_li;
-                    }
-                }
-            }
-            
-        }
-        // (3) merge both for getting the prediction: w0+e(c)+q(c)
-        //注意实际上是e(c) = w0+e(c)+q(c)，同时把q清零了
+        // merge: e(c) = w0 + e(c) + sum_R rel_lin
         for (uint ds = 0; ds < main_cache.dim; ds++) {
-            e_q_term* m_cache = main_cache(ds);
+            e_q_cache& m_cache = main_cache(ds);
             Data* m_data = main_data(ds);
 			
             for (uint c = 0; c < m_data->num_cases; c++) {
-                double q_all = m_cache[c].q;
                 for (uint r = 0; r < m_data->relation.dim; r++) {
-                    q_all += rel_cache(r)[m_data->relation(r).data_row_to_relation_row(c)].q;
+                    m_cache.e[c] += rel_lin(r)(m_data->relation(r).data_row_to_relation_row(c));
                 }
-                m_cache[c].e = m_cache[c].e + q_all;
                 if (fm->k0) {
-                    m_cache[c].e += fm->w0;
+                    m_cache.e[c] += fm->w0;
                 }
-                m_cache[c].q = 0.0;
             }
         }
         
         // The "prediction" in each block is calculated
         for (uint r = 0; r < relation.dim; r++) {
-            // y_i = y_i + q_i = [1/2 sum_f (q^B_if)^2] + [sum w^B_i x^B_i -1/2 sum_f (sum_i v^B_if^2 x^B_i^2)]
+            // y_i = [1/2 sum_f (q^B_if)^2] + [sum w^B_i x^B_i -1/2 sum_f (sum_i v^B_if^2 x^B_i^2)]
             for (uint c = 0; c <  relation(r).data->num_cases; c++) {
-                rel_cache(r)[c].y = rel_cache(r)[c].y + rel_cache(r)[c].q;
-                rel_cache(r)[c].q = 0.0;
+                rel_cache(r).y[c] += rel_lin(r)(c);
             }
         }
         
@@ -367,24 +366,20 @@ protected:
     void add_main_q(Data& train, uint f) {
         // add the q(f)-terms to the main relation q-cache (using only the transpose data)
         
-        double* v = fm->v.value[f];
-        
-        
         {
             train.data_t->begin();
             uint row_index;
             sparse_row<DATA_FLOAT>* feature_data;
-            for (uint i = 0; i < train.data_t->getNumRows(); i++) {
+            for (uint i = 0; i < train.data_t->getNumRows(); i++, train.data_t->next()) {
                 {
                     row_index = train.data_t->getRowIndex();
                     feature_data = &(train.data_t->getRow());
-                    train.data_t->next();
                 }
-                double& v_if = v[row_index];
+                FM_MODEL_FLOAT& v_if = fm->v(f,row_index);
                 for (uint i_fd = 0; i_fd < feature_data->size; i_fd++) {
                     uint& train_case_index = feature_data->data[i_fd].id;
                     FM_FLOAT& x_li = feature_data->data[i_fd].value;
-                    cache[train_case_index].q += v_if * x_li;
+                    cache.q[train_case_index] += v_if * x_li;
                 }
                 
             }
@@ -392,6 +387,98 @@ protected:
     }
     
     //采样，算法第6~24行
+    /*
+     Greedy colouring of the features of the main table: two features that occur in the same
+     case get different colours (e.g. all features of a one-hot encoded attribute can share a
+     colour). The draws of features with the same colour read and write disjoint cache entries,
+     so they can be done concurrently and the result is still an exact Gibbs sweep (in colour
+     order instead of feature order).
+     */
+    void build_colour_classes(Data& train) {
+        uint num_features = train.data_t->getNumRows();
+        DVector<unsigned long long> case_colours(train.num_cases); // bit c is set if a feature of the case has colour c
+        case_colours.init(0);
+        DVector<uint> colour(num_features);
+        num_colours = 0;
+        has_uncoloured = false;
+        for (uint j = 0; j < num_features; j++) {
+            sparse_row<DATA_FLOAT> feature_data = train.data_t->getRowAt(j);
+            unsigned long long used = 0;
+            for (uint i_fd = 0; i_fd < feature_data.size; i_fd++) {
+                used |= case_colours(feature_data.data[i_fd].id);
+            }
+            uint c = 0;
+            while ((c < MAX_COLOURS) && (used & (1ULL << c))) { c++; }
+            colour(j) = c;
+            if (c < MAX_COLOURS) {
+                for (uint i_fd = 0; i_fd < feature_data.size; i_fd++) {
+                    case_colours(feature_data.data[i_fd].id) |= (1ULL << c);
+                }
+                num_colours = std::max(num_colours, c+1);
+            } else {
+                has_uncoloured = true;
+            }
+        }
+        uint num_classes = num_colours + (has_uncoloured ? 1 : 0);
+        if (has_uncoloured) { // the uncoloured features are the last class
+            for (uint j = 0; j < num_features; j++) {
+                if (colour(j) == MAX_COLOURS) { colour(j) = num_colours; }
+            }
+        }
+        colour_begin.setSize(num_classes+1);
+        colour_begin.init(0);
+        for (uint j = 0; j < num_features; j++) {
+            colour_begin(colour(j)+1)++;
+        }
+        for (uint c = 0; c < num_classes; c++) {
+            colour_begin(c+1) += colour_begin(c);
+        }
+        colour_feature.setSize(num_features);
+        DVector<uint> pos(num_classes);
+        for (uint c = 0; c < num_classes; c++) {
+            pos(c) = colour_begin(c);
+        }
+        for (uint j = 0; j < num_features; j++) {
+            colour_feature(pos(colour(j))++) = j;
+        }
+    }
+    
+    // draws w (f < 0) or v(f,.) of all features of the main table that occur in the training data;
+    // every feature draws from its own random stream, so the sample does not depend on the scheduling
+    void draw_main_parallel(Data& train, int f) {
+        unsigned long long seed = ran_bits();
+        unsigned long long stream_offset = (unsigned long long) (f+1) * train.data_t->getNumRows();
+        #pragma omp parallel num_threads(num_threads)
+        {
+            for (uint c = 0; c+1 < colour_begin.dim; c++) {
+                if (c < num_colours) {
+                    #pragma omp for schedule(dynamic, 16)
+                    for (int k = colour_begin(c); k < (int) colour_begin(c+1); k++) {
+                        draw_main_feature(train, f, colour_feature(k), seed ^ ran_mix(stream_offset + colour_feature(k)));
+                    }
+                } else {
+                    // features without a colour might conflict
+                    #pragma omp single
+                    for (uint k = colour_begin(c); k < colour_begin(c+1); k++) {
+                        draw_main_feature(train, f, colour_feature(k), seed ^ ran_mix(stream_offset + colour_feature(k)));
+                    }
+                }
+            }
+            ran_thread_release();
+        }
+    }
+    
+    void draw_main_feature(Data& train, int f, uint row_index, unsigned long long seed) {
+        sparse_row<DATA_FLOAT> feature_data = train.data_t->getRowAt(row_index);
+        uint g = meta->attr_group(row_index);
+        ran_thread_seed(seed);
+        if (f < 0) {
+            draw_w(fm->w(row_index), w_mu(g), w_lambda(g), feature_data);
+        } else {
+            draw_v(fm->v(f,row_index), v_mu(g,f), v_lambda(g,f), feature_data);
+        }
+    }
+    
     void draw_all(Data& train) {
         std::ostringstream ss;
         
@@ -420,18 +507,22 @@ protected:
             }
             
             // draw the w from their posterior，算法第15行
-            train.data_t->begin();
             uint row_index;
             sparse_row<DATA_FLOAT>* feature_data;
-            for (uint i = 0; i < train.data_t->getNumRows(); i++) {
-                {
-                    row_index = train.data_t->getRowIndex();
-                    feature_data = &(train.data_t->getRow());
-                    train.data_t->next();
-                    count_how_many_variables_are_drawn++;
+            if (colour_begin.dim > 0) {
+                draw_main_parallel(train, -1);
+                count_how_many_variables_are_drawn += train.data_t->getNumRows();
+            } else {
+                train.data_t->begin();
+                for (uint i = 0; i < train.data_t->getNumRows(); i++, train.data_t->next()) {
+                    {
+                        row_index = train.data_t->getRowIndex();
+                        feature_data = &(train.data_t->getRow());
+                        count_how_many_variables_are_drawn++;
+                    }
+                    uint g = meta->attr_group(row_index);
+                    draw_w(fm->w(row_index), w_mu(g), w_lambda(g), *feature_data);
                 }
-                uint g = meta->attr_group(row_index);
-                draw_w(fm->w(row_index), w_mu(g), w_lambda(g), *feature_data);
             }
             // draw w's of the main table for which there is no observation in the training data
             uint draw_to = fm->num_attribute;
@@ -446,24 +537,26 @@ protected:
             // foreach relation do: draw w
             for (uint r = 0; r < train.relation.dim; r++) {
                 RelationJoin& join = train.relation(r);
-                relation_cache* r_cache = rel_cache(r);
-                // init the e-cache for the blocks
-                for (uint c = 0; c < join.data->num_cases; c++) {
-                    r_cache[c].we = 0;
-                }
-                for (uint c = 0; c < train.num_cases; c++) {
-                    r_cache[join.data_row_to_relation_row(c)].we += cache[c].e;
-                    cache[c].e -= r_cache[join.data_row_to_relation_row(c)].y; // let main.e be out of sync
+                relation_cache& r_cache = rel_cache(r);
+                // init the e-cache for the blocks: gather the cases of each relation row
+                #pragma omp parallel for num_threads(num_threads) if (num_threads > 1) schedule(dynamic, 256)
+                for (int j = 0; j < (int) join.data->num_cases; j++) {
+                    double we = 0;
+                    for (uint i = join.relation_row_begin(j); i < join.relation_row_begin(j+1); i++) {
+                        uint c = join.relation_row_case(i);
+                        we += cache.e[c];
+                        cache.e[c] -= r_cache.y[j]; // let main.e be out of sync
+                    }
+                    r_cache.we[j] = we;
                 }
                 // draw the w's:
                 join.data->data_t->begin();
                 uint row_index;
                 sparse_row<DATA_FLOAT>* feature_data;
-                for (uint i = 0; i < join.data->data_t->getNumRows(); i++) {
+                for (uint i = 0; i < join.data->data_t->getNumRows(); i++, join.data->data_t->next()) {
                     {
                         row_index = join.data->data_t->getRowIndex();
                         feature_data = &(join.data->data_t->getRow());
-                        join.data->data_t->next();
                         count_how_many_variables_are_drawn++;
                     }
                     uint g = meta->attr_group(row_index+join.data->attr_offset);
@@ -472,8 +565,9 @@ protected:
                 
                 
                 // update the cache.e-Term!
-                for (uint c = 0; c < train.num_cases; c++) {
-                    cache[c].e += r_cache[join.data_row_to_relation_row(c)].y; // sync main.e again
+                #pragma omp parallel for num_threads(num_threads) if (num_threads > 1) schedule(static)
+                for (int c = 0; c < (int) train.num_cases; c++) {
+                    cache.e[c] += r_cache.y[join.data_row_to_relation_row(c)]; // sync main.e again
                 }
                 
             }
@@ -507,59 +601,61 @@ protected:
             uint count_how_many_variables_are_drawn = 0; // to make sure that non-existing ones in the train set are not missed...
             
             for (uint c = 0; c < train.num_cases; c++) {
-                cache[c].q = 0.0;
+                cache.q[c] = 0.0;
             }
             
             add_main_q(train, f);
-			
-            double* v = fm->v.value[f];
             
             for (uint r = 0; r < train.relation.dim; r++) {
                 RelationJoin& join = train.relation(r);
-                relation_cache* r_cache = rel_cache(r);
+                relation_cache& r_cache = rel_cache(r);
                 for (uint c = 0; c < join.data->num_cases; c++) {
-                    r_cache[c].q = 0.0;
+                    r_cache.q[c] = 0.0;
                 }
                 uint attr_offset = join.data->attr_offset;
                 join.data->data_t->begin();
                 uint row_index;
                 sparse_row<DATA_FLOAT>* feature_data;
-                for (uint i = 0; i < join.data->data_t->getNumRows(); i++) {
+                for (uint i = 0; i < join.data->data_t->getNumRows(); i++, join.data->data_t->next()) {
                     {
                         row_index = join.data->data_t->getRowIndex();
                         feature_data = &(join.data->data_t->getRow());
-                        join.data->data_t->next();
                     }
-                    double& v_if = v[row_index + attr_offset];
+                    FM_MODEL_FLOAT& v_if = fm->v(f,row_index + attr_offset);
                     
                     for (uint i_fd = 0; i_fd < feature_data->size; i_fd++) {
                         uint& train_case_index = feature_data->data[i_fd].id;
                         FM_FLOAT& x_li = feature_data->data[i_fd].value;
-                        r_cache[train_case_index].q += v_if * x_li;
+                        r_cache.q[train_case_index] += v_if * x_li;
                     }
                 }
             }
             
             // sum q^M over its relations:
-            for (uint c = 0; c < train.num_cases; c++) {
+            #pragma omp parallel for num_threads(num_threads) if (num_threads > 1 && train.relation.dim > 0) schedule(static)
+            for (int c = 0; c < (int) train.num_cases; c++) {
                 for (uint r = 0; r < train.relation.dim; r++) {
-                    cache[c].q += rel_cache(r)[train.relation(r).data_row_to_relation_row(c)].q; // if do innerblock, then it contains q^M + sum q^B otherwise just sum q^B
+                    cache.q[c] += rel_cache(r).q[train.relation(r).data_row_to_relation_row(c)]; // if do innerblock, then it contains q^M + sum q^B otherwise just sum q^B
                 }
             }
             
             // draw the thetas from their posterior
-            train.data_t->begin();
             uint row_index;
             sparse_row<DATA_FLOAT>* feature_data;
-            for (uint i = 0; i < train.data_t->getNumRows(); i++) {
-                {
-                    row_index = train.data_t->getRowIndex();
-                    feature_data = &(train.data_t->getRow());
-                    train.data_t->next();
-                    count_how_many_variables_are_drawn++;
+            if (colour_begin.dim > 0) {
+                draw_main_parallel(train, f);
+                count_how_many_variables_are_drawn += train.data_t->getNumRows();
+            } else {
+                train.data_t->begin();
+                for (uint i = 0; i < train.data_t->getNumRows(); i++, train.data_t->next()) {
+                    {
+                        row_index = train.data_t->getRowIndex();
+                        feature_data = &(train.data_t->getRow());
+                        count_how_many_variables_are_drawn++;
+                    }
+                    uint g = meta->attr_group(row_index);
+                    draw_v(fm->v(f,row_index), v_mu(g,f), v_lambda(g,f), *feature_data);
                 }
-                uint g = meta->attr_group(row_index);
-                draw_v(v[row_index], v_mu(g,f), v_lambda(g,f), *feature_data);
             }
             // draw v's of the main table for which there is no observation in the training data
             uint draw_to = fm->num_attribute;
@@ -568,50 +664,55 @@ protected:
                 row_index = i;
                 feature_data = &(empty_data_row);
                 uint g = meta->attr_group(row_index);
-                draw_v(v[row_index], v_mu(g,f), v_lambda(g,f), *feature_data);
+                draw_v(fm->v(f,row_index), v_mu(g,f), v_lambda(g,f), *feature_data);
                 count_how_many_variables_are_drawn++;
             }
             
             // foreach relation do: draw v
             for (uint r = 0; r < train.relation.dim; r++) {
                 RelationJoin& join = train.relation(r);
-                relation_cache* r_cache = rel_cache(r);
-                // init for the block: c, c_sqr, e, eq
+                relation_cache& r_cache = rel_cache(r);
+                // init for the block: c, c_sqr, e, eq (gathered over the cases of each relation row)
                 // unsync main: q and e
-                for (uint c = 0; c < join.data->num_cases; c++) {
-                    r_cache[c].we = 0.0;
-                    r_cache[c].weq = 0.0;
-                    r_cache[c].wc = 0.0;
-                    r_cache[c].wc_sqr = 0.0;
-                }
-                for (uint c = 0; c < train.num_cases; c++) {
-                    cache[c].q -= r_cache[join.data_row_to_relation_row(c)].q; // let main.q be out of sync
-                    r_cache[join.data_row_to_relation_row(c)].we += cache[c].e;
-                    r_cache[join.data_row_to_relation_row(c)].weq += (cache[c].e * cache[c].q);
-                    r_cache[join.data_row_to_relation_row(c)].wc += cache[c].q;
-                    r_cache[join.data_row_to_relation_row(c)].wc_sqr += (cache[c].q*cache[c].q);
-                    cache[c].e -= (r_cache[join.data_row_to_relation_row(c)].y + cache[c].q*r_cache[join.data_row_to_relation_row(c)].q); // let main.e be out of sync
+                #pragma omp parallel for num_threads(num_threads) if (num_threads > 1) schedule(dynamic, 256)
+                for (int j = 0; j < (int) join.data->num_cases; j++) {
+                    double we = 0, weq = 0, wc = 0, wc_sqr = 0;
+                    double y = r_cache.y[j], q_rel = r_cache.q[j];
+                    for (uint i = join.relation_row_begin(j); i < join.relation_row_begin(j+1); i++) {
+                        uint c = join.relation_row_case(i);
+                        cache.q[c] -= q_rel; // let main.q be out of sync
+                        double e = cache.e[c], q = cache.q[c];
+                        we += e;
+                        weq += e * q;
+                        wc += q;
+                        wc_sqr += q * q;
+                        cache.e[c] -= (y + q * q_rel); // let main.e be out of sync
+                    }
+                    r_cache.we[j] = we;
+                    r_cache.weq[j] = weq;
+                    r_cache.wc[j] = wc;
+                    r_cache.wc_sqr[j] = wc_sqr;
                 }
 				
                 // draw the v's:
                 join.data->data_t->begin();
                 uint row_index;
                 sparse_row<DATA_FLOAT>* feature_data;
-                for (uint i = 0; i < join.data->data_t->getNumRows(); i++) {
+                for (uint i = 0; i < join.data->data_t->getNumRows(); i++, join.data->data_t->next()) {
                     {
                         row_index = join.data->data_t->getRowIndex();
                         feature_data = &(join.data->data_t->getRow());
-                        join.data->data_t->next();
                         count_how_many_variables_are_drawn++;
                     }
                     uint g = meta->attr_group(row_index+join.data->attr_offset);
-                    draw_v_rel(v[row_index+join.data->attr_offset], v_mu(g,f), v_lambda(g,f), *feature_data, r_cache);
+                    draw_v_rel(fm->v(f,row_index+join.data->attr_offset), v_mu(g,f), v_lambda(g,f), *feature_data, r_cache);
                 }
                 
                 // update the cache.e and cache.q terms
-                for (uint c = 0; c < train.num_cases; c++) {
-                    cache[c].e += (r_cache[join.data_row_to_relation_row(c)].y + cache[c].q*r_cache[join.data_row_to_relation_row(c)].q); // sync e-term
-                    cache[c].q += r_cache[join.data_row_to_relation_row(c)].q; // sync q-term
+                #pragma omp parallel for num_threads(num_threads) if (num_threads > 1) schedule(static)
+                for (int c = 0; c < (int) train.num_cases; c++) {
+                    cache.e[c] += (r_cache.y[join.data_row_to_relation_row(c)] + cache.q[c]*r_cache.q[join.data_row_to_relation_row(c)]); // sync e-term
+                    cache.q[c] += r_cache.q[join.data_row_to_relation_row(c)]; // sync q-term
                 }
             }
             assert(count_how_many_variables_are_drawn == fm->num_attribute);
@@ -622,7 +723,7 @@ protected:
     
     // Find the optimal value for the global bias (0-way interaction)
     // 注意这里更新了w0之后，马上用新的w0来更新了e！！
-    void draw_w0(double& w0, double& reg, Data& train) {//reg 应该就是reg0
+    void draw_w0(FM_MODEL_FLOAT& w0, double& reg, Data& train) {//reg 应该就是reg0
         //可以近似的认为使用的是公式22，虽然还不是理解的很透彻
         //更新：看明白了，其实是公式29和30采样的w0_mean和w0_sigma_sqr
         // h = 1
@@ -632,7 +733,7 @@ protected:
         double w0_sigma_sqr;
         double w0_mean = 0;
         for (uint i = 0; i < train.num_cases; i++) {
-            w0_mean += cache[i].e - w0;
+            w0_mean += cache.e[i] - w0;
         }
         w0_sigma_sqr = (double) 1.0 / (reg + alpha * train.num_cases);
         w0_mean = - w0_sigma_sqr * (alpha * w0_mean - w0_mean_0 * reg);
@@ -662,7 +763,7 @@ protected:
         }
         // update error
         for (uint i = 0; i < train.num_cases; i++) {
-            cache[i].e -= (w0_old - w0);
+            cache.e[i] -= (w0_old - w0);
         }
     }
     
@@ -670,14 +771,21 @@ protected:
     //公式
     //公式29和30采样的w_sigma_sqr和w_mean
     //注意这里更新了wi之后，马上用新的wi来更新了e！！
-    void draw_w(double& w, double& w_mu, double& w_lambda, sparse_row<DATA_FLOAT>& feature_data) {
+    void draw_w(FM_MODEL_FLOAT& w, double& w_mu, double& w_lambda, sparse_row<DATA_FLOAT>& feature_data) {
         double w_sigma_sqr = 0;
         double w_mean = 0;
-        for (uint i_fd = 0; i_fd < feature_data.size; i_fd++) {
-            uint& train_case_index = feature_data.data[i_fd].id;
-            FM_FLOAT x_li = feature_data.data[i_fd].value;
-            w_mean += x_li * (cache[train_case_index].e - w * x_li);
-            w_sigma_sqr += x_li * x_li;
+        if (binary_train) {
+            for (uint i_fd = 0; i_fd < feature_data.size; i_fd++) {
+                w_mean += cache.e[feature_data.data[i_fd].id] - w;
+            }
+            w_sigma_sqr = feature_data.size;
+        } else {
+            for (uint i_fd = 0; i_fd < feature_data.size; i_fd++) {
+                uint& train_case_index = feature_data.data[i_fd].id;
+                FM_FLOAT x_li = feature_data.data[i_fd].value;
+                w_mean += x_li * (cache.e[train_case_index] - w * x_li);
+                w_sigma_sqr += x_li * x_li;
+            }
         }
         w_sigma_sqr = (double) 1.0 / (w_lambda + alpha * w_sigma_sqr);
         w_mean = - w_sigma_sqr * (alpha * w_mean - w_mu * w_lambda);
@@ -697,6 +805,7 @@ protected:
         
         // check for out of bounds values
         if (std::isnan(w)) {
+            #pragma omp atomic
             nan_cntr_w++;
             w = w_old;
             assert(! std::isnan(w_old));
@@ -704,6 +813,7 @@ protected:
             return;
         }
         if (std::isinf(w)) {
+            #pragma omp atomic
             inf_cntr_w++;
             w = w_old;
             assert(! std::isinf(w_old));
@@ -711,16 +821,22 @@ protected:
             return;
         }
         // update error:
+        if (binary_train) {
+            for (uint i_fd = 0; i_fd < feature_data.size; i_fd++) {
+                cache.e[feature_data.data[i_fd].id] -= (w_old - w);
+            }
+            return;
+        }
         for (uint i_fd = 0; i_fd < feature_data.size; i_fd++) {
             uint& train_case_index = feature_data.data[i_fd].id;
             FM_FLOAT& x_li = feature_data.data[i_fd].value;
             double h = x_li;
-            cache[train_case_index].e -= h * (w_old - w);
+            cache.e[train_case_index] -= h * (w_old - w);
         }
     }
     
     // RELATION: Find the optimal value for the 1-way interaction w: RELATION
-    void draw_w_rel(double& w, double& w_mu, double& w_lambda, sparse_row<DATA_FLOAT>& feature_data, relation_cache* r_cache) {
+    void draw_w_rel(FM_MODEL_FLOAT& w, double& w_mu, double& w_lambda, sparse_row<DATA_FLOAT>& feature_data, relation_cache& r_cache) {
         double w_sigma_sqr = 0;
         double w_mean = 0;
         // w_sigma_sqr = \sum h^2
@@ -729,10 +845,10 @@ protected:
         for (uint i_fd = 0; i_fd < feature_data.size; i_fd++) {
             uint& train_case_index = feature_data.data[i_fd].id;
             FM_FLOAT x_li = feature_data.data[i_fd].value;
-            //w_mean += x_li * (cache[train_case_index].e - w * x_li);
-            w_mean += x_li * r_cache[train_case_index].we;
-            w_sigma_sqr += x_li * x_li * r_cache[train_case_index].wnum;
-            num_all += r_cache[train_case_index].wnum;
+            //w_mean += x_li * (cache.e[train_case_index] - w * x_li);
+            w_mean += x_li * r_cache.we[train_case_index];
+            w_sigma_sqr += x_li * x_li * r_cache.wnum[train_case_index];
+            num_all += r_cache.wnum[train_case_index];
         }
         // w_mean = \sum h*e - theta * \sum h^2
         w_mean -= w * w_sigma_sqr;
@@ -773,24 +889,32 @@ protected:
             uint& train_case_index = feature_data.data[i_fd].id;
             FM_FLOAT& x_li = feature_data.data[i_fd].value;
             double h = x_li;
-            r_cache[train_case_index].we -= h * (w_old - w) * r_cache[train_case_index].wnum;
-            r_cache[train_case_index].y += (w-w_old) * h;
+            r_cache.we[train_case_index] -= h * (w_old - w) * r_cache.wnum[train_case_index];
+            r_cache.y[train_case_index] += (w-w_old) * h;
         }
     }
     
     // Find the optimal value for the 2-way interaction parameter v
-    void draw_v(double& v, double& v_mu, double& v_lambda, sparse_row<DATA_FLOAT>& feature_data) {
+    void draw_v(FM_MODEL_FLOAT& v, double& v_mu, double& v_lambda, sparse_row<DATA_FLOAT>& feature_data) {
         double v_sigma_sqr = 0;
         double v_mean = 0;
         // v_sigma_sqr = \sum h^2 (always)
         // v_mean = \sum h*e (for non_internlock_interactions)
-        for (uint i_fd = 0; i_fd < feature_data.size; i_fd++) {
-            uint& train_case_index = feature_data.data[i_fd].id;
-            FM_FLOAT& x_li = feature_data.data[i_fd].value;
-            e_q_term* cache_li = &(cache[train_case_index]);
-            double h = x_li * ( cache_li->q - x_li * v);
-            v_mean += h * cache_li->e;
-            v_sigma_sqr += h * h;
+        if (binary_train) {
+            for (uint i_fd = 0; i_fd < feature_data.size; i_fd++) {
+                uint c = feature_data.data[i_fd].id;
+                double h = cache.q[c] - v;
+                v_mean += h * cache.e[c];
+                v_sigma_sqr += h * h;
+            }
+        } else {
+            for (uint i_fd = 0; i_fd < feature_data.size; i_fd++) {
+                uint& train_case_index = feature_data.data[i_fd].id;
+                FM_FLOAT& x_li = feature_data.data[i_fd].value;
+                double h = x_li * ( cache.q[train_case_index] - x_li * v);
+                v_mean += h * cache.e[train_case_index];
+                v_sigma_sqr += h * h;
+            }
         }
         v_mean -= v * v_sigma_sqr;
         v_sigma_sqr = (double) 1.0 / (v_lambda + alpha * v_sigma_sqr);
@@ -811,6 +935,7 @@ protected:
 		
         // check for out of bounds values
         if (std::isnan(v)) {
+            #pragma omp atomic
             nan_cntr_v++;
             v = v_old;
             assert(! std::isnan(v_old));
@@ -818,6 +943,7 @@ protected:
             return;
         }
         if (std::isinf(v)) {
+            #pragma omp atomic
             inf_cntr_v++;
             v = v_old;
             assert(! std::isinf(v_old));
@@ -826,19 +952,27 @@ protected:
         }
         
         // update error and q:
+        if (binary_train) {
+            for (uint i_fd = 0; i_fd < feature_data.size; i_fd++) {
+                uint c = feature_data.data[i_fd].id;
+                double h = cache.q[c] - v_old;
+                cache.q[c] -= (v_old - v);
+                cache.e[c] -= h * (v_old - v);
+            }
+            return;
+        }
         for (uint i_fd = 0; i_fd < feature_data.size; i_fd++) {
             uint& train_case_index = feature_data.data[i_fd].id;
             FM_FLOAT& x_li = feature_data.data[i_fd].value;
-            e_q_term* cache_li = &(cache[train_case_index]);
-            double h = x_li * ( cache_li->q - x_li * v_old);
-            cache_li->q -= x_li * (v_old - v);
-            cache_li->e -= h * (v_old - v);
+            double h = x_li * ( cache.q[train_case_index] - x_li * v_old);
+            cache.q[train_case_index] -= x_li * (v_old - v);
+            cache.e[train_case_index] -= h * (v_old - v);
         }
     }
 	
     
     // RELATION: Find the optimal value for the 2-way interaction parameter v: RELATION
-    void draw_v_rel(double& v, double& v_mu, double& v_lambda, sparse_row<DATA_FLOAT>& feature_data, relation_cache* r_cache) {
+    void draw_v_rel(FM_MODEL_FLOAT& v, double& v_mu, double& v_lambda, sparse_row<DATA_FLOAT>& feature_data, relation_cache& r_cache) {
         double v_sigma_sqr = 0;
         double v_mean = 0;
         // v_sigma_sqr = \sum h^2
@@ -847,11 +981,11 @@ protected:
         for (uint i_fd = 0; i_fd < feature_data.size; i_fd++) {
             uint& train_case_index = feature_data.data[i_fd].id;
             FM_FLOAT x_li = feature_data.data[i_fd].value;
-            relation_cache* cache_li = &(r_cache[train_case_index]);
-            double h = x_li * ( cache_li->q - x_li * v);
-            v_mean += (h*cache_li->we + x_li*cache_li->weq);
-            v_sigma_sqr += (h * h * cache_li->wnum + 2 * cache_li->wc * x_li * h + x_li * x_li * cache_li->wc_sqr);
-            num_all += r_cache[train_case_index].wnum;
+            uint c = train_case_index;
+            double h = x_li * ( r_cache.q[c] - x_li * v);
+            v_mean += (h*r_cache.we[c] + x_li*r_cache.weq[c]);
+            v_sigma_sqr += (h * h * r_cache.wnum[c] + 2 * r_cache.wc[c] * x_li * h + x_li * x_li * r_cache.wc_sqr[c]);
+            num_all += r_cache.wnum[train_case_index];
         }
         // v_mean = \sum h*e - theta * \sum h^2
         v_mean -= v * v_sigma_sqr;
@@ -891,12 +1025,12 @@ protected:
         for (uint i_fd = 0; i_fd < feature_data.size; i_fd++) {
             uint& train_case_index = feature_data.data[i_fd].id;
             FM_FLOAT x_li = feature_data.data[i_fd].value;
-            relation_cache* cache_li = &(r_cache[train_case_index]);
-            double h = x_li * ( cache_li->q - x_li * v_old);
-            cache_li->we -= (v_old - v) * (h * cache_li->wnum + x_li * cache_li->wc);
-            cache_li->q -= (v_old - v) * x_li;
-            cache_li->weq -= (v_old - v) * (h * cache_li->wc + x_li * cache_li->wc_sqr);
-            cache_li->y += (v-v_old) * h;
+            uint c = train_case_index;
+            double h = x_li * ( r_cache.q[c] - x_li * v_old);
+            r_cache.we[c] -= (v_old - v) * (h * r_cache.wnum[c] + x_li * r_cache.wc[c]);
+            r_cache.q[c] -= (v_old - v) * x_li;
+            r_cache.weq[c] -= (v_old - v) * (h * r_cache.wc[c] + x_li * r_cache.wc_sqr[c]);
+            r_cache.y[c] += (v-v_old) * h;
         }
     }
     
@@ -912,7 +1046,7 @@ protected:
         //公式35 的中后部的一坨 sum(yi - yi_predict)
         double gamma_n = gamma_0;
         for (uint i = 0; i < num_train_total; i++) {
-            gamma_n += cache[i].e*cache[i].e;
+            gamma_n += cache.e[i]*cache.e[i];
         }
         double alpha_old = alpha;
         alpha = ran_gamma(alpha_n / 2.0, gamma_n / 2.0);
@@ -935,7 +1069,7 @@ protected:
     }
     
     //按照公式37来采样μπ
-    void draw_w_mu(double* w) {
+    void draw_w_mu(FM_MODEL_FLOAT* w) {
         if (! do_multilevel) {
             w_mu.init(mu_0);
             return;
@@ -975,7 +1109,7 @@ protected:
     }
     
     /* 完全按照公式36来采样λπ */
-    void draw_w_lambda(double* w) {
+    void draw_w_lambda(FM_MODEL_FLOAT* w) {
         if (! do_multilevel) {
             return;
         }
@@ -1099,6 +1233,34 @@ protected:
     }
     
 public:
+    virtual void save(fm_model_file_writer& out) {
+        fm_learn::save(out);
+        out.addScalar("alpha", alpha);
+        out.addVector("w_mu", w_mu);
+        out.addVector("w_lambda", w_lambda);
+        out.addMatrix("v_mu", v_mu);
+        out.addMatrix("v_lambda", v_lambda);
+    }
+    
+    virtual void load(fm_model_file& in) {
+        fm_learn::load(in);
+        if (! in.hasSection("alpha")) {
+            return; // the model was not learned with MCMC/ALS; keep the priors
+        }
+        if (! do_multilevel) {
+            return; // no hyperparameter inference (ALS): keep the regularization of this run
+        }
+        const fm_model_file_section& s = in.getSection("w_mu");
+        if (s.dim1 != meta->num_attr_groups) {
+            throw "the model was learned with a different number of attribute groups";
+        }
+        alpha = in.getScalar("alpha");
+        in.getVector("w_mu", w_mu);
+        in.getVector("w_lambda", w_lambda);
+        in.getMatrix("v_mu", v_mu);
+        in.getMatrix("v_lambda", v_lambda);
+    }
+    
     virtual void init() {
         fm_learn::init();
         
@@ -1106,6 +1268,7 @@ public:
         
         empty_data_row.size = 0;
         empty_data_row.data = NULL;
+        binary_train = false;
         
         alpha_0 = 1.0;//唯一一次赋值的，就只有1.0
         gamma_0 = 1.0;//唯一一次赋值的，就只有1.0
@@ -1162,6 +1325,7 @@ public:
     
     
     virtual void learn(Data& train, Data& test) {
+        binary_train = train.is_binary;
         pred_sum_all.setSize(test.num_cases);
         pred_sum_all_but5.setSize(test.num_cases);
         pred_this.setSize(test.num_cases);
@@ -1170,26 +1334,44 @@ public:
         pred_this.init(0.0);
         
         // init caches data structure
-        MemoryLog::getInstance().logNew("e_q_term", sizeof(e_q_term), train.num_cases);
-        cache = new e_q_term[train.num_cases];//e_q_term数组，数组包含元素个数是 训练样本的个数
-        MemoryLog::getInstance().logNew("e_q_term", sizeof(e_q_term), test.num_cases);
-        cache_test = new e_q_term[test.num_cases];
+        cache.allocate(train.num_cases);//e和q数组，数组包含元素个数是 训练样本的个数
+        cache_test.allocate(test.num_cases);
         
         // relation我们目前还用不到
         rel_cache.setSize(train.relation.dim);//rel_cache's dim is  1X?
         for (uint r = 0; r < train.relation.dim; r++) {
-            MemoryLog::getInstance().logNew("relation_cache", sizeof(relation_cache), train.relation(r).data->num_cases);
-            rel_cache(r) = new relation_cache[train.relation(r).data->num_cases];
-            for (uint c = 0; c < train.relation(r).data->num_cases; c++) {
-                rel_cache(r)[c].wnum = 0;
-            }
+            rel_cache(r).allocate(train.relation(r).data->num_cases);
         }
         
-        // calculate #^R
+        // calculate #^R from the inverse index of the joins
         for (uint r = 0; r < train.relation.dim; r++) {
-            for (uint c = 0; c < train.relation(r).data_row_to_relation_row.dim; c++) {
-                rel_cache(r)[train.relation(r).data_row_to_relation_row(c)].wnum += 1.0;
+            RelationJoin& join = train.relation(r);
+            if (join.relation_row_begin.dim != join.data->num_cases + 1) {
+                join.build_inverse_index();
             }
+            for (uint c = 0; c < join.data->num_cases; c++) {
+                rel_cache(r).wnum[c] = join.relation_row_begin(c+1) - join.relation_row_begin(c);
+            }
+        }
+        
+        // colour classes for parallel sampling
+        colour_begin.setSize(0);
+        if (num_threads > 1) {
+            if (train.data_t->hasRandomAccess()) {
+                build_colour_classes(train);
+                std::cout << "MCMC: parallel sampling with " << num_threads << " threads, " << num_colours << " colour classes" << (has_uncoloured ? " (+1 sequential)" : "") << std::endl;
+            } else {
+                std::cout << "MCMC: the transposed data has no random access, sampling is sequential" << std::endl;
+            }
+        }
+        // the parallel sampling draws the features of a colour class in random order, the sequential one in order
+        if (colour_begin.dim > 0) {
+            train.data_t->adviseRandom();
+        } else {
+            train.data_t->adviseSequential();
+        }
+        if (train.data != NULL) {
+            train.data->adviseSequential(); // the predictions of the e-terms
         }
         
         //真正的调用simultaneous去学习
@@ -1197,13 +1379,10 @@ public:
         
         // free data structures
         for (uint i = 0; i < train.relation.dim; i++) {
-            MemoryLog::getInstance().logFree("relation_cache", sizeof(relation_cache), train.relation(i).data->num_cases);
-            delete[] rel_cache(i);
+            rel_cache(i).free(train.relation(i).data->num_cases);
         }
-        MemoryLog::getInstance().logFree("e_q_term", sizeof(e_q_term), test.num_cases);
-        delete[] cache_test;
-        MemoryLog::getInstance().logFree("e_q_term", sizeof(e_q_term), train.num_cases);
-        delete[] cache;
+        cache_test.free(test.num_cases);
+        cache.free(train.num_cases);
     }
     
     
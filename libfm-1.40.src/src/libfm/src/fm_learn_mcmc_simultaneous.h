@@ -32,18 +32,18 @@ protected:
         // make a collection of datasets that are predicted jointly
         int num_data = 2;
         DVector<Data*> main_data(num_data);
-        DVector<e_q_term*> main_cache(num_data);//存储每一个instance的 e 和 q
+        DVector<e_q_cache> main_cache(num_data);//存储每一个instance的 e 和 q
         main_data(0) = &train;
         main_data(1) = &test;
         main_cache(0) = cache;
         main_cache(1) = cache_test;
         
         
-        predict_data_and_write_to_eterms(main_data, main_cache);//预测y，算法的第4行，（看起来e暂时性的成为\hat{y}），所以才有下面的cache[c].e = cache[c].e - train.target(c);
+        predict_data_and_write_to_eterms(main_data, main_cache);//预测y，算法的第4行，（看起来e暂时性的成为\hat{y}），所以才有下面的cache.e[c] = cache.e[c] - train.target(c);
         if (task == TASK_REGRESSION) {
             // remove the target from each prediction, because: e(c) := \hat{y}(c) - target(c)
             for (uint c = 0; c < train.num_cases; c++) {
-                cache[c].e = cache[c].e - train.target(c);//每一个instance都有一个e，并且ei = yi - yi_predict，见公式23
+                cache.e[c] = cache.e[c] - train.target(c);//每一个instance都有一个e，并且ei = yi - yi_predict，见公式23
             }
             
         } else if (task == TASK_CLASSIFICATION) {
@@ -51,7 +51,7 @@ protected:
             // for initializing, they are not sampled but initialized with meaningful values:
             // -1 for the negative class and +1 for the positive class (actually these are the values that are already in the target and thus, we can do the same as for regression; but note that other initialization strategies would need other techniques here:
             for (uint c = 0; c < train.num_cases; c++) {
-                cache[c].e = cache[c].e - train.target(c);
+                cache.e[c] = cache.e[c] - train.target(c);
             }
             
         } else {
@@ -121,7 +121,7 @@ protected:
                 // evaluate test and store it
                 // 评估测试集，并将 结果保存在 pred_this、pred_sum_all、pred_sum_all_but5中
                 for (uint c = 0; c < test.num_cases; c++) {
-                    double p = cache_test[c].e;
+                    double p = cache_test.e[c];
                     pred_this(c) = p;
                     p = std::min(max_target, p);
                     p = std::max(min_target, p);
@@ -133,19 +133,19 @@ protected:
                 
                 // Evaluate the training dataset and update the e-terms
                 for (uint c = 0; c < train.num_cases; c++) {
-                    double p = cache[c].e;
+                    double p = cache.e[c];
                     p = std::min(max_target, p);
                     p = std::max(min_target, p);
                     double err = p - train.target(c);
                     rmse_train += err*err;
-                    cache[c].e = cache[c].e - train.target(c); //这里将e赋值为正确的值， 就是预测误差本身
+                    cache.e[c] = cache.e[c] - train.target(c); //这里将e赋值为正确的值， 就是预测误差本身
                 }
                 rmse_train = std::sqrt(rmse_train/train.num_cases);
                 
             } else if (task == TASK_CLASSIFICATION) {
                 // evaluate test and store it
                 for (uint c = 0; c < test.num_cases; c++) {
-                    double p = cache_test[c].e;
+                    double p = cache_test.e[c];
                     p = cdf_gaussian(p);
                     pred_this(c) = p;
                     pred_sum_all(c) += p;
@@ -157,7 +157,7 @@ protected:
                 // Evaluate the training dataset and update the e-terms
                 uint _acc_train = 0;
                 for (uint c = 0; c < train.num_cases; c++) {
-                    double p = cache[c].e;
+                    double p = cache.e[c];
                     p = cdf_gaussian(p);
                     if (((p >= 0.5) && (train.target(c) > 0.0)) || ((p < 0.5) && (train.target(c) < 0.0))) {
                         _acc_train++;
@@ -166,26 +166,26 @@ protected:
                     double sampled_target;
                     if (train.target(c) >= 0.0) {
                         if (do_sample) {
-                            sampled_target = ran_left_tgaussian(0.0, cache[c].e, 1.0);
+                            sampled_target = ran_left_tgaussian(0.0, cache.e[c], 1.0);
                         } else {
                             // the target is the expected value of the truncated normal
-                            double mu = cache[c].e;
+                            double mu = cache.e[c];
                             double phi_minus_mu = exp(-mu*mu/2.0) / sqrt(3.141*2);
                             double Phi_minus_mu = cdf_gaussian(-mu);
                             sampled_target = mu + phi_minus_mu / (1-Phi_minus_mu);
                         }
                     } else {
                         if (do_sample) {
-                            sampled_target = ran_right_tgaussian(0.0, cache[c].e, 1.0);
+                            sampled_target = ran_right_tgaussian(0.0, cache.e[c], 1.0);
                         } else {
                             // the target is the expected value of the truncated normal
-                            double mu = cache[c].e;
+                            double mu = cache.e[c];
                             double phi_minus_mu = exp(-mu*mu/2.0) / sqrt(3.141*2);
                             double Phi_minus_mu = cdf_gaussian(-mu);
                             sampled_target = mu - phi_minus_mu / Phi_minus_mu;
                         }
                     }
-                    cache[c].e = cache[c].e - sampled_target;
+                    cache.e[c] = cache.e[c] - sampled_target;
                 }
                 acc_train = (double) _acc_train / train.num_cases;
                 
@@ -234,11 +234,16 @@ protected:
                 _evaluate_class(pred_this, test.target, 1.0, acc_test_this, ll_test_this, num_eval_cases);
                 _evaluate_class(pred_sum_all, test.target, 1.0/(i+1), acc_test_all, ll_test_all, num_eval_cases);
                 _evaluate_class(pred_sum_all_but5, test.target, 1.0/(i-5+1), acc_test_all_but5, ll_test_all_but5, num_eval_cases);
+                _evaluate_metrics(pred_sum_all, test.target, 1.0/(i+1), eval_metrics, num_eval_cases);
                 
-                std::cout << "#Iter=" << std::setw(3) << i << "\tTrain=" << acc_train << "\tTest=" << acc_test_all << "\tTest(ll)=" << ll_test_all << std::endl;
+                std::cout << "#Iter=" << std::setw(3) << i << "\tTrain=" << acc_train << "\tTest=" << acc_test_all << "\tTest(ll)=" << ll_test_all << report_metrics() << std::endl;
                 
                 if (log != NULL) {
                     log->log("accuracy", acc_test_all);
+                    log->log("auc", eval_metrics.auc());
+                    log->log("logloss", eval_metrics.logloss());
+                    log->log("ne", eval_metrics.normalized_entropy());
+                    log->log("calibration", eval_metrics.calibration());
                     log->log("acc_mcmc_this", acc_test_this);
                     log->log("acc_mcmc_all", acc_test_all);
                     log->log("acc_mcmc_all_but5", acc_test_all_but5);
@@ -303,6 +308,14 @@ protected:
         accuracy = (double) _accuracy / num_cases;
     }
     
+    // AUC, logloss, NE and calibration of the averaged probabilities pred*normalizer
+    void _evaluate_metrics(DVector<double>& pred, DVector<DATA_FLOAT>& target, double normalizer, binary_metrics& metrics, uint num_eval_cases) {
+        metrics.clear();
+        for (uint c = 0; c < std::min((uint)pred.dim, num_eval_cases); c++) {
+            metrics.add(pred(c) * normalizer, binary_metrics::is_positive(target(c)));
+        }
+    }
+    
     
     void _evaluate(DVector<double>& pred, DVector<DATA_FLOAT>& target, double normalizer, double& rmse, double& mae, uint& num_eval_cases) {
         _evaluate(pred, target, normalizer, rmse, mae, 0, num_eval_cases);
@@ -19,20 +19,46 @@
 class fm_learn_sgd: public fm_learn {
 	protected:
 		//DVector<double> sum, sum_sqr;
+		bool binary_train; // all values of the training data are 1.0
 	public:
 		int num_iter;
 		double learn_rate;
 		DVector<double> learn_rates;		
+		fm_optimizer optimizer; // adaptive learning rates; plain SGD if optimizer.method == FM_OPT_SGD
+		bool lazy_reg; // regularize all parameters in every step (see fm_lazy_reg)
+		fm_lazy_reg lazy;
+		int eval_train_every;  // the training error is computed every eval_train_every iterations (and in the last one); 0=never
+		uint eval_train_sample; // ... on a fixed random sample of this many rows; 0=all rows
+		std::vector<uint> eval_train_rows;
 
 		virtual void init() {		
 			fm_learn::init();	
 			learn_rates.setSize(3);
+			binary_train = false;
+			lazy_reg = false;
+			eval_train_every = 1;
+			eval_train_sample = 0;
 		//	sum.setSize(fm->num_factor);		
 		//	sum_sqr.setSize(fm->num_factor);
 		}		
 
 		virtual void learn(Data& train, Data& test) { 
 			fm_learn::learn(train, test);
+			binary_train = train.is_binary;
+			if (optimizer.method != FM_OPT_SGD) {
+				// the per layer form of -learn_rate sets learn_rate to 0; FTRL would divide by it
+				if (! (learn_rate > 0)) {
+					throw "adagrad, ftrl and adam need a single positive learn_rate";
+				}
+				optimizer.init(fm, learn_rate);
+			}
+			if (lazy_reg) {
+				if (optimizer.method != FM_OPT_SGD) {
+					throw "lazy regularization is only supported with plain SGD";
+				}
+				lazy.init(fm, learn_rate);
+			}
+			std::cout << "optimizer=" << optimizer.name() << (lazy_reg ? " (lazy regularization)" : "") << std::endl;
 			std::cout << "learnrate=" << learn_rate << std::endl;
 			std::cout << "learnrates=" << learn_rates(0) << "," << learn_rates(1) << "," << learn_rates(2) << std::endl;
 			std::cout << "#iterations=" << num_iter << std::endl;
@@ -40,11 +66,30 @@ class fm_learn_sgd: public fm_learn {
 			if (train.relation.dim > 0) {
 				throw "relations are not supported with SGD";
 			}
+			eval_train_rows.clear();
+			if ((eval_train_sample > 0) && (eval_train_sample < train.data->getNumRows())) {
+				if (train.data->hasRandomAccess()) {
+					// selection sampling (Knuth, Algorithm S); the rows stay in order
+					uint num_rows = train.data->getNumRows();
+					for (uint i = 0; (i < num_rows) && (eval_train_rows.size() < eval_train_sample); i++) {
+						if ((num_rows - i) * ran_uniform() < eval_train_sample - eval_train_rows.size()) {
+							eval_train_rows.push_back(i);
+						}
+					}
+					std::cout << "training error on a sample of " << eval_train_rows.size() << " rows" << std::endl;
+				} else {
+					std::cout << "training data does not support random access (use -cache_size 0 or -mmap 1); the training error is computed on all rows" << std::endl;
+				}
+			}
 			std::cout.flush();
 		}
 
-		void SGD(sparse_row<DATA_FLOAT> &x, const double multiplier, DVector<double> &sum) {
-			fm_SGD(fm, learn_rate, x, multiplier, sum); 
+		void SGD(sparse_row<DATA_FLOAT> &x, const double multiplier, DVector<FM_MODEL_FLOAT> &sum) {
+			if (optimizer.method == FM_OPT_SGD) {
+				fm_SGD(fm, learn_rate, x, multiplier, sum, binary_train);
+			} else {
+				optimizer.SGD(fm, learn_rate, x, multiplier, sum);
+			}
 		} 
 		
 		void debug() {
@@ -52,19 +97,25 @@ class fm_learn_sgd: public fm_learn {
 			fm_learn::debug();			
 		}
 
+		// error on the training data after iteration iter; NaN if it is not computed in this iteration
+		double evaluate_train(Data& train, int iter) {
+			if ((eval_train_every <= 0) || (((iter+1) % eval_train_every != 0) && (iter+1 != num_iter))) {
+				return std::numeric_limits<double>::quiet_NaN();
+			}
+			if (eval_train_rows.size() > 0) {
+				return evaluate_rows(train, eval_train_rows);
+			}
+			return evaluate(train);
+		}
+
 		virtual void predict(Data& data, DVector<double>& out) {
 			assert(data.data->getNumRows() == out.dim);
+			if (predict_parallel(data)) {
+				predict_model(data, out);
+				return;
+			}
 			for (data.data->begin(); !data.data->end(); data.data->next()) {
-				double p = predict_case(data);
-				if (task == TASK_REGRESSION ) {
-					p = std::min(max_target, p);
-					p = std::max(min_target, p);
-				} else if (task == TASK_CLASSIFICATION) {
-					p = 1.0/(1.0 + exp(-p));
-				} else {
-					throw "task not supported";
-				}
-				out(data.data->getRowIndex()) = p;
+				out(data.data->getRowIndex()) = transform_prediction(predict_case(data));
 			}				
 		} 
 
@@ -0,0 +1,244 @@
+/*
+	Mini-batch Stochastic Gradient Descent based learning for classification and regression
+
+	Each batch is processed in two phases:
+	(1) the predictions and the sum_f = sum_i v_if x_i terms of all rows of the batch are
+	    computed with the model of the previous batch (rows in parallel),
+	(2) the gradients of the batch are accumulated per feature and applied once. The entries
+	    of the batch are grouped by feature (counting sort into a per-batch column index), so
+	    every feature is updated by exactly one thread without locks.
+	The gradient of the loss is averaged over the batch; the regularization is applied once per
+	batch for every feature that occurs in it (with -lazy_reg to all features, see fm_lazy_reg).
+
+	Based on the publication(s):
+	Steffen Rendle (2010): Factorization Machines, in Proceedings of the 10th IEEE International Conference on Data Mining (ICDM 2010), Sydney, Australia.
+*/
+
+#ifndef FM_LEARN_SGD_BATCH_H_
+#define FM_LEARN_SGD_BATCH_H_
+
+#include <vector>
+#include "fm_learn_sgd.h"
+
+class fm_learn_sgd_batch: public fm_learn_sgd {
+	protected:
+		// rows of the current batch; they are copied if the data has no random access
+		std::vector< sparse_row<DATA_FLOAT> > rows;
+		std::vector< sparse_entry<DATA_FLOAT> > entries;
+		std::vector<uint> row_begin;
+		std::vector<double> target;
+
+		// phase 1: per row the multiplier of the loss gradient and sum_f
+		std::vector<double> mult;
+		std::vector<FM_MODEL_FLOAT> row_sum; // num_factor values per row
+		std::vector< DVector<FM_MODEL_FLOAT> > thread_sum; // scratch of fm_model::predict, one per thread
+		std::vector< DVector<FM_MODEL_FLOAT> > thread_sum_sqr;
+
+		// phase 2: column index of the batch; slot(id) is the column of feature id or -1
+		DVector<int> slot;
+		std::vector<uint> slot_attr; // feature id of a column
+		std::vector<uint> col_begin; // start of a column in col_entry (num_slots+1 values)
+		struct batch_entry {
+			uint row;
+			DATA_FLOAT value;
+		};
+		std::vector<batch_entry> col_entry;
+		std::vector<double> thread_grad_v; // num_factor values per thread
+
+	public:
+		uint batch_size;
+
+		fm_learn_sgd_batch() { batch_size = 256; }
+
+		virtual void init() {
+			fm_learn_sgd::init();
+
+			if (log != NULL) {
+				log->addField("rmse_train", std::numeric_limits<double>::quiet_NaN());
+			}
+		}
+
+		virtual void learn(Data& train, Data& test) {
+			fm_learn_sgd::learn(train, test);
+
+			std::cout << "SGD: DON'T FORGET TO SHUFFLE THE ROWS IN TRAINING DATA TO GET THE BEST RESULTS." << std::endl;
+			std::cout << "SGD: batch size " << batch_size << ", " << num_threads << " threads" << std::endl;
+
+			rows.resize(batch_size);
+			row_begin.resize(batch_size);
+			target.resize(batch_size);
+			mult.resize(batch_size);
+			row_sum.resize((uint64) batch_size * fm->num_factor);
+			slot.setSize(fm->num_attribute);
+			slot.init(-1);
+			thread_sum.clear(); // DVector is not copyable; the elements are created in place and not moved afterwards
+			thread_sum_sqr.clear();
+			thread_sum.resize(num_threads);
+			thread_sum_sqr.resize(num_threads);
+			for (int t = 0; t < num_threads; t++) {
+				thread_sum[t].setSize(fm->num_factor);
+				thread_sum_sqr[t].setSize(fm->num_factor);
+			}
+			thread_grad_v.resize((uint64) num_threads * fm->num_factor);
+
+			bool random_access = train.data->hasRandomAccess();
+			train.data->adviseSequential();
+			for (int i = 0; i < num_iter; i++) {
+				double iteration_time = getwalltime();
+				train.data->begin();
+				uint num_rows = train.data->getNumRows();
+				for (uint batch_start = 0; batch_start < num_rows; batch_start += batch_size) {
+					uint num_batch_rows = std::min(batch_size, num_rows - batch_start);
+					if (random_access) {
+						for (uint r = 0; r < num_batch_rows; r++) {
+							rows[r] = train.data->getRowAt(batch_start + r);
+							target[r] = train.target(batch_start + r);
+						}
+					} else {
+						// the current row of a LargeSparseMatrix is only valid until next()
+						entries.clear();
+						for (uint r = 0; r < num_batch_rows; r++, train.data->next()) {
+							sparse_row<DATA_FLOAT>& row = train.data->getRow();
+							row_begin[r] = entries.size();
+							entries.insert(entries.end(), row.data, row.data + row.size);
+							target[r] = train.target(train.data->getRowIndex());
+						}
+						for (uint r = 0; r < num_batch_rows; r++) {
+							uint end = (r+1 < num_batch_rows) ? row_begin[r+1] : entries.size();
+							rows[r].data = entries.empty() ? NULL : &(entries[row_begin[r]]);
+							rows[r].size = end - row_begin[r];
+						}
+					}
+					SGD_batch(num_batch_rows);
+				}
+				if (lazy_reg) {
+					lazy.catch_up_all(fm);
+				}
+				iteration_time = (getwalltime() - iteration_time);
+				double rmse_train = evaluate_train(train, i);
+				double rmse_test = evaluate(test);
+				std::cout << "#Iter=" << std::setw(3) << i << "\tTrain=" << rmse_train << "\tTest=" << rmse_test << report_metrics() << std::endl;
+				if (log != NULL) {
+					log->log("rmse_train", rmse_train);
+					log->log("time_learn", iteration_time);
+					log->newLine();
+				}
+			}
+		}
+
+	protected:
+		// one SGD step on the first num_batch_rows rows of the batch
+		void SGD_batch(uint num_batch_rows) {
+			int num_factor = fm->num_factor;
+
+			// (1) group the entries of the batch by feature
+			slot_attr.clear();
+			col_begin.clear();
+			for (uint r = 0; r < num_batch_rows; r++) {
+				for (uint j = 0; j < rows[r].size; j++) {
+					uint id = rows[r].data[j].id;
+					if (slot(id) < 0) {
+						slot(id) = slot_attr.size();
+						slot_attr.push_back(id);
+						col_begin.push_back(0);
+					}
+					col_begin[slot(id)]++;
+				}
+			}
+			uint num_slots = slot_attr.size();
+			uint num_entries = 0;
+			for (uint s = 0; s < num_slots; s++) {
+				uint count = col_begin[s];
+				col_begin[s] = num_entries;
+				num_entries += count;
+			}
+			col_begin.push_back(num_entries);
+			col_entry.resize(num_entries);
+			for (uint r = 0; r < num_batch_rows; r++) {
+				for (uint j = 0; j < rows[r].size; j++) {
+					batch_entry& e = col_entry[col_begin[slot(rows[r].data[j].id)]++];
+					e.row = r;
+					e.value = rows[r].data[j].value;
+				}
+			}
+			// col_begin[s] is now the end of column s, i.e. the begin of column s+1
+			for (uint s = num_slots; s > 0; s--) {
+				col_begin[s] = col_begin[s-1];
+			}
+			col_begin[0] = 0;
+
+			if (lazy_reg) {
+				lazy.next_step();
+				#pragma omp parallel for num_threads(num_threads) if (num_threads > 1) schedule(static)
+				for (int s = 0; s < (int) num_slots; s++) {
+					lazy.catch_up(fm, slot_attr[s]);
+				}
+			}
+
+			// (2) predict all rows with the current model
+			#pragma omp parallel num_threads(num_threads) if (num_threads > 1)
+			{
+				DVector<FM_MODEL_FLOAT>& sum = thread_sum[get_thread_num()];
+				DVector<FM_MODEL_FLOAT>& sum_sqr = thread_sum_sqr[get_thread_num()];
+				#pragma omp for schedule(static)
+				for (int r = 0; r < (int) num_batch_rows; r++) {
+					double p = fm->predict(rows[r], sum, sum_sqr, binary_train);
+					double y = target[r];
+					if (task == 0) {
+						p = std::min(max_target, p);
+						p = std::max(min_target, p);
+						mult[r] = -(y-p);
+					} else if (task == 1) {
+						mult[r] = -y*(1.0-1.0/(1.0+exp(-y*p)));
+					}
+					std::copy(sum.value, sum.value + num_factor, &(row_sum[(uint64) r * num_factor]));
+				}
+			}
+
+			// (3) apply the averaged gradients; each feature is owned by one thread
+			double scale = 1.0 / num_batch_rows;
+			if (fm->k0) {
+				double grad = 0;
+				for (uint r = 0; r < num_batch_rows; r++) {
+					grad += mult[r];
+				}
+				FM_MODEL_FLOAT& w0 = fm->w0;
+				w0 -= learn_rate * (grad * scale + fm->reg0 * w0);
+			}
+			#pragma omp parallel num_threads(num_threads) if (num_threads > 1)
+			{
+				double* grad_v = &(thread_grad_v[(uint64) get_thread_num() * num_factor]);
+				#pragma omp for schedule(dynamic, 512)
+				for (int s = 0; s < (int) num_slots; s++) {
+					uint id = slot_attr[s];
+					// grad_v(f) = sum_r mult_r * (sum_rf * x_r - v_f * x_r^2)
+					double grad_w = 0, grad_sqr = 0;
+					std::fill(grad_v, grad_v + num_factor, 0.0);
+					for (uint c = col_begin[s]; c < col_begin[s+1]; c++) {
+						double x = col_entry[c].value;
+						double m = mult[col_entry[c].row] * x;
+						grad_w += m;
+						grad_sqr += m * x;
+						const FM_MODEL_FLOAT* sum_r = &(row_sum[(uint64) col_entry[c].row * num_factor]);
+						for (int f = 0; f < num_factor; f++) {
+							grad_v[f] += m * sum_r[f];
+						}
+					}
+					if (fm->k1) {
+						FM_MODEL_FLOAT& w = fm->w(id);
+						w -= learn_rate * (grad_w * scale + fm->regw * w);
+					}
+					for (int f = 0; f < num_factor; f++) {
+						FM_MODEL_FLOAT& v = fm->v(f,id);
+						v -= learn_rate * ((grad_v[f] - v * grad_sqr) * scale + fm->regv * v);
+					}
+				}
+			}
+
+			for (uint s = 0; s < num_slots; s++) {
+				slot(slot_attr[s]) = -1;
+			}
+		}
+};
+
+#endif /*FM_LEARN_SGD_BATCH_H_*/
@@ -5,7 +5,7 @@
 	Steffen Rendle (2010): Factorization Machines, in Proceedings of the 10th IEEE International Conference on Data Mining (ICDM 2010), Sydney, Australia.
 
 	Author:   Steffen Rendle, http://www.libfm.org/
-	modified: 2012-01-04
+	modified: 2013-09-09
 
 	Copyright 2010-2012 Steffen Rendle, see license.txt for more information
 */
@@ -29,35 +29,90 @@ class fm_learn_sgd_element: public fm_learn_sgd {
 			fm_learn_sgd::learn(train, test);
 
 			std::cout << "SGD: DON'T FORGET TO SHUFFLE THE ROWS IN TRAINING DATA TO GET THE BEST RESULTS." << std::endl; 
+
+			bool use_hogwild = (num_threads > 1);
+			if (use_hogwild && lazy_reg) {
+				std::cout << "SGD: lazy regularization counts the steps sequentially; running single-threaded." << std::endl;
+				use_hogwild = false;
+			}
+			if (use_hogwild && ! train.data->hasRandomAccess()) {
+				std::cout << "SGD: training data does not support random access (use -cache_size 0 or -mmap 1); running single-threaded." << std::endl;
+				use_hogwild = false;
+			}
+			if (use_hogwild) {
+				std::cout << "SGD: Hogwild with " << num_threads << " threads" << std::endl;
+				train.data->adviseRandom();
+			} else {
+				train.data->adviseSequential();
+			}
 			// SGD
 			for (int i = 0; i < num_iter; i++) {
 			
-				double iteration_time = getusertime();
-				for (train.data->begin(); !train.data->end(); train.data->next()) {
-
-					//calculate multplier
-					double p = fm->predict(train.data->getRow(), sum, sum_sqr);
-					double mult = 0;
-					if (task == 0) {//regression task
-					//look carefully how to calculate the deriavative of theta
-						p = std::min(max_target, p);//promise within in the range
-						p = std::max(min_target, p);//promise within in the range
-						mult = -(train.target(train.data->getRowIndex())-p);//mult = -(yi - y_predict)
-					} else if (task == 1) {
-						mult = -train.target(train.data->getRowIndex())*(1.0-1.0/(1.0+exp(-train.target(train.data->getRowIndex())*p)));
-					}				
-					SGD(train.data->getRow(), mult, sum);					
-				}				
-				iteration_time = (getusertime() - iteration_time);
-				double rmse_train = evaluate(train);
+				double iteration_time = getwalltime();
+				if (use_hogwild) {
+					learn_hogwild(train);
+				} else {
+					for (train.data->begin(); !train.data->end(); train.data->next()) {
+						SGD_case(train.data->getRow(), train.target(train.data->getRowIndex()), sum, sum_sqr);
+					}
+				}
+				if (lazy_reg) {
+					lazy.catch_up_all(fm);
+				}
+				iteration_time = (getwalltime() - iteration_time);
+				double rmse_train = evaluate_train(train, i);
 				double rmse_test = evaluate(test);
-				std::cout << "#Iter=" << std::setw(3) << i << "\tTrain=" << rmse_train << "\tTest=" << rmse_test << std::endl;
+				std::cout << "#Iter=" << std::setw(3) << i << "\tTrain=" << rmse_train << "\tTest=" << rmse_test << report_metrics() << std::endl;
 				if (log != NULL) {
 					log->log("rmse_train", rmse_train);
 					log->log("time_learn", iteration_time);
 					log->newLine();
 				}
 			}		
+			if ((optimizer.method == FM_OPT_FTRL) && fm->k1) {
+				uint num_zero = 0;
+				for (uint i = 0; i < fm->num_attribute; i++) {
+					if (fm->w(i) == 0) { num_zero++; }
+				}
+				std::cout << "FTRL: " << num_zero << " of " << fm->num_attribute << " 1-way interactions are zero" << std::endl;
+			}
+		}
+
+	protected:
+		// one SGD step on case x with target y; sum and sum_sqr are scratch vectors of size num_factor
+		void SGD_case(sparse_row<DATA_FLOAT> &x, const double y, DVector<FM_MODEL_FLOAT> &sum, DVector<FM_MODEL_FLOAT> &sum_sqr) {
+			if (lazy_reg) {
+				lazy.next_step();
+				lazy.catch_up(fm, x);
+			}
+			//calculate multplier
+			double p = fm->predict(x, sum, sum_sqr, binary_train);
+			double mult = 0;
+			if (task == 0) {//regression task
+			//look carefully how to calculate the deriavative of theta
+				p = std::min(max_target, p);//promise within in the range
+				p = std::max(min_target, p);//promise within in the range
+				mult = -(y-p);//mult = -(yi - y_predict)
+			} else if (task == 1) {
+				mult = -y*(1.0-1.0/(1.0+exp(-y*p)));
+			}				
+			SGD(x, mult, sum);					
+		}
+
+		// Hogwild (Niu et al., 2011): each thread runs SGD over its own contiguous shard
+		// of the rows and updates the shared model without locks. Updates of sparse
+		// cases rarely collide, so lost updates have almost no effect on the result.
+		void learn_hogwild(Data& train) {
+			uint num_rows = train.data->getNumRows();
+			#pragma omp parallel num_threads(num_threads)
+			{
+				DVector<FM_MODEL_FLOAT> thread_sum(fm->num_factor), thread_sum_sqr(fm->num_factor);
+				#pragma omp for schedule(static)
+				for (uint r = 0; r < num_rows; r++) {
+					sparse_row<DATA_FLOAT> x = train.data->getRowAt(r);
+					SGD_case(x, train.target(r), thread_sum, thread_sum_sqr);
+				}
+			}
 		}
 		
 };
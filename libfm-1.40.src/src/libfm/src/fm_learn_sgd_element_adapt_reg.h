@@ -40,7 +40,7 @@ class fm_learn_sgd_element_adapt_reg: public fm_learn_sgd {
 
 		// for each parameter there is one gradient to store
 		DVector<double> grad_w; 
-		DMatrix<double> grad_v;
+		fm_v_matrix grad_v;
 
 		Data* validation;
 
@@ -119,22 +119,22 @@ class fm_learn_sgd_element_adapt_reg: public fm_learn_sgd {
 
 			// make the update with my regularization constants:
 			if (fm->k0) {
-				double& w0 = fm->w0;
+				FM_MODEL_FLOAT& w0 = fm->w0;
 				double grad_0 = mult;
 				w0 -= learn_rate * (grad_0 + 2 * reg_0 * w0);
 			}
 			if (fm->k1) {
 				for (uint i = 0; i < x.size; i++) {
 					uint g = meta->attr_group(x.data[i].id);
-					double& w = fm->w(x.data[i].id);
+					FM_MODEL_FLOAT& w = fm->w(x.data[i].id);
 					grad_w(x.data[i].id) = mult * x.data[i].value;
 					w -= learn_rate * (grad_w(x.data[i].id) + 2 * reg_w(g) * w);
 				}
 			}	
-			for (int f = 0; f < fm->num_factor; f++) {
-				for (uint i = 0; i < x.size; i++) {
-					uint g = meta->attr_group(x.data[i].id);
-					double& v = fm->v(f,x.data[i].id);
+			for (uint i = 0; i < x.size; i++) {
+				uint g = meta->attr_group(x.data[i].id);
+				for (int f = 0; f < fm->num_factor; f++) {
+					FM_MODEL_FLOAT& v = fm->v(f,x.data[i].id);
 					grad_v(f,x.data[i].id) = mult * (x.data[i].value * (sum(f) - v * x.data[i].value)); // grad_v_if = (y(x)-y) * [ x_i*(\sum_j x_j v_jf) - v_if*x^2 ]			
 					v -= learn_rate * (grad_v(f,x.data[i].id) + 2 * reg_v(g,f) * v);
 				}
@@ -150,7 +150,7 @@ class fm_learn_sgd_element_adapt_reg: public fm_learn_sgd {
 				for (uint i = 0; i < x.size; i++) {
 					assert(x.data[i].id < fm->num_attribute);
 					uint g = meta->attr_group(x.data[i].id);
-					double& w = fm->w(x.data[i].id); 
+					FM_MODEL_FLOAT& w = fm->w(x.data[i].id); 
 					double w_dash = w - learn_rate * (grad_w(x.data[i].id) + 2 * reg_w(g) * w);
 					p += w_dash * x.data[i].value; 
 				}
@@ -158,14 +158,18 @@ class fm_learn_sgd_element_adapt_reg: public fm_learn_sgd {
 			for (int f = 0; f < fm->num_factor; f++) {
 				sum(f) = 0.0;
 				sum_sqr(f) = 0.0;
-				for (uint i = 0; i < x.size; i++) {
-					uint g = meta->attr_group(x.data[i].id);
-					double& v = fm->v(f,x.data[i].id); 
+			}
+			for (uint i = 0; i < x.size; i++) {
+				uint g = meta->attr_group(x.data[i].id);
+				for (int f = 0; f < fm->num_factor; f++) {
+					FM_MODEL_FLOAT& v = fm->v(f,x.data[i].id); 
 					double v_dash = v - learn_rate * (grad_v(f,x.data[i].id) + 2 * reg_v(g,f) * v);
 					double d = v_dash * x.data[i].value;
 					sum(f) += d;
 					sum_sqr(f) += d*d;
 				}
+			}
+			for (int f = 0; f < fm->num_factor; f++) {
 				p += 0.5 * (sum(f)*sum(f) - sum_sqr(f));
 			}
 			return p;
@@ -205,7 +209,7 @@ class fm_learn_sgd_element_adapt_reg: public fm_learn_sgd {
 				for (uint i = 0; i < x.size; i++) {
 					// v_if' =  [ v_if * (1-alpha*lambda_v_f) - alpha * grad_v_if] 
 					uint g = meta->attr_group(x.data[i].id);
-					double& v = fm->v(f,x.data[i].id); 
+					FM_MODEL_FLOAT& v = fm->v(f,x.data[i].id); 
 					double v_dash = v - learn_rate * (grad_v(f,x.data[i].id) + 2 * reg_v(g,f) * v);
 					
 					sum_f_dash += v_dash * x.data[i].value;
@@ -264,6 +268,8 @@ class fm_learn_sgd_element_adapt_reg: public fm_learn_sgd {
 			
 			std::cout << "Using " << train.data->getNumRows() << " rows for training model parameters and " << validation->data->getNumRows() << " for training shrinkage." << std::endl;
 
+			train.data->adviseSequential();
+			validation->data->adviseSequential();
 			// SGD
 			for (int i = 0; i < num_iter; i++) {
 				double iteration_time = getusertime();
@@ -289,9 +295,9 @@ class fm_learn_sgd_element_adapt_reg: public fm_learn_sgd {
 				iteration_time = (getusertime() - iteration_time);
 	
 				double rmse_val = evaluate(*validation);
-				double rmse_train = evaluate(train);
+				double rmse_train = evaluate_train(train, i);
 				double rmse_test = evaluate(test);
-				std::cout << "#Iter=" << std::setw(3) << i << "\tTrain=" << rmse_train << "\tTest=" << rmse_test << std::endl;
+				std::cout << "#Iter=" << std::setw(3) << i << "\tTrain=" << rmse_train << "\tTest=" << rmse_test << report_metrics() << std::endl;
 				if (log != NULL) {
 					log->log("wmean", mean_w);						
 					log->log("wvar", var_w);					
@@ -0,0 +1,387 @@
+/*
+	Pairwise ranking (BPR) with Stochastic Gradient Descent
+
+	Every row with a positive target is an observed (context, item) pair. Each step takes such a
+	row x_pos, draws a negative x_neg and minimizes -ln sigmoid(y(x_pos) - y(x_neg)) with fm_pairSGD.
+	The negatives are drawn from an alias table in O(1):
+	- with item_group >= 0, the item of a row are its attributes of this attribute group (-meta);
+	  the first of them identifies the item. x_neg is x_pos with its item replaced by a candidate
+	  item, i.e. an item of any training row, drawn uniformly or by its number of positive rows.
+	- with item_group < 0, x_neg is a training row with a non-positive target, drawn uniformly.
+	With several threads the positive rows are processed Hogwild (see fm_learn_sgd_element).
+
+	With item_group >= 0, evaluate computes Precision@k and NDCG@k in one pass over the data: a
+	query is a maximal run of consecutive rows with the same attributes outside item_group (i.e.
+	the candidates of a user are listed together), the rows with a positive target are relevant.
+	Without item_group there are no queries; evaluate reports the accuracy and the AUC over all
+	rows like the other learners of task c.
+
+	Based on the publication(s):
+	Steffen Rendle, Christoph Freudenthaler, Zeno Gantner, Lars Schmidt-Thieme (2009): BPR: Bayesian Personalized Ranking from Implicit Feedback, in Proceedings of the 25th Conference on Uncertainty in Artificial Intelligence (UAI 2009).
+*/
+
+#ifndef FM_LEARN_SGD_PAIR_H_
+#define FM_LEARN_SGD_PAIR_H_
+
+#include <vector>
+#include <algorithm>
+#include <sstream>
+#include "fm_learn_sgd.h"
+#include "../../util/random.h"
+
+class fm_learn_sgd_pair: public fm_learn_sgd {
+	protected:
+		// scratch of one thread
+		struct pair_scratch {
+			DVector<FM_MODEL_FLOAT> sum_pos, sum_neg, sum_sqr;
+			DVector<bool> grad_visited;
+			DVector<double> grad;
+			std::vector< sparse_entry<DATA_FLOAT> > neg_entries;
+		};
+
+		std::vector<uint> pos_rows;
+		std::vector<int> pos_item; // candidate item of a positive row
+		std::vector<uint> neg_rows; // candidates if item_group < 0
+		std::vector< sparse_entry<DATA_FLOAT> > item_entries; // attributes of the candidate items
+		std::vector<uint> item_begin; // start of a candidate in item_entries (num_items+1 values)
+		ran_alias_table neg_table;
+
+		double last_prec, last_ndcg; // of the last evaluate
+
+	public:
+		int item_group;
+		bool neg_popularity; // draw the candidate items by their number of positive rows
+		uint rank_k;
+
+		fm_learn_sgd_pair() {
+			item_group = -1;
+			neg_popularity = false;
+			rank_k = 10;
+			last_prec = last_ndcg = std::numeric_limits<double>::quiet_NaN();
+		}
+
+		virtual void init() {
+			fm_learn_sgd::init();
+
+			if (log != NULL) {
+				log->addField("pair_accuracy", std::numeric_limits<double>::quiet_NaN());
+				log->addField("prec_at_k", std::numeric_limits<double>::quiet_NaN());
+				log->addField("ndcg_at_k", std::numeric_limits<double>::quiet_NaN());
+			}
+		}
+
+		virtual void learn(Data& train, Data& test) {
+			fm_learn_sgd::learn(train, test);
+
+			if (task != TASK_CLASSIFICATION) {
+				throw "sgd_pair needs task c (the rows with a positive target are the observed pairs)";
+			}
+			if ((item_group >= 0) && ((uint) item_group >= meta->num_attr_groups)) {
+				throw "item_group is not an attribute group of the meta data";
+			}
+			if (! train.data->hasRandomAccess()) {
+				throw "sgd_pair needs random access to the training data (use -cache_size 0 or -mmap 1)";
+			}
+			init_candidates(train);
+			std::cout << "BPR: " << pos_rows.size() << " positive rows, " << neg_table.size() << " candidate " << ((item_group >= 0) ? "items" : "rows") << ", " << (neg_popularity ? "popularity" : "uniform") << " sampling" << std::endl;
+
+			bool use_hogwild = (num_threads > 1);
+			if (use_hogwild && lazy_reg) {
+				std::cout << "BPR: lazy regularization counts the steps sequentially; running single-threaded." << std::endl;
+				use_hogwild = false;
+			}
+			int num_scratch = use_hogwild ? num_threads : 1;
+			std::vector<pair_scratch> scratch(num_scratch);
+			for (int t = 0; t < num_scratch; t++) {
+				scratch[t].sum_pos.setSize(fm->num_factor);
+				scratch[t].sum_neg.setSize(fm->num_factor);
+				scratch[t].sum_sqr.setSize(fm->num_factor);
+				scratch[t].grad_visited.setSize(fm->num_attribute);
+				scratch[t].grad.setSize(fm->num_attribute);
+			}
+			if (use_hogwild) {
+				std::cout << "BPR: Hogwild with " << num_threads << " threads" << std::endl;
+			}
+			train.data->adviseRandom(); // shuffled positive rows and sampled negatives
+
+			std::vector<uint> order(pos_rows.size());
+			for (uint i = 0; i < order.size(); i++) { order[i] = i; }
+			for (int i = 0; i < num_iter; i++) {
+				double iteration_time = getwalltime();
+				// visit the positive rows in a new random order in every iteration
+				for (uint j = order.size(); j > 1; j--) {
+					std::swap(order[j-1], order[std::min((uint) (ran_uniform() * j), j-1)]);
+				}
+				uint64 num_pairs = 0, num_correct = 0;
+				unsigned long long seed = ran_bits();
+				#pragma omp parallel num_threads(num_threads) if (use_hogwild) reduction(+:num_pairs,num_correct)
+				{
+					int t = use_hogwild ? get_thread_num() : 0;
+					pair_scratch& s = scratch[t];
+					// the negatives of a thread (i.e. of its static block of rows) come from an own stream
+					ran_thread_seed(seed ^ ran_mix(t));
+					#pragma omp for schedule(static)
+					for (int j = 0; j < (int) order.size(); j++) {
+						uint r = pos_rows[order[j]];
+						sparse_row<DATA_FLOAT> x_pos = train.data->getRowAt(r);
+						sparse_row<DATA_FLOAT> x_neg;
+						if (! draw_negative(train, x_pos, pos_item[order[j]], x_neg, s)) {
+							continue;
+						}
+						num_pairs++;
+						if (SGD_pair(x_pos, x_neg, s)) {
+							num_correct++;
+						}
+					}
+					ran_thread_release();
+				}
+				if (lazy_reg) {
+					lazy.catch_up_all(fm);
+				}
+				iteration_time = (getwalltime() - iteration_time);
+				double pair_accuracy = (double) num_correct / num_pairs;
+				double eval_test = evaluate(test);
+				std::cout << "#Iter=" << std::setw(3) << i << "\tTrain(pair_acc)=" << pair_accuracy << "\tTest" << evaluate_label() << "=" << eval_test << report_metrics() << std::endl;
+				if (log != NULL) {
+					log->log("pair_accuracy", pair_accuracy);
+					log->log("time_learn", iteration_time);
+					log->newLine();
+				}
+			}
+		}
+
+		// NDCG@k (see above); Precision@k is kept for report_metrics. Without item_group: accuracy
+		virtual double evaluate(Data& data) {
+			if (item_group < 0) {
+				return fm_learn_sgd::evaluate(data);
+			}
+			double eval_time = getwalltime();
+			uint num_rows = data.data->getNumRows();
+			bool precomputed = predict_parallel(data);
+			DVector<double> score;
+			if (precomputed) {
+				score.setSize(num_rows);
+				#pragma omp parallel num_threads(num_threads)
+				{
+					DVector<FM_MODEL_FLOAT> thread_sum(fm->num_factor), thread_sum_sqr(fm->num_factor);
+					#pragma omp for schedule(static)
+					for (int r = 0; r < (int) num_rows; r++) {
+						sparse_row<DATA_FLOAT> x = data.data->getRowAt(r);
+						score(r) = fm->predict(x, thread_sum, thread_sum_sqr, data.is_binary);
+					}
+				}
+			}
+			std::vector< sparse_entry<DATA_FLOAT> > context, row_context;
+			std::vector< std::pair<double,bool> > query;
+			double sum_prec = 0, sum_ndcg = 0;
+			uint num_queries = 0;
+			for (data.data->begin(); !data.data->end(); data.data->next()) {
+				sparse_row<DATA_FLOAT>& x = data.data->getRow();
+				uint r = data.data->getRowIndex();
+				row_context.clear();
+				for (uint j = 0; j < x.size; j++) {
+					if (! is_item(x.data[j].id)) {
+						row_context.push_back(x.data[j]);
+					}
+				}
+				if (! query.empty() && ! same_entries(row_context, context)) {
+					add_query(query, sum_prec, sum_ndcg, num_queries);
+				}
+				context.swap(row_context);
+				double p = precomputed ? score(r) : predict_case(data);
+				query.push_back(std::make_pair(p, data.target(r) > 0));
+			}
+			add_query(query, sum_prec, sum_ndcg, num_queries);
+			eval_time = (getwalltime() - eval_time);
+
+			last_prec = sum_prec / num_queries;
+			last_ndcg = sum_ndcg / num_queries;
+			if (log != NULL) {
+				log->log("prec_at_k", last_prec);
+				log->log("ndcg_at_k", last_ndcg);
+				log->log("time_pred", eval_time);
+			}
+			return last_ndcg;
+		}
+
+		// NDCG@k is the value of evaluate (see evaluate_label)
+		virtual std::string report_metrics() {
+			if (item_group < 0) {
+				return fm_learn_sgd::report_metrics();
+			}
+			std::ostringstream ss;
+			ss << "\tTest(P@" << rank_k << ")=" << last_prec;
+			return ss.str();
+		}
+
+		virtual std::string evaluate_label() {
+			if (item_group < 0) {
+				return "";
+			}
+			std::ostringstream ss;
+			ss << "(NDCG@" << rank_k << ")";
+			return ss.str();
+		}
+
+	protected:
+		inline bool is_item(uint id) {
+			return (item_group < 0) || (meta->attr_group(id) == (uint) item_group);
+		}
+
+		// the first attribute of item_group identifies the item of a row; -1 if the row has none
+		inline int item_key(sparse_row<DATA_FLOAT>& x) {
+			for (uint j = 0; j < x.size; j++) {
+				if (is_item(x.data[j].id)) {
+					return x.data[j].id;
+				}
+			}
+			return -1;
+		}
+
+		static bool same_entries(const std::vector< sparse_entry<DATA_FLOAT> >& a, const std::vector< sparse_entry<DATA_FLOAT> >& b) {
+			if (a.size() != b.size()) {
+				return false;
+			}
+			for (uint j = 0; j < a.size(); j++) {
+				if ((a[j].id != b[j].id) || (a[j].value != b[j].value)) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		// collects the positive rows and the candidates of the negatives
+		void init_candidates(Data& train) {
+			if ((item_group < 0) && neg_popularity) {
+				throw "popularity sampling needs item_group";
+			}
+			pos_rows.clear();
+			pos_item.clear();
+			neg_rows.clear();
+			item_entries.clear();
+			item_begin.clear();
+			std::vector<double> weight;
+			std::vector<int> item_index;
+			if (item_group >= 0) {
+				item_index.resize(fm->num_attribute, -1);
+			}
+			for (uint r = 0; r < train.data->getNumRows(); r++) {
+				sparse_row<DATA_FLOAT> x = train.data->getRowAt(r);
+				bool positive = train.target(r) > 0;
+				if (item_group < 0) {
+					if (positive) {
+						pos_rows.push_back(r);
+						pos_item.push_back(-1);
+					} else {
+						neg_rows.push_back(r);
+						weight.push_back(1.0);
+					}
+					continue;
+				}
+				int key = item_key(x);
+				if (key < 0) {
+					continue;
+				}
+				if (item_index[key] < 0) {
+					item_index[key] = item_begin.size();
+					item_begin.push_back(item_entries.size());
+					for (uint j = 0; j < x.size; j++) {
+						if (is_item(x.data[j].id)) {
+							item_entries.push_back(x.data[j]);
+						}
+					}
+					weight.push_back(neg_popularity ? 0.0 : 1.0);
+				}
+				if (positive) {
+					pos_rows.push_back(r);
+					pos_item.push_back(item_index[key]);
+					if (neg_popularity) {
+						weight[item_index[key]] += 1.0;
+					}
+				}
+			}
+			item_begin.push_back(item_entries.size());
+			if (pos_rows.empty()) {
+				throw "sgd_pair: the training data has no row with a positive target";
+			}
+			if (weight.empty()) {
+				throw "sgd_pair: the training data has no candidates for negatives (rows with a non-positive target or, with item_group, items)";
+			}
+			neg_table.init(weight);
+		}
+
+		// draws a negative for the positive row x_pos with item pos_item; false if only the item of
+		// x_pos was drawn. x_neg points to the training data or to s.neg_entries.
+		bool draw_negative(Data& train, sparse_row<DATA_FLOAT>& x_pos, int pos_item, sparse_row<DATA_FLOAT>& x_neg, pair_scratch& s) {
+			if (item_group < 0) {
+				x_neg = train.data->getRowAt(neg_rows[neg_table.draw()]);
+				return true;
+			}
+			const int MAX_TRIALS = 10;
+			int item = pos_item;
+			for (int t = 0; (t < MAX_TRIALS) && (item == pos_item); t++) {
+				item = neg_table.draw();
+			}
+			if (item == pos_item) {
+				return false;
+			}
+			s.neg_entries.clear();
+			for (uint j = 0; j < x_pos.size; j++) {
+				if (! is_item(x_pos.data[j].id)) {
+					s.neg_entries.push_back(x_pos.data[j]);
+				}
+			}
+			s.neg_entries.insert(s.neg_entries.end(), item_entries.begin() + item_begin[item], item_entries.begin() + item_begin[item+1]);
+			x_neg.data = &(s.neg_entries[0]);
+			x_neg.size = s.neg_entries.size();
+			return true;
+		}
+
+		// one BPR step; true if x_pos was ranked above x_neg before the step
+		bool SGD_pair(sparse_row<DATA_FLOAT>& x_pos, sparse_row<DATA_FLOAT>& x_neg, pair_scratch& s) {
+			if (lazy_reg) {
+				lazy.next_step();
+				lazy.catch_up(fm, x_pos);
+				lazy.catch_up(fm, x_neg);
+			}
+			double diff = fm->predict(x_pos, s.sum_pos, s.sum_sqr, binary_train) - fm->predict(x_neg, s.sum_neg, s.sum_sqr, binary_train);
+			// derivative of -ln sigmoid(diff)
+			double mult = -1.0 / (1.0 + exp(diff));
+			fm_pairSGD(fm, learn_rate, x_pos, x_neg, mult, s.sum_pos, s.sum_neg, s.grad_visited, s.grad);
+			return diff > 0;
+		}
+
+		// rows with the same score keep no particular order (the relevance is not a tie breaker)
+		static bool higher_score(const std::pair<double,bool>& a, const std::pair<double,bool>& b) {
+			return a.first > b.first;
+		}
+
+		// adds Precision@k and NDCG@k of a query (if it has a relevant row) and clears it
+		void add_query(std::vector< std::pair<double,bool> >& query, double& sum_prec, double& sum_ndcg, uint& num_queries) {
+			uint num_relevant = 0;
+			for (uint i = 0; i < query.size(); i++) {
+				if (query[i].second) { num_relevant++; }
+			}
+			if (num_relevant > 0) {
+				uint k = std::min((uint) query.size(), rank_k);
+				std::partial_sort(query.begin(), query.begin() + k, query.end(), higher_score);
+				uint hits = 0;
+				double dcg = 0, idcg = 0;
+				for (uint i = 0; i < k; i++) {
+					if (query[i].second) {
+						hits++;
+						dcg += 1.0 / std::log2(i + 2.0);
+					}
+					if (i < num_relevant) {
+						idcg += 1.0 / std::log2(i + 2.0);
+					}
+				}
+				sum_prec += (double) hits / rank_k;
+				sum_ndcg += dcg / idcg;
+				num_queries++;
+			}
+			query.clear();
+		}
+};
+
+#endif /*FM_LEARN_SGD_PAIR_H_*/
@@ -22,13 +22,19 @@ protected:
     uint cache_size;
     bool has_xt;
     bool has_x;
+    bool use_mmap;
+    
+    LargeSparseMatrix<DATA_FLOAT>* openBinaryFile(std::string filename, uint64 cache_size) {
+        return openLargeSparseMatrix<DATA_FLOAT>(filename, cache_size, use_mmap);
+    }
 public:
-    RelationData(uint cache_size, bool has_x, bool has_xt) {
+    RelationData(uint cache_size, bool has_x, bool has_xt, bool use_mmap = false) {
         this->data_t = NULL;
         this->data = NULL;
         this->cache_size = cache_size;
         this->has_x = has_x;
         this->has_xt = has_xt;
+        this->use_mmap = use_mmap;
         this->meta = NULL;
     }
     DataMetaInfo* meta;
@@ -50,6 +56,32 @@ public:
     DVector<uint> data_row_to_relation_row;
     RelationData* data;
     
+    // inverse of data_row_to_relation_row in CSR form: the data rows of relation row j are
+    // relation_row_case(relation_row_begin(j)) ... relation_row_case(relation_row_begin(j+1)-1) in increasing order
+    DVector<uint> relation_row_begin;
+    DVector<uint> relation_row_case;
+    
+    void build_inverse_index() {
+        uint num_relation_rows = data->num_cases;
+        relation_row_begin.setSize(num_relation_rows + 1);
+        relation_row_begin.init(0);
+        for (uint c = 0; c < data_row_to_relation_row.dim; c++) {
+            assert(data_row_to_relation_row(c) < num_relation_rows);
+            relation_row_begin(data_row_to_relation_row(c) + 1)++;
+        }
+        for (uint j = 0; j < num_relation_rows; j++) {
+            relation_row_begin(j+1) += relation_row_begin(j);
+        }
+        relation_row_case.setSize(data_row_to_relation_row.dim);
+        DVector<uint> pos(num_relation_rows);
+        for (uint j = 0; j < num_relation_rows; j++) {
+            pos(j) = relation_row_begin(j);
+        }
+        for (uint c = 0; c < data_row_to_relation_row.dim; c++) {
+            relation_row_case(pos(data_row_to_relation_row(c))++) = c;
+        }
+    }
+    
     void load(std::string filename, uint expected_row_count) {
         bool do_binary = false;
         // check if binary or text format should be read
@@ -89,7 +121,7 @@ void RelationData::load(std::string filename) {
 	
 	if (has_x) {
 		std::cout << "data... ";
-		this->data = new LargeSparseMatrixHD<DATA_FLOAT>(filename + ".x", this_cs);
+		this->data = openBinaryFile(filename + ".x", this_cs);
 		this->num_feature = this->data->getNumCols();
 		num_values = this->data->getNumValues();
 		num_cases = this->data->getNumRows();
@@ -98,7 +130,7 @@ void RelationData::load(std::string filename) {
 	}
 	if (has_xt) {
 		std::cout << "data transpose... ";
-		this->data_t = new LargeSparseMatrixHD<DATA_FLOAT>(filename + ".xt", this_cs);
+		this->data_t = openBinaryFile(filename + ".xt", this_cs);
 		this->num_feature = this->data_t->getNumRows();
 		num_values = this->data_t->getNumValues();
 		num_cases = this->data_t->getNumCols();
@@ -0,0 +1,310 @@
+/*
+ Parser for the libfm text format (parallel, without sscanf)
+
+ A file is split into byte ranges that start at line boundaries. Each range
+ is parsed independently by a text_chunk, either into its own vectors or
+ directly to the final position of the range in preallocated arrays (see
+ setOutput). The positions come from a counting pass (count_only) that only
+ looks for line ends, comments and ':' separators, i.e. no number is parsed
+ twice. In file order, the result is the same as parsing the file line by line.
+ */
+
+#ifndef TEXT_PARSER_H_
+#define TEXT_PARSER_H_
+
+#include <cstdlib>
+#include <cctype>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+#include <fstream>
+
+const uint64 TEXT_PARSER_BLOCK_SIZE = 16*1024*1024;
+
+// Scans an unsigned integer (like "%d" for non-negative values, incl. leading whitespace)
+bool text_scan_uint(const char*& pline, uint& result) {
+	const char* p = pline;
+	while (isspace((unsigned char) *p)) { p++; }
+	if ((*p < '0') || (*p > '9')) { return false; }
+	uint64 v = 0;
+	while ((*p >= '0') && (*p <= '9')) {
+		v = v*10 + (*p - '0');
+		if (v > std::numeric_limits<uint>::max()) { return false; }
+		p++;
+	}
+	result = (uint) v;
+	pline = p;
+	return true;
+}
+
+// Scans a float (like "%f", incl. leading whitespace).
+// Numbers with at most 7 significant digits and a small exponent are converted exactly
+// with one float operation; everything else is passed to strtof.
+bool text_scan_float(const char*& pline, FM_FLOAT& result) {
+	static const float pow10[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+	const char* p = pline;
+	while (isspace((unsigned char) *p)) { p++; }
+	const char* start = p;
+	bool negative = false;
+	if ((*p == '+') || (*p == '-')) {
+		negative = (*p == '-');
+		p++;
+	}
+	uint64 mantissa = 0;
+	int exponent = 0;
+	bool has_digits = false;
+	bool fast = true;
+	while ((*p >= '0') && (*p <= '9')) {
+		if (mantissa < 100000000) { mantissa = mantissa*10 + (*p - '0'); } else { fast = false; }
+		has_digits = true;
+		p++;
+	}
+	if (*p == '.') {
+		p++;
+		while ((*p >= '0') && (*p <= '9')) {
+			if (mantissa < 100000000) { mantissa = mantissa*10 + (*p - '0'); exponent--; } else { fast = false; }
+			has_digits = true;
+			p++;
+		}
+	}
+	if (has_digits && ((*p == 'e') || (*p == 'E'))) {
+		const char* q = p+1;
+		bool exp_negative = false;
+		if ((*q == '+') || (*q == '-')) {
+			exp_negative = (*q == '-');
+			q++;
+		}
+		if ((*q >= '0') && (*q <= '9')) {
+			int e = 0;
+			while ((*q >= '0') && (*q <= '9')) {
+				if (e < 10000) { e = e*10 + (*q - '0'); }
+				q++;
+			}
+			exponent += exp_negative ? -e : e;
+			p = q;
+		} else {
+			fast = false;
+		}
+	}
+	if (! has_digits || isalnum((unsigned char) *p) || (*p == '.') || (mantissa > (1 << 24)) || (exponent < -10) || (exponent > 10)) {
+		fast = false;
+	}
+	if (fast) {
+		float f = (float) mantissa;
+		if (exponent < 0) {
+			f /= pow10[-exponent];
+		} else {
+			f *= pow10[exponent];
+		}
+		result = negative ? -f : f;
+		pline = p;
+		return true;
+	}
+	char* end;
+	float f = strtof(start, &end);
+	if (end == start) { return false; }
+	result = f;
+	pline = end;
+	return true;
+}
+
+class text_chunk {
+	public:
+		// parsed rows if there is no output (see setOutput) and count_only is not set
+		std::vector<DATA_FLOAT> target;
+		std::vector<uint> row_size;
+		std::vector< sparse_entry<DATA_FLOAT> > entries;
+		// nothing is parsed, only num_rows (lines with content) and num_values (':' outside of
+		// comments) are counted; for a valid file these are the numbers a parse yields
+		bool count_only;
+		uint num_rows;
+		uint64 num_values;
+		uint num_feature; // largest feature id + 1
+		DATA_FLOAT min_target;
+		DATA_FLOAT max_target;
+		uint64 num_bytes;
+
+	protected:
+		DATA_FLOAT* target_out;
+		sparse_row<DATA_FLOAT>* row_out;
+		sparse_entry<DATA_FLOAT>* entry_out;
+		uint max_rows;
+		uint64 max_values;
+
+	public:
+		text_chunk() { count_only = false; clear(); }
+
+		void clear() {
+			std::vector<DATA_FLOAT>().swap(target);
+			std::vector<uint>().swap(row_size);
+			std::vector< sparse_entry<DATA_FLOAT> >().swap(entries);
+			num_rows = 0;
+			num_values = 0;
+			num_feature = 0;
+			min_target = +std::numeric_limits<DATA_FLOAT>::max();
+			max_target = -std::numeric_limits<DATA_FLOAT>::max();
+			num_bytes = 0;
+			target_out = NULL;
+			row_out = NULL;
+			entry_out = NULL;
+		}
+
+		// the following rows are written to the arrays (at most max_rows rows and max_values entries)
+		void setOutput(DATA_FLOAT* target_out, sparse_row<DATA_FLOAT>* row_out, sparse_entry<DATA_FLOAT>* entry_out, uint max_rows, uint64 max_values) {
+			clear();
+			this->target_out = target_out;
+			this->row_out = row_out;
+			this->entry_out = entry_out;
+			this->max_rows = max_rows;
+			this->max_values = max_values;
+		}
+
+		// parses one zero-terminated line
+		void parseLine(const char* line) {
+			const char *pline = line;
+			while ((*pline == ' ')  || (*pline == 9)) { pline++; } // skip leading spaces
+			if ((*pline == 0)  || (*pline == '#')) { return; }  // skip empty rows
+			DATA_FLOAT _value;
+			uint _feature;
+			if (! text_scan_float(pline, _value)) {
+				throw "cannot parse line \"" + std::string(line) + "\" at character " + pline[0];
+			}
+			DATA_FLOAT row_target = _value;
+			min_target = std::min(_value, min_target);
+			max_target = std::max(_value, max_target);
+			uint64 row_begin = num_values;
+			do {
+				const char* p = pline;
+				if (! text_scan_uint(p, _feature) || (*p != ':')) { break; }
+				p++;
+				if (! text_scan_float(p, _value)) { break; }
+				pline = p;
+				sparse_entry<DATA_FLOAT> e;
+				e.id = _feature;
+				e.value = _value;
+				if (entry_out != NULL) {
+					if (num_values >= max_values) { throw std::string("the file has changed while reading"); }
+					entry_out[num_values] = e;
+				} else {
+					entries.push_back(e);
+				}
+				num_values++;
+				num_feature = std::max(_feature+1, num_feature);
+			} while (true);
+			if (row_out != NULL) {
+				if (num_rows >= max_rows) { throw std::string("the file has changed while reading"); }
+				target_out[num_rows] = row_target;
+				row_out[num_rows].data = entry_out + row_begin;
+				row_out[num_rows].size = num_values - row_begin;
+			} else {
+				target.push_back(row_target);
+				row_size.push_back(num_values - row_begin);
+			}
+			num_rows++;
+			while ((*pline != 0) && ((*pline == ' ')  || (*pline == 9))) { pline++; } // skip trailing spaces
+			if ((*pline != 0)  && (*pline != '#')) {
+				throw "cannot parse line \"" + std::string(line) + "\" at character " + pline[0];
+			}
+		}
+
+		// counts one line for count_only; the line ends at '\n' or 0
+		void countLine(const char* line) {
+			const char *pline = line;
+			while ((*pline == ' ')  || (*pline == 9)) { pline++; } // skip leading spaces
+			if ((*pline == 0)  || (*pline == '\n') || (*pline == '#')) { return; }  // skip empty rows
+			num_rows++;
+			for (; (*pline != 0) && (*pline != '\n') && (*pline != '#'); pline++) {
+				if (*pline == ':') { num_values++; }
+			}
+		}
+
+		// parses all lines in [begin, end); *end has to be writable, lines are terminated in place
+		void parseBuffer(char* begin, char* end) {
+			*end = 0;
+			if (count_only) {
+				for (char* line = begin; line < end; line++) {
+					countLine(line);
+					line = (char*) memchr(line, '\n', end - line);
+					if (line == NULL) { break; }
+				}
+				num_bytes += end - begin;
+				return;
+			}
+			char* line = begin;
+			while (line < end) {
+				char* eol = line;
+				while ((eol < end) && (*eol != '\n')) { eol++; }
+				*eol = 0;
+				parseLine(line);
+				line = eol + 1;
+			}
+			num_bytes += end - begin;
+		}
+
+		// parses all lines of a file in the byte range [from, to); from has to be the beginning of a line
+		void parseFile(const std::string& filename, uint64 from, uint64 to) {
+			std::ifstream fData(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+			if (! fData.is_open()) {
+				throw "unable to open " + filename;
+			}
+			fData.seekg(from, std::ios_base::beg);
+			std::vector<char> buffer(TEXT_PARSER_BLOCK_SIZE + 1);
+			uint64 carry = 0;
+			uint64 pos = from;
+			while (pos < to) {
+				uint64 len = std::min(to - pos, (uint64) (buffer.size() - 1 - carry));
+				if (len == 0) {
+					// a single line is larger than the buffer
+					buffer.resize(2*buffer.size());
+					continue;
+				}
+				fData.read(&(buffer[carry]), len);
+				if ((uint64) fData.gcount() != len) {
+					throw "error reading " + filename;
+				}
+				pos += len;
+				uint64 filled = carry + len;
+				// parse everything up to the last complete line
+				uint64 last = filled;
+				if (pos < to) {
+					while ((last > 0) && (buffer[last-1] != '\n')) { last--; }
+				}
+				char dummy = buffer[last];
+				parseBuffer(&(buffer[0]), &(buffer[last]));
+				buffer[last] = dummy;
+				carry = filled - last;
+				if (carry > 0) {
+					std::copy(buffer.begin() + last, buffer.begin() + filled, buffer.begin());
+				}
+			}
+			fData.close();
+		}
+};
+
+// returns the position of the first line that starts at or after pos
+uint64 text_find_line_begin(const std::string& filename, uint64 pos, uint64 file_size) {
+	if (pos == 0) { return 0; }
+	std::ifstream fData(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+	if (! fData.is_open()) {
+		throw "unable to open " + filename;
+	}
+	fData.seekg(pos-1, std::ios_base::beg);
+	char c;
+	while ((pos <= file_size) && fData.get(c)) {
+		if (c == '\n') { return pos; }
+		pos++;
+	}
+	return file_size;
+}
+
+uint64 text_file_size(const std::string& filename) {
+	std::ifstream fData(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+	if (! fData.is_open()) {
+		throw "unable to open " + filename;
+	}
+	fData.seekg(0, std::ios_base::end);
+	return fData.tellg();
+}
+
+#endif /*TEXT_PARSER_H_*/
@@ -1,28 +1,37 @@
 /*
-	transpose: Convert a libfm-format file in a binary sparse matrix for x and a dense vector for the target y. 
+	convert: Convert a libfm-format file in a binary sparse matrix for x and a dense vector for the target y.
+
+	The text file is read once in large blocks. Every block is split at line
+	boundaries, the parts are parsed in parallel and written in input order. The
+	header of x and y is written with provisional sizes and patched at the end.
+	Optionally, the transposed x is produced in the same run.
 
 	Author:   Steffen Rendle, http://www.libfm.org/
-	modified: 2013-07-03
+	modified: 2013-09-09
 
 	Copyright 2011-2013 Steffen Rendle, see license.txt for more information
 */
 
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <string>
+#include <vector>
 #include <iterator>
 #include <algorithm>
 #include <iomanip>
 #include "../../util/util.h"
 #include "../../util/cmdline.h"
 #include "../src/Data.h"
+#include "../src/text_parser.h"
+#include "../../util/fmatrix_transpose.h"
 
 /**
- * 
+ *
  * Version history:
  * 1.4.0:
- *	no differences, version numbers are kept in sync over all libfm tools
+ *	single pass over the input with parallel parsing; optional transposed output; compressed format
  * 1.3.6:
  *	binary mode for file access
  * 1.3.4:
@@ -32,13 +41,63 @@
  * 1.0:
  *	first version
  */
- 
+
 
 
 using namespace std;
 
-int main(int argc, char **argv) { 
- 	
+const uint64 CONVERT_BLOCK_SIZE = 32*1024*1024; // bytes of text that are parsed at once
+
+// the rows of one part of a block, already in the binary format of x
+struct convert_part {
+	text_chunk chunk; // the parsed rows, same parser as Data::load
+	std::vector<char> x;
+	uint max_row_bytes;
+	bool binary; // all values are 1.0
+	std::string error; // the first line that could not be parsed
+
+	// compress: 0=plain rows, 1=compressed rows, 2=compressed rows with fp16 values
+	void parse(char* begin, char* end, int compress) {
+		chunk.clear();
+		x.clear();
+		max_row_bytes = 0;
+		binary = true;
+		error.clear();
+		if (end > begin) {
+			if (end[-1] == '\n') { end--; } // parseBuffer terminates the range at end; the next part starts behind the newline
+			try {
+				chunk.parseBuffer(begin, end);
+			} catch (std::string &e) {
+				error = e;
+				return;
+			}
+		}
+		uint64 entry = 0;
+		for (uint r = 0; r < chunk.num_rows; r++) {
+			sparse_row<DATA_FLOAT> row;
+			row.size = chunk.row_size[r];
+			row.data = chunk.entries.empty() ? NULL : &(chunk.entries[entry]);
+			for (uint j = 0; j < row.size; j++) {
+				binary &= (row.data[j].value == 1.0);
+			}
+			uint64 pos = x.size();
+			if (compress) {
+				fmatrix_encode_row(row, compress == 2, x);
+				max_row_bytes = std::max(max_row_bytes, (uint) (x.size() - pos));
+			} else {
+				x.resize(pos + sizeof(uint) + sizeof(sparse_entry<DATA_FLOAT>) * row.size);
+				memcpy(&(x[pos]), &(row.size), sizeof(uint));
+				if (row.size > 0) {
+					memcpy(&(x[pos + sizeof(uint)]), row.data, sizeof(sparse_entry<DATA_FLOAT>) * row.size);
+				}
+			}
+			entry += row.size;
+		}
+	}
+};
+
+int main(int argc, char **argv) {
+
  	srand ( time(NULL) );
 	try {
 		CMDLine cmdline(argc, argv);
@@ -49,10 +108,15 @@ int main(int argc, char **argv) {
 		std::cout << "  WWW:     http://www.libfm.org/" << std::endl;
 		std::cout << "  License: Free for academic use. See license.txt." << std::endl;
 		std::cout << "----------------------------------------------------------------------------" << std::endl;
-		
-		const std::string param_ifile	= cmdline.registerParameter("ifile", "input file name, file has to be in binary sparse format [MANDATORY]");
+
+		const std::string param_ifile	= cmdline.registerParameter("ifile", "input file name, file has to be in libfm text format [MANDATORY]");
 		const std::string param_ofilex	= cmdline.registerParameter("ofilex", "output file name for x [MANDATORY]");
 		const std::string param_ofiley	= cmdline.registerParameter("ofiley", "output file name for y [MANDATORY]");
+		const std::string param_ofilext	= cmdline.registerParameter("ofilext", "output file name for the transposed x; default=none");
+		const std::string param_cache_size = cmdline.registerParameter("cache_size", "memory for sorting the transposed x, default=200000000");
+		const std::string param_tmp = cmdline.registerParameter("tmp", "prefix for temporary files of the transposition; default=ofilext");
+		const std::string param_compress = cmdline.registerParameter("compress", "format of x: 0=plain, 1=compressed (delta coded ids, implicit 1.0 values), 2=compressed with values rounded to fp16; default=0");
+		const std::string param_threads = cmdline.registerParameter("threads", "number of threads for parsing; default=all cores");
 		const std::string param_help       = cmdline.registerParameter("help", "this screen");
 
 
@@ -65,124 +129,173 @@ int main(int argc, char **argv) {
 		std::string ifile = cmdline.getValue(param_ifile);
 		std::string ofilex = cmdline.getValue(param_ofilex);
 		std::string ofiley = cmdline.getValue(param_ofiley);
+		int num_threads = cmdline.getValue(param_threads, get_num_threads());
+		if (num_threads < 1) {
+			throw "threads has to be at least 1";
+		}
+		int compress = cmdline.getValue(param_compress, 0);
+		if ((compress < 0) || (compress > 2)) {
+			throw "compress has to be 0, 1 or 2";
+		}
 
 		uint num_rows = 0;
 		uint64 num_values = 0;
 		uint num_feature = 0;
-		bool has_feature = false;
 		DATA_FLOAT min_target = +std::numeric_limits<DATA_FLOAT>::max();
 		DATA_FLOAT max_target = -std::numeric_limits<DATA_FLOAT>::max();
 
-		// (1) determine the number of rows and the maximum feature_id
-		{
-			std::ifstream fData(ifile.c_str());
-			if (! fData.is_open()) {
-				throw "unable to open " + ifile;
-			}
-			DATA_FLOAT _value;
-			int nchar;
-			uint _feature;
-			while (!fData.eof()) {
-				std::string line;
-				std::getline(fData, line);
-				const char *pline = line.c_str();
-				while ((*pline == ' ')  || (*pline == 9)) { pline++; } // skip leading spaces
-				if ((*pline == 0)  || (*pline == '#')) { continue; }  // skip empty rows
-				if (sscanf(pline, "%f%n", &_value, &nchar) >=1) {
-					pline += nchar;
-					min_target = std::min(_value, min_target);
-					max_target = std::max(_value, max_target);			
-					num_rows++;
-					while (sscanf(pline, "%d:%f%n", &_feature, &_value, &nchar) >= 2) {
-						pline += nchar;	
-						num_feature = std::max(_feature, num_feature);
-						has_feature = true;
-						num_values++;	
-					}
-					while ((*pline != 0) && ((*pline == ' ')  || (*pline == 9))) { pline++; } // skip trailing spaces
-					if ((*pline != 0)  && (*pline != '#')) { 
-						throw "cannot parse line \"" + line + "\" at character " + pline[0];
-					}
-				} else {
-					throw "cannot parse line \"" + line + "\" at character " + pline[0];
-				}
-			} 
-			fData.close();
+		double convert_time = getwalltime();
+
+		FILE* in = fopen(ifile.c_str(), "rb");
+		if (in == NULL) {
+			throw "unable to open " + ifile;
 		}
-		if (has_feature) {	
-			num_feature++; // number of feature is bigger (by one) than the largest value
+		std::ofstream out_x(ofilex.c_str(), ios_base::out | ios_base::binary);
+		if (! out_x.is_open()) {
+			throw "unable to open " + ofilex;
 		}
-		std::cout << "num_rows=" << num_rows << "\tnum_values=" << num_values << "\tnum_features=" << num_feature << "\tmin_target=" << min_target << "\tmax_target=" << max_target << std::endl;
-		
-		sparse_row<DATA_FLOAT> row;
-		row.data = new sparse_entry<DATA_FLOAT>[num_feature];
-
-		// (2) read the data and write it back simultaneously
-		{
-			std::ifstream fData(ifile.c_str());
-			if (! fData.is_open()) {
-				throw "unable to open " + ifile;
+		std::ofstream out_y(ofiley.c_str(), ios_base::out | ios_base::binary);
+		if (! out_y.is_open()) {
+			throw "unable to open " + ofiley;
+		}
+		// provisional headers, the sizes are written at the end; the compressed header starts like the plain one
+		compressed_file_header fh;
+		fh.id = compress ? FMATRIX_COMPRESSED_FILE_ID : FMATRIX_EXPECTED_FILE_ID;
+		fh.num_values = 0;
+		fh.num_rows = 0;
+		fh.num_cols = 0;
+		fh.float_size = sizeof(DATA_FLOAT);
+		fh.data_size = 0;
+		fh.max_row_bytes = 0;
+		fh.flags = FMATRIX_FLAG_BINARY;
+		uint header_size = compress ? sizeof(compressed_file_header) : sizeof(file_header);
+		out_x.write(reinterpret_cast<char*>(&fh), header_size);
+		uint file_version = 1;
+		uint data_size = sizeof(DATA_FLOAT);
+		out_y.write(reinterpret_cast<char*>(&file_version), sizeof(file_version));
+		out_y.write(reinterpret_cast<char*>(&data_size), sizeof(data_size));
+		out_y.write(reinterpret_cast<char*>(&num_rows), sizeof(num_rows));
+
+		LargeSparseMatrixTranspose<DATA_FLOAT>* transpose = NULL;
+		if (cmdline.hasParameter(param_ofilext)) {
+			transpose = new LargeSparseMatrixTranspose<DATA_FLOAT>(cmdline.getValue(param_cache_size, 200000000), cmdline.getValue(param_tmp, cmdline.getValue(param_ofilext)), num_threads);
+			transpose->begin();
+		}
+
+		// (1) read the text in blocks; a line that does not end in a block is carried over to the next one
+		std::vector<char> text(CONVERT_BLOCK_SIZE + 1);
+		uint64 filled = 0;
+		bool at_eof = false;
+		std::vector<convert_part> parts(num_threads);
+		std::vector<char*> part_begin(num_threads + 1);
+		std::vector< sparse_entry<DATA_FLOAT> > row_data(1); // decoded compressed rows for the transposition
+		while (! at_eof) {
+			uint64 read = fread(&(text[filled]), 1, text.size() - 1 - filled, in);
+			filled += read;
+			at_eof = (filled < text.size() - 1);
+			uint64 end = filled;
+			if (! at_eof) {
+				while ((end > 0) && (text[end-1] != '\n')) { end--; }
+				if (end == 0) {
+					// a line longer than the block
+					text.resize(2 * text.size());
+					continue;
+				}
 			}
-			std::ofstream out_x(ofilex.c_str(), ios_base::out | ios_base::binary);
-			if (! out_x.is_open()) {
-				throw "unable to open " + ofilex;
-			} else {
-				file_header fh;
-				fh.id = FMATRIX_EXPECTED_FILE_ID;
-				fh.num_values = num_values;
-				fh.num_rows = num_rows;
-				fh.num_cols = num_feature;
-				fh.float_size = sizeof(DATA_FLOAT);
-				out_x.write(reinterpret_cast<char*>(&fh), sizeof(fh));
+			text[filled] = 0;
+
+			// (2) parse the parts of the block in parallel
+			char* block = &(text[0]);
+			part_begin[0] = block;
+			for (int p = 1; p < num_threads; p++) {
+				char* b = std::max(block + end * p / num_threads, part_begin[p-1]);
+				while ((b < block + end) && (b > block) && (b[-1] != '\n')) { b++; }
+				part_begin[p] = b;
 			}
-			std::ofstream out_y(ofiley.c_str(), ios_base::out | ios_base::binary);
-			if (! out_y.is_open()) {
-				throw "unable to open " + ofiley;
-			} else {
-				uint file_version = 1;
-				uint data_size = sizeof(DATA_FLOAT);
-				out_y.write(reinterpret_cast<char*>(&file_version), sizeof(file_version));
-				out_y.write(reinterpret_cast<char*>(&data_size), sizeof(data_size));
-				out_y.write(reinterpret_cast<char*>(&num_rows), sizeof(num_rows));
+			part_begin[num_threads] = block + end;
+			#pragma omp parallel for num_threads(num_threads) schedule(static, 1)
+			for (int p = 0; p < num_threads; p++) {
+				parts[p].parse(part_begin[p], part_begin[p+1], compress);
 			}
 
-			DATA_FLOAT _value;
-			int nchar;
-			uint _feature;
-			while (!fData.eof()) {
-				std::string line;
-				std::getline(fData, line);
-				const char *pline = line.c_str();
-				while ((*pline == ' ')  || (*pline == 9)) { pline++; } // skip leading spaces
-				if ((*pline == 0)  || (*pline == '#')) { continue; }  // skip empty rows
-				if (sscanf(pline, "%f%n", &_value, &nchar) >=1) {
-					pline += nchar;
-					out_y.write(reinterpret_cast<char*>(&(_value)), sizeof(DATA_FLOAT));
-					row.size = 0;
-					while (sscanf(pline, "%d:%f%n", &_feature, &_value, &nchar) >= 2) {
-						pline += nchar;	
-						assert(row.size < num_feature);
-						row.data[row.size].id = _feature;
-						row.data[row.size].value = _value;
-						row.size++;	
+			// (3) write the parts in input order
+			for (int p = 0; p < num_threads; p++) {
+				convert_part& part = parts[p];
+				if (! part.error.empty()) {
+					throw part.error;
+				}
+				std::vector<DATA_FLOAT>& y = part.chunk.target;
+				if (! y.empty()) {
+					out_x.write(&(part.x[0]), part.x.size());
+					out_y.write(reinterpret_cast<char*>(&(y[0])), sizeof(DATA_FLOAT) * y.size());
+				}
+				if ((transpose != NULL) && compress) {
+					row_data.resize(std::max((uint64) part.max_row_bytes, (uint64) row_data.size())); // every entry takes at least one byte
+					sparse_row<DATA_FLOAT> row;
+					const unsigned char* pos = reinterpret_cast<const unsigned char*>(part.x.empty() ? NULL : &(part.x[0]));
+					for (uint i = 0; i < y.size(); i++) {
+						row.data = &(row_data[0]);
+						pos = fmatrix_decode_row(pos, row);
+						transpose->addRow(num_rows, row);
+						num_rows++;
 					}
-					out_x.write(reinterpret_cast<char*>(&(row.size)), sizeof(uint));
-					out_x.write(reinterpret_cast<char*>(row.data), sizeof(sparse_entry<DATA_FLOAT>)*row.size);
-					while ((*pline != 0) && ((*pline == ' ')  || (*pline == 9))) { pline++; } // skip trailing spaces
-					if ((*pline != 0)  && (*pline != '#')) { 
-						throw "cannot parse line \"" + line + "\" at character " + pline[0];
+				} else if (transpose != NULL) {
+					sparse_row<DATA_FLOAT> row;
+					for (uint64 pos = 0; pos < part.x.size(); pos += sizeof(uint) + sizeof(sparse_entry<DATA_FLOAT>) * row.size) {
+						memcpy(&(row.size), &(part.x[pos]), sizeof(uint));
+						row.data = reinterpret_cast<sparse_entry<DATA_FLOAT>*>(&(part.x[pos + sizeof(uint)]));
+						transpose->addRow(num_rows, row);
+						num_rows++;
 					}
 				} else {
-					throw "cannot parse line \"" + line + "\" at character " + pline[0];
+					num_rows += y.size();
+				}
+				num_values += part.chunk.num_values;
+				fh.data_size += part.x.size();
+				fh.max_row_bytes = std::max(part.max_row_bytes, fh.max_row_bytes);
+				if (! part.binary) {
+					fh.flags &= ~FMATRIX_FLAG_BINARY;
 				}
-			}	
-			fData.close();
-			out_x.close();
-			out_y.close();
+				num_feature = std::max(part.chunk.num_feature, num_feature);
+				min_target = std::min(part.chunk.min_target, min_target);
+				max_target = std::max(part.chunk.max_target, max_target);
+			}
+
+			memmove(&(text[0]), &(text[end]), filled - end);
+			filled -= end;
+		}
+		fclose(in);
 
+		// (4) write the final sizes and flags into the headers (the flags of the plain format into its sidecar file)
+		fh.num_values = num_values;
+		fh.num_rows = num_rows;
+		fh.num_cols = num_feature;
+		out_x.seekp(0);
+		out_x.write(reinterpret_cast<char*>(&fh), header_size);
+		out_x.close();
+		if (out_x.fail()) {
+			throw "error writing " + ofilex;
 		}
+		if (! compress) {
+			fmatrix_save_flags(ofilex, fh.flags, num_values);
+		}
+		out_y.seekp(2 * sizeof(uint));
+		out_y.write(reinterpret_cast<char*>(&num_rows), sizeof(num_rows));
+		out_y.close();
+		if (out_y.fail()) {
+			throw "error writing " + ofiley;
+		}
+		if (transpose != NULL) {
+			transpose->finish(cmdline.getValue(param_ofilext), num_rows, num_feature);
+			delete transpose;
+		}
+		convert_time = getwalltime() - convert_time;
+		std::cout << "num_rows=" << num_rows << "\tnum_values=" << num_values << "\tnum_features=" << num_feature << "\tmin_target=" << min_target << "\tmax_target=" << max_target << std::endl;
+		std::cout << "time=" << convert_time << "s\tthreads=" << num_threads << std::endl;
 	} catch (std::string &e) {
 		std::cerr << e << std::endl;
+	} catch (char const* &e) {
+		std::cerr << e << std::endl;
 	}
 
 }
@@ -0,0 +1,271 @@
+/*
+	libFM-predict: Predict a data set with a model written by libFM -save_model.
+
+	The data is read block by block: binary x/y files through the LargeSparseMatrix
+	interface, files in the libfm text format in blocks of complete lines that are parsed
+	in parallel (text_chunk). Each block is predicted in parallel and written in the order
+	of the input rows, so the memory does not depend on the size of the data.
+*/
+
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iomanip>
+#include "../../util/util.h"
+#include "../../util/cmdline.h"
+#include "../../fm_core/fm_model.h"
+#include "../src/Data.h"
+#include "../src/text_parser.h"
+#include "../src/fm_learn.h"
+#include "../src/fm_learn_sgd_element.h"
+#include "../src/fm_learn_mcmc_simultaneous.h"
+
+
+using namespace std;
+
+const uint PREDICT_BLOCK_SIZE = 65536; // rows per block of binary data
+const uint64 PREDICT_TEXT_BLOCK_SIZE = 4*1024*1024; // bytes per block of text data
+const uint PREDICT_OUTPUT_WIDTH = 32;  // characters reserved per formatted prediction
+
+// rows of a block with the values of attributes the model does not know removed
+class predict_block {
+	public:
+		std::vector< sparse_row<FM_FLOAT> > rows;
+		std::vector<uint> row_begin;
+		std::vector< sparse_entry<FM_FLOAT> > entries;
+		bool binary; // all values of the block are 1.0
+		uint64 num_unknown; // values of attributes that did not exist when the model was learned
+		std::vector<char> text;
+		std::vector<uint> text_size;
+
+		predict_block() { num_unknown = 0; clear(); }
+
+		void clear() {
+			rows.clear();
+			row_begin.clear();
+			entries.clear();
+			binary = true;
+		}
+
+		void add(const sparse_row<DATA_FLOAT>& row, uint num_attribute) {
+			row_begin.push_back(entries.size());
+			for (uint j = 0; j < row.size; j++) {
+				if (row.data[j].id < num_attribute) {
+					entries.push_back(row.data[j]);
+					binary &= (row.data[j].value == 1.0);
+				} else {
+					num_unknown++;
+				}
+			}
+		}
+
+		// predicts the rows in parallel and writes them in order
+		void predict(fm_model& fm, fm_learn& fml, FILE* out) {
+			uint num_rows = row_begin.size();
+			rows.resize(num_rows);
+			for (uint i = 0; i < num_rows; i++) {
+				uint end = (i+1 < num_rows) ? row_begin[i+1] : entries.size();
+				rows[i].data = entries.empty() ? NULL : &(entries[row_begin[i]]);
+				rows[i].size = end - row_begin[i];
+			}
+			text.resize((uint64) num_rows * PREDICT_OUTPUT_WIDTH);
+			text_size.resize(num_rows);
+			#pragma omp parallel
+			{
+				DVector<FM_MODEL_FLOAT> sum(fm.num_factor), sum_sqr(fm.num_factor);
+				#pragma omp for schedule(static)
+				for (int i = 0; i < (int) num_rows; i++) {
+					double p = fml.transform_prediction(fm.predict(rows[i], sum, sum_sqr, binary));
+					// same format as DVector::save
+					text_size[i] = snprintf(&(text[(uint64) i * PREDICT_OUTPUT_WIDTH]), PREDICT_OUTPUT_WIDTH, "%g\n", p);
+				}
+			}
+			for (uint i = 0; i < num_rows; i++) {
+				fwrite(&(text[(uint64) i * PREDICT_OUTPUT_WIDTH]), 1, text_size[i], out);
+			}
+		}
+};
+
+int main(int argc, char **argv) {
+
+	try {
+		CMDLine cmdline(argc, argv);
+		std::cout << "----------------------------------------------------------------------------" << std::endl;
+		std::cout << "libFM-predict" << std::endl;
+		std::cout << "  Version: 1.40" << std::endl;
+		std::cout << "  Author:  Steffen Rendle, steffen.rendle@uni-konstanz.de" << std::endl;
+		std::cout << "  WWW:     http://www.libfm.org/" << std::endl;
+		std::cout << "  License: Free for academic use. See license.txt." << std::endl;
+		std::cout << "----------------------------------------------------------------------------" << std::endl;
+
+		const std::string param_model = cmdline.registerParameter("model", "filename of a model written with libFM -save_model [MANDATORY]");
+		const std::string param_test_file = cmdline.registerParameter("test", "filename for the data to predict (libfm text format or binary x/y files) [MANDATORY]");
+		const std::string param_out = cmdline.registerParameter("out", "filename for the predictions [MANDATORY]");
+		const std::string param_cache_size = cmdline.registerParameter("cache_size", "cache size for data storage (only applicable if data is in binary format), default=infty");
+		const std::string param_mmap = cmdline.registerParameter("mmap", "1=map the model and binary data files into memory; default=0");
+		const std::string param_simd = cmdline.registerParameter("simd", "vector instructions for prediction: auto, avx512, avx2, sse2 or scalar; default=auto");
+		const std::string param_threads = cmdline.registerParameter("threads", "number of threads; default=all cores");
+		const std::string param_help = cmdline.registerParameter("help", "this screen");
+
+		if (cmdline.hasParameter(param_help) || (argc == 1)) {
+			cmdline.print_help();
+			return 0;
+		}
+		cmdline.checkParameters();
+
+		if (cmdline.hasParameter(param_threads)) {
+			int num_threads = cmdline.getValue(param_threads, 1);
+			if (num_threads < 1) { throw "threads has to be at least 1"; }
+			set_num_threads(num_threads);
+		}
+		if (cmdline.hasParameter(param_simd)) {
+			fm_simd::getInstance().select(cmdline.getValue(param_simd));
+		}
+		bool use_mmap = cmdline.getValue(param_mmap, 0) != 0;
+
+		// (1) load the model and setup the predict path of the method it was learned with
+		std::cout << "Loading model...\t" << std::endl;
+		fm_model_file* model_file = new fm_model_file(cmdline.getValue(param_model), use_mmap);
+		fm_model fm;
+		fm.load(model_file); // fm owns the file
+		fm_learn* fml;
+		if (model_file->hasSection("alpha")) {
+			fml = new fm_learn_mcmc_simultaneous();
+		} else {
+			fml = new fm_learn_sgd_element();
+		}
+		fml->fm = &fm;
+		fml->task = (int) model_file->getScalar("task");
+		fml->fm_learn::load(*model_file); // the MCMC hyperparameters are not needed for prediction
+		std::cout << "num_attributes=" << fm.num_attribute << "\tdim=" << fm.k0 << "," << fm.k1 << "," << fm.num_factor << "\ttask=" << ((fml->task == fm_learn::TASK_REGRESSION) ? "r" : "c") << "\tmethod=" << (model_file->hasSection("alpha") ? "mcmc" : "sgd") << "\tsimd=" << fm_simd::getInstance().name << std::endl;
+
+		// (2) open the data; Data::load would read a text file completely
+		std::string test_filename = cmdline.getValue(param_test_file);
+		bool is_binary_file = (fileexists(test_filename + ".data") && fileexists(test_filename + ".target")) ||
+		                      (fileexists(test_filename + ".x") && fileexists(test_filename + ".y"));
+		Data* test = NULL;
+		std::ifstream text_in;
+		if (is_binary_file) {
+			std::cout << "Loading data...\t" << std::endl;
+			test = new Data(cmdline.getValue(param_cache_size, 0), true, false, use_mmap);
+			test->load(test_filename);
+		} else {
+			text_in.open(test_filename.c_str(), std::ios_base::in | std::ios_base::binary);
+			if (! text_in.is_open()) {
+				throw "unable to open " + test_filename;
+			}
+		}
+
+		std::string out_filename = cmdline.getValue(param_out);
+		FILE* out = fopen(out_filename.c_str(), "wb");
+		if (out == NULL) {
+			throw "unable to open " + out_filename;
+		}
+
+		// (3) predict block by block
+		predict_block block;
+		uint64 num_rows = 0;
+		double predict_time = getwalltime();
+		if (is_binary_file) {
+			LargeSparseMatrix<DATA_FLOAT>* data = test->data;
+			data->adviseSequential();
+			data->begin();
+			while (! data->end()) {
+				// copy the next rows; the current row of a LargeSparseMatrix is only valid until next()
+				block.clear();
+				for (uint i = 0; (i < PREDICT_BLOCK_SIZE) && ! data->end(); i++, data->next()) {
+					block.add(data->getRow(), fm.num_attribute);
+				}
+				block.predict(fm, *fml, out);
+				num_rows += block.row_begin.size();
+			}
+		} else {
+			// the complete lines of each block are split into one part per thread
+			int num_parts = get_num_threads();
+			std::vector<text_chunk> part(num_parts);
+			std::vector<uint64> part_begin(num_parts+1);
+			std::vector<std::string> part_error(num_parts);
+			std::vector<char> buffer(PREDICT_TEXT_BLOCK_SIZE + 1);
+			uint64 carry = 0;
+			bool at_end = false;
+			while (! at_end) {
+				text_in.read(&(buffer[carry]), buffer.size() - 1 - carry);
+				uint64 filled = carry + text_in.gcount();
+				at_end = text_in.eof();
+				uint64 last = filled;
+				if (! at_end) {
+					while ((last > 0) && (buffer[last-1] != '\n')) { last--; }
+					if (last == 0) {
+						// a single line is larger than the buffer
+						carry = filled;
+						buffer.resize(2*buffer.size());
+						continue;
+					}
+				}
+				for (int p = 0; p < num_parts; p++) {
+					uint64 pos = last / num_parts * p;
+					while ((pos > 0) && (pos < last) && (buffer[pos-1] != '\n')) { pos++; }
+					part_begin[p] = pos;
+				}
+				part_begin[num_parts] = last;
+				char after_last = buffer[last];
+				#pragma omp parallel for schedule(dynamic, 1)
+				for (int p = 0; p < num_parts; p++) {
+					part[p].clear();
+					if (part_begin[p+1] == part_begin[p]) { continue; }
+					uint64 end = part_begin[p+1];
+					if (buffer[end-1] == '\n') { end--; } // parseBuffer terminates the range at end, i.e. overwrites the newline
+					try {
+						part[p].parseBuffer(&(buffer[part_begin[p]]), &(buffer[end]));
+					} catch (std::string &e) {
+						part_error[p] = e;
+					}
+				}
+				for (int p = 0; p < num_parts; p++) {
+					if (part_error[p].size() > 0) {
+						throw part_error[p];
+					}
+				}
+				buffer[last] = after_last;
+				block.clear();
+				for (int p = 0; p < num_parts; p++) {
+					sparse_row<DATA_FLOAT> row;
+					uint64 entry = 0;
+					for (uint r = 0; r < part[p].num_rows; r++) {
+						row.data = part[p].entries.empty() ? NULL : &(part[p].entries[entry]);
+						row.size = part[p].row_size[r];
+						block.add(row, fm.num_attribute);
+						entry += row.size;
+					}
+				}
+				block.predict(fm, *fml, out);
+				num_rows += block.row_begin.size();
+				carry = filled - last;
+				if (carry > 0) {
+					std::copy(buffer.begin() + last, buffer.begin() + filled, buffer.begin());
+				}
+			}
+		}
+		predict_time = getwalltime() - predict_time;
+		if (test != NULL) {
+			delete test;
+		}
+		if (fclose(out) != 0) {
+			throw "error writing " + out_filename;
+		}
+		if (block.num_unknown > 0) {
+			std::cout << "ignored " << block.num_unknown << " values of attributes that are not in the model" << std::endl;
+		}
+		std::cout << "predicted " << num_rows << " rows in " << predict_time << "s\t" << (num_rows / predict_time) << " rows/sec\tthreads=" << get_num_threads() << std::endl;
+	} catch (std::string &e) {
+		std::cerr << std::endl << "ERROR: " << e << std::endl;
+		return 1;
+	} catch (char const* &e) {
+		std::cerr << std::endl << "ERROR: " << e << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -12,14 +12,31 @@
 
 #include <limits>
 #include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <assert.h>
 #include <iostream>
 #include <fstream>
 #include "../util/random.h"
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 
 
 const uint FMATRIX_EXPECTED_FILE_ID = 2;
+const uint FMATRIX_COMPRESSED_FILE_ID = 3;
 
 template <typename T> struct sparse_entry {
     uint id;
@@ -39,8 +56,270 @@ struct file_header {
 	uint num_cols;
 }; 
 
+const uint FMATRIX_FLAG_BINARY = 1; // all values are 1.0
+
+/*
+ The header of the plain format has no room for flags, so the writers store them in the sidecar
+ file <filename>.flags. It is only used if it matches the size, the modification time and the
+ number of values of the matrix file; otherwise (e.g. for files of older versions or files that
+ have been rewritten by them) the flags are computed from the data.
+*/
+const uint FMATRIX_FLAGS_FILE_ID = 0x67616c66; // "flag"
+const uint FMATRIX_INDEX_FILE_ID = 0x78646e69; // "indx", row index of LargeSparseMatrixMMap
+
+// size and modification time of a file; identifies the version of a matrix file for its sidecar files
+struct fmatrix_file_stamp {
+	uint64 file_size;
+	int64 mtime_sec;
+	int64 mtime_nsec;
+	bool operator==(const fmatrix_file_stamp& s) const {
+		return (file_size == s.file_size) && (mtime_sec == s.mtime_sec) && (mtime_nsec == s.mtime_nsec);
+	}
+};
+
+struct fmatrix_flags_file {
+	uint id;
+	uint flags;         // FMATRIX_FLAG_*
+	uint64 num_values;  // of the matrix file
+	fmatrix_file_stamp stamp;
+};
+
+// false if the stamp is not available
+inline bool fmatrix_get_stamp(const std::string& filename, fmatrix_file_stamp& stamp) {
+	#ifdef _WIN32
+	return false;
+	#else
+	struct stat st;
+	if (stat(filename.c_str(), &st) != 0) {
+		return false;
+	}
+	stamp.file_size = st.st_size;
+	stamp.mtime_sec = st.st_mtim.tv_sec;
+	stamp.mtime_nsec = st.st_mtim.tv_nsec;
+	return true;
+	#endif
+}
+
+// writes the flags of the closed matrix file filename; failures are ignored (the flags are optional)
+inline void fmatrix_save_flags(const std::string& filename, uint flags, uint64 num_values) {
+	fmatrix_flags_file ff;
+	if (! fmatrix_get_stamp(filename, ff.stamp)) {
+		return;
+	}
+	ff.id = FMATRIX_FLAGS_FILE_ID;
+	ff.flags = flags;
+	ff.num_values = num_values;
+	std::string flags_filename = filename + ".flags";
+	std::ofstream out(flags_filename.c_str(), std::ios_base::out | std::ios_base::binary);
+	if (out.is_open()) {
+		out.write(reinterpret_cast<char*>(&ff), sizeof(ff));
+	}
+}
+
+// reads the flags of the matrix file filename; false if there are none or they do not belong to the file
+inline bool fmatrix_load_flags(const std::string& filename, uint64 num_values, uint& flags) {
+	fmatrix_file_stamp stamp;
+	if (! fmatrix_get_stamp(filename, stamp)) {
+		return false;
+	}
+	std::string flags_filename = filename + ".flags";
+	std::ifstream in(flags_filename.c_str(), std::ios_base::in | std::ios_base::binary);
+	fmatrix_flags_file ff;
+	if (! in.is_open() || ! in.read(reinterpret_cast<char*>(&ff), sizeof(ff))) {
+		return false;
+	}
+	if ((ff.id != FMATRIX_FLAGS_FILE_ID) || (ff.num_values != num_values) || ! (ff.stamp == stamp)) {
+		return false;
+	}
+	flags = ff.flags;
+	return true;
+}
+
+/*
+ Compressed binary sparse matrix: the header starts like file_header and is followed by the rows
+ as a byte stream. Each row is stored as
+   varint(size), flags, ids, values
+ The ids are delta coded varints; if the ids of a row are not sorted, the deltas are zigzag coded.
+ The values are either left out (all values are 1.0), stored as fp16 or stored as T.
+*/
+struct compressed_file_header {
+	uint id;
+	uint float_size;
+	uint64 num_values;
+	uint num_rows;
+	uint num_cols;
+	uint64 data_size;   // bytes of row data after the header
+	uint max_row_bytes; // size of the longest encoded row
+	uint flags;         // FMATRIX_FLAG_*
+};
+
+const unsigned char FMATRIX_ROW_VALUES_ONE = 0;   // all values are 1.0
+const unsigned char FMATRIX_ROW_VALUES_FP16 = 1;
+const unsigned char FMATRIX_ROW_VALUES_FULL = 2;
+const unsigned char FMATRIX_ROW_VALUES_MASK = 3;
+const unsigned char FMATRIX_ROW_IDS_SORTED = 4;   // ids are plain deltas, otherwise zigzag deltas
+
+inline float fmatrix_half_to_float(unsigned short h) {
+	uint sign = (uint) (h & 0x8000) << 16;
+	uint exponent = (h >> 10) & 0x1f;
+	uint mantissa = h & 0x3ff;
+	uint bits;
+	if (exponent == 0x1f) {
+		bits = sign | 0x7f800000 | (mantissa << 13); // inf, nan
+	} else if (exponent != 0) {
+		bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+	} else if (mantissa == 0) {
+		bits = sign;
+	} else {
+		// subnormal
+		exponent = 113;
+		while ((mantissa & 0x400) == 0) { mantissa <<= 1; exponent--; }
+		bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+	}
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+// rounds to the nearest fp16 value (ties to even)
+inline unsigned short fmatrix_float_to_half(float f) {
+	uint bits;
+	memcpy(&bits, &f, sizeof(bits));
+	uint sign = (bits >> 16) & 0x8000;
+	uint abs_bits = bits & 0x7fffffff;
+	if (abs_bits >= 0x7f800000) {
+		return sign | 0x7c00 | ((abs_bits > 0x7f800000) ? 0x200 : 0); // inf, nan
+	}
+	if (abs_bits >= 0x477ff000) {
+		return sign | 0x7c00; // overflow
+	}
+	if (abs_bits < 0x38800000) {
+		// subnormal or zero
+		if (abs_bits < 0x33000000) { return sign; }
+		uint exponent = abs_bits >> 23;
+		uint mantissa = (abs_bits & 0x7fffff) | 0x800000;
+		uint shift = 126 - exponent;
+		uint half = mantissa >> shift;
+		uint rest = mantissa & ((1u << shift) - 1);
+		uint halfway = 1u << (shift - 1);
+		if ((rest > halfway) || ((rest == halfway) && (half & 1))) { half++; }
+		return sign | half;
+	}
+	uint half = ((abs_bits - 0x38000000) >> 13);
+	uint rest = abs_bits & 0x1fff;
+	if ((rest > 0x1000) || ((rest == 0x1000) && (half & 1))) { half++; }
+	return sign | half;
+}
+
+inline void fmatrix_put_varint(std::vector<char>& out, uint x) {
+	while (x >= 0x80) {
+		out.push_back((char) (x | 0x80));
+		x >>= 7;
+	}
+	out.push_back((char) x);
+}
+
+inline const unsigned char* fmatrix_get_varint(const unsigned char* p, uint& x) {
+	x = *p & 0x7f;
+	for (uint shift = 7; *p++ & 0x80; shift += 7) {
+		x |= (uint) (*p & 0x7f) << shift;
+	}
+	return p;
+}
+
+// appends the compressed row to out and returns its flags; with quantize, values that are not exactly representable are rounded to fp16
+template <typename T> unsigned char fmatrix_encode_row(const sparse_row<T>& row, bool quantize, std::vector<char>& out) {
+	bool all_one = true;
+	bool fits_fp16 = true;
+	bool sorted = true;
+	for (uint i = 0; i < row.size; i++) {
+		all_one &= (row.data[i].value == 1.0);
+		fits_fp16 &= quantize || ((T) fmatrix_half_to_float(fmatrix_float_to_half(row.data[i].value)) == row.data[i].value);
+		sorted &= (i == 0) || (row.data[i].id >= row.data[i-1].id);
+	}
+	unsigned char flags = all_one ? FMATRIX_ROW_VALUES_ONE : (fits_fp16 ? FMATRIX_ROW_VALUES_FP16 : FMATRIX_ROW_VALUES_FULL);
+	if (sorted) { flags |= FMATRIX_ROW_IDS_SORTED; }
+	fmatrix_put_varint(out, row.size);
+	out.push_back((char) flags);
+	uint last = 0;
+	for (uint i = 0; i < row.size; i++) {
+		uint delta = row.data[i].id - last;
+		if (! sorted) {
+			int d = (int) delta;
+			delta = ((uint) d << 1) ^ (uint) (d >> 31);
+		}
+		fmatrix_put_varint(out, delta);
+		last = row.data[i].id;
+	}
+	if ((flags & FMATRIX_ROW_VALUES_MASK) == FMATRIX_ROW_VALUES_FP16) {
+		for (uint i = 0; i < row.size; i++) {
+			unsigned short h = fmatrix_float_to_half(row.data[i].value);
+			out.insert(out.end(), reinterpret_cast<char*>(&h), reinterpret_cast<char*>(&h) + sizeof(h));
+		}
+	} else if ((flags & FMATRIX_ROW_VALUES_MASK) == FMATRIX_ROW_VALUES_FULL) {
+		for (uint i = 0; i < row.size; i++) {
+			out.insert(out.end(), reinterpret_cast<const char*>(&(row.data[i].value)), reinterpret_cast<const char*>(&(row.data[i].value)) + sizeof(T));
+		}
+	}
+	return flags;
+}
+
+// decodes the row at p into row.data (which has to hold the row); returns the position after the row
+template <typename T> const unsigned char* fmatrix_decode_row(const unsigned char* p, sparse_row<T>& row) {
+	p = fmatrix_get_varint(p, row.size);
+	unsigned char flags = *p++;
+	sparse_entry<T>* data = row.data;
+	uint id = 0;
+	if (flags & FMATRIX_ROW_IDS_SORTED) {
+		for (uint i = 0; i < row.size; i++) {
+			uint delta;
+			if (*p < 0x80) { delta = *p++; } else { p = fmatrix_get_varint(p, delta); }
+			id += delta;
+			data[i].id = id;
+		}
+	} else {
+		for (uint i = 0; i < row.size; i++) {
+			uint delta;
+			p = fmatrix_get_varint(p, delta);
+			id += (delta >> 1) ^ (0 - (delta & 1));
+			data[i].id = id;
+		}
+	}
+	switch (flags & FMATRIX_ROW_VALUES_MASK) {
+		case FMATRIX_ROW_VALUES_ONE:
+			for (uint i = 0; i < row.size; i++) { data[i].value = 1.0; }
+			break;
+		case FMATRIX_ROW_VALUES_FP16:
+			for (uint i = 0; i < row.size; i++) {
+				unsigned short h;
+				memcpy(&h, p, sizeof(h));
+				data[i].value = fmatrix_half_to_float(h);
+				p += sizeof(h);
+			}
+			break;
+		default:
+			for (uint i = 0; i < row.size; i++) {
+				memcpy(&(data[i].value), p, sizeof(T));
+				p += sizeof(T);
+			}
+	}
+	return p;
+}
+
+// statistics of a matrix that is streamed from disk
+struct fmatrix_io_stats {
+	uint64 passes;      // complete passes over the rows
+	uint64 blocks_read;
+	uint64 bytes_read;
+	double read_time;   // seconds spent reading (in the reader thread)
+	double stall_time;  // seconds the consumer waited for data
+	double pass_time;   // seconds of all complete passes; pass_time - stall_time is the time of the consumer
+	fmatrix_io_stats() : passes(0), blocks_read(0), bytes_read(0), read_time(0), stall_time(0), pass_time(0) { }
+};
+
 template <typename T> class LargeSparseMatrix {
 	public:
+		virtual ~LargeSparseMatrix() { }
 		virtual void begin() = 0; // go to the beginning
 		virtual bool end() = 0;   // are we at the end?
 		virtual void next() = 0; // go to the next line
@@ -49,6 +328,23 @@ template <typename T> class LargeSparseMatrix {
 		virtual uint getNumRows() = 0; // get the number of Rows
 		virtual uint getNumCols() = 0; // get the number of Cols
 		virtual uint64 getNumValues() = 0; // get the number of Values
+		virtual bool hasRandomAccess() { return false; } // can rows be accessed with getRowAt?
+		virtual sparse_row<T> getRowAt(uint row_index) { throw "random access is not supported for this matrix"; } // row with index row_index; does not change the current row
+		virtual void adviseSequential() { } // hints how the rows are accessed by the following passes
+		virtual void adviseRandom() { }     // (e.g. madvise for a memory mapped file)
+
+		virtual bool getIOStats(fmatrix_io_stats& stats) { return false; } // for matrices that are streamed from disk
+
+		// are all values 1.0? this reads the whole matrix
+		virtual bool isBinary() {
+			for (begin(); !end(); next()) {
+				sparse_row<T>& row = getRow();
+				for (uint i = 0; i < row.size; i++) {
+					if (row.data[i].value != 1.0) { return false; }
+				}
+			}
+			return true;
+		}
 		
 
 		void saveToBinaryFile(std::string filename) {
@@ -62,11 +358,16 @@ template <typename T> class LargeSparseMatrix {
 				fh.num_cols = getNumCols();
 				fh.float_size = sizeof(T);
 				out.write(reinterpret_cast<char*>(&fh), sizeof(fh));
+				bool binary = true;
 				for (begin(); !end(); next()) {
+					for (uint i = 0; i < getRow().size; i++) {
+						binary &= (getRow().data[i].value == 1.0);
+					}
 					out.write(reinterpret_cast<char*>(&(getRow().size)), sizeof(uint));
 					out.write(reinterpret_cast<char*>(getRow().data), sizeof(sparse_entry<T>)*getRow().size);
 				}
 				out.close();
+				fmatrix_save_flags(filename, binary ? FMATRIX_FLAG_BINARY : 0, fh.num_values);
 			} else {
 				throw "could not open " + filename;
 			}
@@ -93,130 +394,375 @@ template <typename T> class LargeSparseMatrix {
 		}
 };
 
+/*
+ Binary sparse matrix that is read through a cache of cache_size bytes. If the file does not fit
+ into the cache, the cache is split into num_buffers blocks that form a ring: a background thread
+ reads the next blocks of the file (pread, optionally with O_DIRECT) while the rows of the current
+ block are consumed. The time the consumer waits for a block is counted as stall time (see
+ fmatrix_io_stats); if it is large, the cache (or the number of buffers) should be increased.
+*/
+class fmatrix_io_settings {
+	public:
+		uint num_buffers; // blocks of the cache of LargeSparseMatrixHD
+		bool direct_io;   // read with O_DIRECT (bypasses the page cache)
+
+		static fmatrix_io_settings& getInstance() {
+			static fmatrix_io_settings instance;
+			return instance;
+		}
+	private:
+		fmatrix_io_settings() { num_buffers = 2; direct_io = false; }
+};
+
 template <typename T> class LargeSparseMatrixHD : public LargeSparseMatrix<T> {
 	protected:
-		DVector< sparse_row<T> > data;
-		DVector< sparse_entry<T> > cache;
+		static const uint64 IO_ALIGNMENT = 4096; // O_DIRECT needs aligned offsets, sizes and buffers
+
+		struct block {
+			char* memory;
+			uint64 capacity;
+			std::vector< sparse_row<T> > rows; // point into memory
+			bool ready;                        // filled by the reader, not yet consumed
+		};
+
 		std::string filename;
-		
+		uint num_cols;
+		uint64 num_values;
+		uint num_rows;
+		uint64 file_size;
+
+		std::vector<block> blocks;
+		bool in_memory;        // the whole file fits into a single block, it is read once
+		bool in_memory_loaded;
+		bool direct_io;
+		int fd;
+		#ifdef _WIN32
 		std::ifstream in;
+		#endif
 
-		uint64 position_in_data_cache;
-		uint number_of_valid_rows_in_cache;
-		uint64 number_of_valid_entries_in_cache;
+		// reader thread
+		std::thread reader;
+		std::mutex mutex;
+		std::condition_variable cond;
+		bool stop_reader;
+		std::string reader_error;
+
+		uint current_block;
+		uint position_in_block;
 		uint row_index;
 
-		uint num_cols;
-		uint64 num_values;
-		uint num_rows;	
-
-		void readcache() {
-			if (row_index >= num_rows) { return; }
-			number_of_valid_rows_in_cache = 0;
-			number_of_valid_entries_in_cache = 0;
-			position_in_data_cache = 0;
-			do {
-				if ((row_index + number_of_valid_rows_in_cache) > (num_rows-1)) {
-					break;
-				}
-				if (number_of_valid_rows_in_cache >= data.dim) { break; }
-
-				sparse_row<T>& this_row = data.value[number_of_valid_rows_in_cache];
-				
-				in.read(reinterpret_cast<char*>(&(this_row.size)), sizeof(uint));
-				if ((this_row.size + number_of_valid_entries_in_cache) > cache.dim) {
-					in.seekg(- (long int) sizeof(uint), std::ios::cur);
-					break;
-				}
-
-				this_row.data = &(cache.value[number_of_valid_entries_in_cache]);
-				in.read(reinterpret_cast<char*>(this_row.data), sizeof(sparse_entry<T>)*this_row.size);
-			
-				number_of_valid_rows_in_cache++;					
-				number_of_valid_entries_in_cache += this_row.size;
-			} while (true);
-	
-		}	
+		fmatrix_io_stats stats;
+		std::chrono::steady_clock::time_point pass_start;
+
+		static double seconds_since(const std::chrono::steady_clock::time_point& t) {
+			return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+		}
+
+		void allocate(block& b, uint64 capacity) {
+			if (b.memory != NULL) { free(b.memory); }
+			capacity = (capacity + IO_ALIGNMENT - 1) / IO_ALIGNMENT * IO_ALIGNMENT;
+			void* m = NULL;
+			#ifdef _WIN32
+			m = malloc(capacity);
+			#else
+			if (posix_memalign(&m, IO_ALIGNMENT, capacity) != 0) { m = NULL; }
+			#endif
+			if (m == NULL) {
+				throw std::string("out of memory for the cache of ") + filename;
+			}
+			b.memory = static_cast<char*>(m);
+			b.capacity = capacity;
+		}
+
+		uint64 read_at(char* buffer, uint64 size, uint64 offset) {
+			uint64 done = 0;
+			#ifdef _WIN32
+			in.clear();
+			in.seekg(offset, std::ios_base::beg);
+			in.read(buffer, size);
+			done = in.gcount();
+			#else
+			while (done < size) {
+				ssize_t r = pread(fd, buffer + done, size - done, offset + done);
+				if (r < 0) {
+					throw "error reading " + filename;
+				}
+				if (r == 0) { break; }
+				done += r;
+				if (direct_io && ((r % IO_ALIGNMENT) != 0)) { break; } // end of file
+			}
+			#endif
+			return done;
+		}
+
+		// reads the rows that start at file position offset and fit completely into the block;
+		// first_row is the index of the first row; returns the file position after the last row
+		uint64 fill(block& b, uint64 offset, uint first_row) {
+			while (true) {
+				uint64 start = direct_io ? (offset / IO_ALIGNMENT * IO_ALIGNMENT) : offset;
+				uint64 size = direct_io ? b.capacity : std::min(b.capacity, file_size - start);
+				std::chrono::steady_clock::time_point read_start = std::chrono::steady_clock::now();
+				uint64 got = read_at(b.memory, size, start);
+				double read_time = seconds_since(read_start);
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					stats.bytes_read += got;
+					stats.read_time += read_time;
+					stats.blocks_read++;
+				}
+				b.rows.clear();
+				uint64 p = offset - start;
+				uint64 row_bytes = sizeof(uint); // of the first row that does not fit
+				while (first_row + b.rows.size() < num_rows) {
+					if (p + sizeof(uint) > got) { break; }
+					sparse_row<T> row;
+					memcpy(&(row.size), b.memory + p, sizeof(uint));
+					row_bytes = sizeof(uint) + (uint64) row.size * sizeof(sparse_entry<T>);
+					if (p + row_bytes > got) { break; }
+					row.data = reinterpret_cast<sparse_entry<T>*>(b.memory + p + sizeof(uint));
+					b.rows.push_back(row);
+					p += row_bytes;
+				}
+				if (! b.rows.empty() || (first_row >= num_rows)) {
+					return start + p;
+				}
+				if (start + got >= file_size) {
+					throw "file " + filename + " is truncated";
+				}
+				// a single row is larger than the block
+				allocate(b, (offset - start) + row_bytes + IO_ALIGNMENT);
+			}
+		}
+
+		// fills the blocks of the ring one after the other until all rows are read
+		void read_loop() {
+			try {
+				uint64 offset = sizeof(file_header);
+				uint row = 0;
+				for (uint k = 0; row < num_rows; k = (k + 1) % blocks.size()) {
+					block& b = blocks[k];
+					{
+						std::unique_lock<std::mutex> lock(mutex);
+						cond.wait(lock, [&] { return stop_reader || ! b.ready; });
+						if (stop_reader) { return; }
+					}
+					offset = fill(b, offset, row);
+					row += b.rows.size();
+					{
+						std::lock_guard<std::mutex> lock(mutex);
+						b.ready = true;
+					}
+					cond.notify_all();
+				}
+			} catch (std::string& e) {
+				std::lock_guard<std::mutex> lock(mutex);
+				reader_error = e;
+				cond.notify_all();
+			} catch (char const* e) {
+				std::lock_guard<std::mutex> lock(mutex);
+				reader_error = e;
+				cond.notify_all();
+			}
+		}
+
+		void stop() {
+			if (reader.joinable()) {
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					stop_reader = true;
+				}
+				cond.notify_all();
+				reader.join();
+			}
+		}
+
+		// waits until the current block has been read
+		void wait_for_block() {
+			block& b = blocks[current_block];
+			std::chrono::steady_clock::time_point wait_start = std::chrono::steady_clock::now();
+			std::unique_lock<std::mutex> lock(mutex);
+			if (! b.ready && reader_error.empty()) {
+				cond.wait(lock, [&] { return b.ready || ! reader_error.empty(); });
+			}
+			stats.stall_time += seconds_since(wait_start);
+			if (! reader_error.empty()) {
+				throw reader_error;
+			}
+		}
+
 	public:
-		LargeSparseMatrixHD(std::string filename, uint64 cache_size) { 
+		LargeSparseMatrixHD(std::string filename, uint64 cache_size) {
 			this->filename = filename;
-			in.open(filename.c_str(), std::ios_base::in | std::ios_base::binary);
-			if (in.is_open()) {
+			fd = -1;
+			stop_reader = false;
+			in_memory_loaded = false;
+			stats = fmatrix_io_stats();
+			{
+				std::ifstream in(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+				if (! in.is_open()) {
+					throw "could not open " + filename;
+				}
 				file_header fh;
 				in.read(reinterpret_cast<char*>(&fh), sizeof(fh));
 				assert(fh.id == FMATRIX_EXPECTED_FILE_ID);
 				assert(fh.float_size == sizeof(T));
 				this->num_values = fh.num_values;
 				this->num_rows = fh.num_rows;
-				this->num_cols = fh.num_cols;				
-				//in.close();
-			} else {
+				this->num_cols = fh.num_cols;
+				in.seekg(0, std::ios_base::end);
+				file_size = in.tellg();
+			}
+			fmatrix_io_settings& settings = fmatrix_io_settings::getInstance();
+			direct_io = settings.direct_io;
+			#ifdef _WIN32
+			direct_io = false;
+			in.open(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+			#else
+			if (direct_io) {
+				fd = open(filename.c_str(), O_RDONLY | O_DIRECT);
+				if (fd < 0) {
+					std::cout << "O_DIRECT is not supported for " << filename << ", reading through the page cache" << std::endl;
+					direct_io = false;
+				}
+			}
+			if (fd < 0) {
+				fd = open(filename.c_str(), O_RDONLY);
+			}
+			if (fd < 0) {
 				throw "could not open " + filename;
 			}
+			#endif
 
 			if (cache_size == 0) {
 				cache_size = std::numeric_limits<uint64>::max();
 			}
-			// determine cache sizes automatically:
-			double avg_entries_per_line = (double) this->num_values / this->num_rows;
-			uint num_rows_in_cache;
-			{
-				uint64 dummy = cache_size / (sizeof(sparse_entry<T>) * avg_entries_per_line + sizeof(uint));
-				if (dummy > static_cast<uint64>(std::numeric_limits<uint>::max())) {
-					num_rows_in_cache = std::numeric_limits<uint>::max();
-				} else {
-					num_rows_in_cache = dummy;
-				}
+			// the row table is part of the cache: 4 bytes per row of the file become a sparse_row
+			uint64 data_size = file_size - sizeof(file_header);
+			uint64 row_table_size = (uint64) num_rows * (sizeof(sparse_row<T>) - sizeof(uint));
+			in_memory = (cache_size >= data_size + row_table_size + IO_ALIGNMENT);
+			uint num_buffers = in_memory ? 1 : std::max(settings.num_buffers, 1u);
+			blocks.resize(num_buffers);
+			uint64 block_size;
+			if (in_memory) {
+				block_size = data_size + 2 * IO_ALIGNMENT;
+			} else {
+				// the rows table of a block takes about (sizeof(sparse_row)-4) bytes per row
+				double avg_row_bytes = sizeof(uint) + (double) num_values / std::max(num_rows, 1u) * sizeof(sparse_entry<T>);
+				double row_share = (sizeof(sparse_row<T>) - sizeof(uint)) / (avg_row_bytes + sizeof(sparse_row<T>) - sizeof(uint));
+				block_size = std::max((uint64) (cache_size / num_buffers * (1.0 - row_share)), 4 * IO_ALIGNMENT);
+			}
+			for (uint i = 0; i < num_buffers; i++) {
+				blocks[i].memory = NULL;
+				blocks[i].ready = false;
+				allocate(blocks[i], block_size);
 			}
-			num_rows_in_cache = std::min(num_rows_in_cache, this->num_rows);
-			uint64 num_entries_in_cache = (cache_size - sizeof(uint)*num_rows_in_cache) / sizeof(sparse_entry<T>);
-			num_entries_in_cache = std::min(num_entries_in_cache, this->num_values);
-			std::cout << "num entries in cache=" << num_entries_in_cache << "\tnum rows in cache=" << num_rows_in_cache << std::endl;
+			std::cout << "cache: " << (in_memory ? "all rows in memory" : "streaming") << "\tbuffers=" << num_buffers << "\tbytes per buffer=" << blocks[0].capacity << (direct_io ? "\tO_DIRECT" : "") << std::endl;
+			row_index = 0;
+			current_block = 0;
+			position_in_block = 0;
+		}
 
-			cache.setSize(num_entries_in_cache);
-			data.setSize(num_rows_in_cache);
+		~LargeSparseMatrixHD() {
+			stop();
+			for (uint i = 0; i < blocks.size(); i++) {
+				free(blocks[i].memory);
+			}
+			#ifndef _WIN32
+			if (fd >= 0) { close(fd); }
+			#endif
 		}
-//		~LargeSparseMatrixHD() { in.close(); }
 
 		virtual uint getNumRows() { return num_rows; };
 		virtual uint getNumCols() { return num_cols; };
 		virtual uint64 getNumValues() { return num_values; };
 
+		// without valid flags (see fmatrix_load_flags) the matrix is read completely
+		virtual bool isBinary() {
+			uint flags;
+			if (fmatrix_load_flags(filename, num_values, flags)) {
+				return (flags & FMATRIX_FLAG_BINARY) != 0;
+			}
+			return LargeSparseMatrix<T>::isBinary();
+		}
+
 		virtual void next() {
 			row_index++;
-			position_in_data_cache++;
-			if (position_in_data_cache >= number_of_valid_rows_in_cache) {
-				readcache();
+			position_in_block++;
+			if (row_index >= num_rows) {
+				std::lock_guard<std::mutex> lock(mutex);
+				stats.pass_time += seconds_since(pass_start);
+				stats.passes++;
+				return;
+			}
+			if (position_in_block >= blocks[current_block].rows.size()) {
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					blocks[current_block].ready = false;
+				}
+				cond.notify_all();
+				current_block = (current_block + 1) % blocks.size();
+				position_in_block = 0;
+				wait_for_block();
 			}
 		}
 
 		virtual void begin() {
-			if ((row_index == position_in_data_cache) && (number_of_valid_rows_in_cache > 0)) {
-				// if the beginning is already in the cache, do nothing
-				row_index = 0;
-				position_in_data_cache = 0;
-				// close the file because everything is in the cache
-				if (in.is_open()) {
-					in.close();
-				}
+			row_index = 0;
+			position_in_block = 0;
+			current_block = 0;
+			pass_start = std::chrono::steady_clock::now();
+			if (in_memory) {
+				load_all();
 				return;
 			}
-			row_index = 0;
-			position_in_data_cache = 0;
-			number_of_valid_rows_in_cache = 0;
-			number_of_valid_entries_in_cache = 0;
-			in.seekg(sizeof(file_header), std::ios_base::beg);
-			readcache();
+			stop();
+			stop_reader = false;
+			reader_error.clear();
+			for (uint i = 0; i < blocks.size(); i++) {
+				blocks[i].ready = false;
+			}
+			if (num_rows == 0) { return; }
+			reader = std::thread(&LargeSparseMatrixHD<T>::read_loop, this);
+			wait_for_block();
 		}
 
 		virtual bool end() { return row_index >= num_rows; }
 
 		virtual sparse_row<T>& getRow() {
-            return data(position_in_data_cache);
-        }
+			return blocks[current_block].rows[position_in_block];
+		}
 		virtual uint getRowIndex() { return row_index; }
-	
-	
+
+		virtual bool getIOStats(fmatrix_io_stats& stats) {
+			std::lock_guard<std::mutex> lock(mutex);
+			stats = this->stats;
+			return ! in_memory;
+		}
+
+		// if the file fits into the cache, all rows are in the single block
+		virtual bool hasRandomAccess() {
+			if (in_memory) { load_all(); }
+			return in_memory;
+		}
+		virtual sparse_row<T> getRowAt(uint row_index) {
+			assert(in_memory_loaded);
+			return blocks[0].rows[row_index];
+		}
+
+	protected:
+		// the file is read once; afterwards everything is in the cache
+		void load_all() {
+			if (in_memory_loaded) { return; }
+			fill(blocks[0], sizeof(file_header), 0);
+			if (blocks[0].rows.size() != num_rows) {
+				throw "file " + filename + " does not match its header";
+			}
+			in_memory_loaded = true;
+			#ifndef _WIN32
+			close(fd);
+			fd = -1;
+			#endif
+		}
 };
 
 template <typename T> class LargeSparseMatrixMemory : public LargeSparseMatrix<T> {
@@ -234,11 +780,367 @@ template <typename T> class LargeSparseMatrixMemory : public LargeSparseMatrix<T
 		virtual uint getNumRows() { return data.dim; };
 		virtual uint getNumCols() { return num_cols; };
 		virtual uint64 getNumValues() { return num_values; };
+		virtual bool hasRandomAccess() { return true; }
+		virtual sparse_row<T> getRowAt(uint row_index) { return data(row_index); }
 
 //		void loadFromTextFile(std::string filename);
 };
 
+/*
+ Binary sparse matrix that is mapped into memory. The rows returned point directly
+ into the mapping, so nothing is copied and the operating system decides what stays in memory.
+ The byte offset of each row is stored in an index which is built once and kept
+ next to the data file (<filename>.idx).
+*/
+template <typename T> class LargeSparseMatrixMMap : public LargeSparseMatrix<T> {
+	protected:
+		std::string filename;
+		char* mapping;
+		uint64 mapping_size;
+		DVector<uint64> row_offset; // position of each row in the file; row_offset(num_rows) is the file size
+		
+		sparse_row<T> current_row;
+		uint row_index;
+
+		uint num_cols;
+		uint64 num_values;
+		uint num_rows;
+
+		// the row index of a file is cached in <filename>.idx: a header that identifies the matrix file
+		// followed by the num_rows+1 values of row_offset
+		struct index_header {
+			uint id;
+			uint num_rows;
+			uint64 num_values;
+			fmatrix_file_stamp stamp;
+		};
+
+		bool loadIndex(std::string index_filename) {
+			index_header ih;
+			if (! fmatrix_get_stamp(filename, ih.stamp)) { return false; }
+			std::ifstream in(index_filename.c_str(), std::ios_base::in | std::ios_base::binary);
+			if (! in.is_open()) { return false; }
+			index_header ih_file;
+			in.read(reinterpret_cast<char*>(&ih_file), sizeof(ih_file));
+			if (! in || (ih_file.id != FMATRIX_INDEX_FILE_ID) || (ih_file.num_rows != num_rows) || (ih_file.num_values != num_values) || ! (ih_file.stamp == ih.stamp) || (ih.stamp.file_size != mapping_size)) {
+				return false;
+			}
+			row_offset.setSize(num_rows+1);
+			in.read(reinterpret_cast<char*>(row_offset.value), (uint64) (num_rows+1) * sizeof(uint64));
+			if (! in) {
+				return false;
+			}
+			return (row_offset(0) == sizeof(file_header)) && (row_offset(num_rows) == mapping_size);
+		}
+
+		// a failure is not an error (e.g. a read-only directory); the index is rebuilt the next time
+		void saveIndex(std::string index_filename) {
+			index_header ih;
+			ih.id = FMATRIX_INDEX_FILE_ID;
+			ih.num_rows = num_rows;
+			ih.num_values = num_values;
+			if (! fmatrix_get_stamp(filename, ih.stamp)) { return; }
+			std::ofstream out(index_filename.c_str(), std::ios_base::out | std::ios_base::binary);
+			if (out.is_open()) {
+				out.write(reinterpret_cast<char*>(&ih), sizeof(ih));
+				out.write(reinterpret_cast<char*>(row_offset.value), (uint64) (num_rows+1) * sizeof(uint64));
+				out.close();
+				if (out.fail()) {
+					std::remove(index_filename.c_str()); // incomplete
+				}
+			}
+			if (out.fail()) {
+				std::cout << "could not write the row index " << index_filename << ", using it from memory" << std::endl;
+			}
+		}
+
+		void buildIndex() {
+			row_offset.setSize(num_rows+1);
+			uint64 pos = sizeof(file_header);
+			for (uint i = 0; i < num_rows; i++) {
+				if ((pos + sizeof(uint)) > mapping_size) {
+					throw "file " + filename + " is truncated";
+				}
+				row_offset(i) = pos;
+				uint size = *reinterpret_cast<uint*>(mapping + pos);
+				pos += sizeof(uint) + (uint64) size * sizeof(sparse_entry<T>);
+			}
+			if (pos != mapping_size) {
+				throw "file " + filename + " does not match its header";
+			}
+			row_offset(num_rows) = pos;
+		}
+
+		void readRow(uint i, sparse_row<T>& row) {
+			char* p = mapping + row_offset(i);
+			row.size = *reinterpret_cast<uint*>(p);
+			row.data = reinterpret_cast<sparse_entry<T>*>(p + sizeof(uint));
+		}
+
+	public:
+		LargeSparseMatrixMMap(std::string filename, bool persist_index = true) {
+			this->filename = filename;
+			mapping = NULL;
+			mapping_size = 0;
+			row_index = 0;
+			#ifdef _WIN32
+			throw "memory mapped files are not supported on this platform";
+			#else
+			int fd = open(filename.c_str(), O_RDONLY);
+			if (fd < 0) {
+				throw "could not open " + filename;
+			}
+			struct stat st;
+			fstat(fd, &st);
+			mapping_size = st.st_size;
+			if (mapping_size < sizeof(file_header)) {
+				close(fd);
+				throw "file " + filename + " is not a binary sparse matrix";
+			}
+			void* m = mmap(NULL, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+			close(fd);
+			if (m == MAP_FAILED) {
+				throw "could not map " + filename;
+			}
+			mapping = static_cast<char*>(m);
+			#endif
+
+			file_header fh = *reinterpret_cast<file_header*>(mapping);
+			assert(fh.id == FMATRIX_EXPECTED_FILE_ID);
+			assert(fh.float_size == sizeof(T));
+			this->num_values = fh.num_values;
+			this->num_rows = fh.num_rows;
+			this->num_cols = fh.num_cols;
+
+			std::string index_filename = filename + ".idx";
+			if (! loadIndex(index_filename)) {
+				std::cout << "building row index for " << filename << std::endl;
+				buildIndex();
+				if (persist_index) {
+					saveIndex(index_filename);
+				}
+			}
+			std::cout << "mapped " << mapping_size << " bytes" << std::endl;
+			begin();
+		}
+
+		~LargeSparseMatrixMMap() {
+			#ifndef _WIN32
+			if (mapping != NULL) {
+				munmap(mapping, mapping_size);
+			}
+			#endif
+		}
+
+		// hints for the kernel how the rows will be accessed
+		virtual void adviseSequential() {
+			#ifndef _WIN32
+			madvise(mapping, mapping_size, MADV_SEQUENTIAL);
+			#endif
+		}
+		virtual void adviseRandom() {
+			#ifndef _WIN32
+			madvise(mapping, mapping_size, MADV_RANDOM);
+			#endif
+		}
+
+		virtual uint getNumRows() { return num_rows; };
+		virtual uint getNumCols() { return num_cols; };
+		virtual uint64 getNumValues() { return num_values; };
+
+		// without valid flags (see fmatrix_load_flags) the matrix is read completely
+		virtual bool isBinary() {
+			uint flags;
+			if (fmatrix_load_flags(filename, num_values, flags)) {
+				return (flags & FMATRIX_FLAG_BINARY) != 0;
+			}
+			return LargeSparseMatrix<T>::isBinary();
+		}
+
+		virtual void begin() {
+			row_index = 0;
+			if (num_rows > 0) { readRow(0, current_row); }
+		}
+		virtual bool end() { return row_index >= num_rows; }
+		virtual void next() {
+			row_index++;
+			if (row_index < num_rows) { readRow(row_index, current_row); }
+		}
+		virtual sparse_row<T>& getRow() { return current_row; }
+		virtual uint getRowIndex() { return row_index; }
+
+		virtual bool hasRandomAccess() { return true; }
+		virtual sparse_row<T> getRowAt(uint row_index) {
+			sparse_row<T> row;
+			readRow(row_index, row);
+			return row;
+		}
+};
+
+/*
+ Reader for the compressed format; rows are decoded on the fly when the matrix is iterated.
+ If the compressed data fits into the cache, it is read only once and kept in memory. With
+ use_mmap, the file is mapped into memory instead.
+*/
+template <typename T> class LargeSparseMatrixCompressed : public LargeSparseMatrix<T> {
+	protected:
+		std::string filename;
+		compressed_file_header fh;
+
+		std::ifstream in;
+		std::vector<unsigned char> buffer;
+		char* mapping;
+		uint64 mapping_size;
+		bool in_memory;                     // all rows are in the buffer or the mapping
+		const unsigned char* data_begin;    // first row in the buffer/ mapping
+		const unsigned char* position;      // next row to decode
+		const unsigned char* buffer_end;
+		uint64 data_read;                   // bytes of row data that have been read into the buffer
+
+		DVector< sparse_entry<T> > row_data;
+		sparse_row<T> current_row;
+		uint row_index;
+
+		// makes sure that the next row is completely in the buffer
+		void fill() {
+			if (in_memory || ((uint64) (buffer_end - position) >= fh.max_row_bytes) || (data_read >= fh.data_size)) {
+				return;
+			}
+			uint64 remaining = buffer_end - position;
+			memmove(&(buffer[0]), position, remaining);
+			uint64 size = std::min((uint64) buffer.size() - remaining, fh.data_size - data_read);
+			in.read(reinterpret_cast<char*>(&(buffer[remaining])), size);
+			if (! in) {
+				throw "file " + filename + " is truncated";
+			}
+			data_read += size;
+			position = &(buffer[0]);
+			buffer_end = position + remaining + size;
+		}
+
+		void decode() {
+			fill();
+			current_row.data = row_data.value;
+			position = fmatrix_decode_row(position, current_row);
+		}
+
+	public:
+		LargeSparseMatrixCompressed(std::string filename, uint64 cache_size, bool use_mmap = false) {
+			this->filename = filename;
+			mapping = NULL;
+			mapping_size = 0;
+			in.open(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+			if (! in.is_open()) {
+				throw "could not open " + filename;
+			}
+			in.read(reinterpret_cast<char*>(&fh), sizeof(fh));
+			if (! in || (fh.id != FMATRIX_COMPRESSED_FILE_ID) || (fh.float_size != sizeof(T))) {
+				throw "file " + filename + " is not a compressed binary sparse matrix";
+			}
+			row_data.setSize(std::max(fh.max_row_bytes, 1u)); // every entry takes at least one byte
+			if (use_mmap) {
+				#ifdef _WIN32
+				throw "memory mapped files are not supported on this platform";
+				#else
+				in.close();
+				int fd = open(filename.c_str(), O_RDONLY);
+				if (fd < 0) {
+					throw "could not open " + filename;
+				}
+				// reading behind the end of a truncated file would raise SIGBUS
+				mapping_size = sizeof(fh) + fh.data_size;
+				struct stat st;
+				if ((fstat(fd, &st) != 0) || ((uint64) st.st_size < mapping_size)) {
+					close(fd);
+					throw "file " + filename + " is truncated";
+				}
+				void* m = mmap(NULL, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+				close(fd);
+				if (m == MAP_FAILED) {
+					throw "could not map " + filename;
+				}
+				mapping = static_cast<char*>(m);
+				madvise(mapping, mapping_size, MADV_SEQUENTIAL);
+				in_memory = true;
+				data_begin = reinterpret_cast<unsigned char*>(mapping) + sizeof(fh);
+				#endif
+			} else {
+				if (cache_size == 0) {
+					cache_size = std::numeric_limits<uint64>::max();
+				}
+				// the buffer has to hold at least a few rows
+				uint64 buffer_size = std::max(cache_size, (uint64) 4 * fh.max_row_bytes + 4096);
+				in_memory = (buffer_size >= fh.data_size);
+				buffer.resize(std::min(buffer_size, fh.data_size) + 16);
+				if (in_memory) {
+					in.read(reinterpret_cast<char*>(&(buffer[0])), fh.data_size);
+					if (! in) {
+						throw "file " + filename + " is truncated";
+					}
+					in.close();
+				}
+				data_begin = &(buffer[0]);
+				std::cout << "compressed bytes in cache=" << buffer.size() << "\tcompressed size=" << fh.data_size << std::endl;
+			}
+			begin();
+		}
+
+		~LargeSparseMatrixCompressed() {
+			#ifndef _WIN32
+			if (mapping != NULL) {
+				munmap(mapping, mapping_size);
+			}
+			#endif
+		}
+
+		virtual uint getNumRows() { return fh.num_rows; };
+		virtual uint getNumCols() { return fh.num_cols; };
+		virtual uint64 getNumValues() { return fh.num_values; };
+
+		virtual void begin() {
+			row_index = 0;
+			position = data_begin;
+			if (in_memory) {
+				buffer_end = data_begin + fh.data_size;
+			} else {
+				in.clear();
+				in.seekg(sizeof(fh), std::ios_base::beg);
+				buffer_end = position;
+				data_read = 0;
+			}
+			if (fh.num_rows > 0) { decode(); }
+		}
+		virtual bool end() { return row_index >= fh.num_rows; }
+		virtual void next() {
+			row_index++;
+			if (row_index < fh.num_rows) { decode(); }
+		}
+		virtual sparse_row<T>& getRow() { return current_row; }
+		virtual uint getRowIndex() { return row_index; }
+
+		virtual bool isBinary() { return (fh.flags & FMATRIX_FLAG_BINARY) != 0; }
+};
 
+// the first uint of a binary sparse matrix file
+inline uint fmatrix_file_id(std::string filename) {
+	std::ifstream in(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+	if (! in.is_open()) {
+		throw "could not open " + filename;
+	}
+	uint id = 0;
+	in.read(reinterpret_cast<char*>(&id), sizeof(id));
+	return id;
+}
 
+// opens a binary sparse matrix in the plain or the compressed format
+template <typename T> LargeSparseMatrix<T>* openLargeSparseMatrix(std::string filename, uint64 cache_size, bool use_mmap) {
+	if (fmatrix_file_id(filename) == FMATRIX_COMPRESSED_FILE_ID) {
+		return new LargeSparseMatrixCompressed<T>(filename, cache_size, use_mmap);
+	} else if (use_mmap) {
+		return new LargeSparseMatrixMMap<T>(filename);
+	} else {
+		return new LargeSparseMatrixHD<T>(filename, cache_size);
+	}
+}
 
 #endif /*FMATRIX_H_*/
@@ -0,0 +1,416 @@
+/*
+	External memory transpose of a large sparse matrix
+
+	The input is read once: its values are collected as (column, row, value) entries
+	in a buffer of bounded size. Every full buffer is sorted (in parallel) and written
+	as a sorted run to a temporary file. Finally all runs are merged into the
+	transposed binary file; if there are more runs than can be merged at once, runs
+	are merged into longer runs first. If the data fits into the buffer, no temporary
+	files are written at all.
+*/
+
+#ifndef FMATRIX_TRANSPOSE_H_
+#define FMATRIX_TRANSPOSE_H_
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <limits>
+#include <fstream>
+#include "fmatrix.h"
+#include "util.h"
+
+const uint TRANSPOSE_MAX_FAN_IN = 256; // default for the number of runs that are merged at once
+
+template <typename T> struct transpose_entry {
+	uint col;
+	uint row;
+	T value;
+	bool operator<(const transpose_entry<T>& e) const {
+		return (col < e.col) || ((col == e.col) && (row < e.row));
+	}
+};
+
+// sequential reader of a run file with a fixed buffer
+template <typename T> class transpose_run_reader {
+	private:
+		std::ifstream in;
+		std::vector< transpose_entry<T> > buffer;
+		uint64 position, filled;
+		std::string filename;
+	public:
+		transpose_entry<T> current;
+
+		void open(const std::string& filename, uint64 buffer_entries) {
+			this->filename = filename;
+			in.open(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+			if (! in.is_open()) {
+				throw "unable to open " + filename;
+			}
+			buffer.resize(std::max(buffer_entries, (uint64) 1));
+			position = 0;
+			filled = 0;
+		}
+		// moves to the next entry; returns false at the end of the run
+		bool next() {
+			if (position >= filled) {
+				in.read(reinterpret_cast<char*>(&(buffer[0])), buffer.size() * sizeof(transpose_entry<T>));
+				filled = in.gcount() / sizeof(transpose_entry<T>);
+				position = 0;
+				if (filled == 0) { return false; }
+			}
+			current = buffer[position++];
+			return true;
+		}
+		void close() {
+			in.close();
+			std::vector< transpose_entry<T> >().swap(buffer);
+		}
+};
+
+// buffered sequential writer
+class transpose_writer {
+	private:
+		std::ofstream out;
+		std::vector<char> buffer;
+		uint64 filled;
+		std::string filename;
+	public:
+		void open(const std::string& filename, uint64 buffer_size) {
+			this->filename = filename;
+			out.open(filename.c_str(), std::ios_base::out | std::ios_base::binary);
+			if (! out.is_open()) {
+				throw "could not open " + filename;
+			}
+			buffer.resize(std::max(buffer_size, (uint64) 4096));
+			filled = 0;
+		}
+		void write(const void* data, uint64 size) {
+			if (filled + size > buffer.size()) {
+				flush();
+				if (size > buffer.size()) {
+					out.write(static_cast<const char*>(data), size);
+					return;
+				}
+			}
+			memcpy(&(buffer[filled]), data, size);
+			filled += size;
+		}
+		void flush() {
+			out.write(&(buffer[0]), filled);
+			filled = 0;
+		}
+		void close() {
+			flush();
+			out.close();
+			if (out.fail()) {
+				throw "error writing " + filename;
+			}
+		}
+};
+
+template <typename T> class LargeSparseMatrixTranspose {
+	private:
+		std::string tmp_prefix;
+		uint num_tmp_files;
+		uint64 memory_size;
+		int num_threads;
+
+		std::vector<uint> entries_per_col; // = row sizes of the transposed matrix; grows with the largest column seen
+		uint num_rows, num_cols;
+		uint64 num_values;
+		bool binary; // all values added so far are 1.0
+
+		uint64 capacity; // entries in the buffer
+		std::vector< transpose_entry<T> > buffer;
+		std::vector< transpose_entry<T> > tmp;
+		std::vector<std::string> runs;
+
+		std::string tmpFilename() {
+			std::ostringstream ss;
+			ss << tmp_prefix << ".run" << num_tmp_files++;
+			return ss.str();
+		}
+
+		// sorts by (col,row)
+		void sortBuffer(std::vector< transpose_entry<T> >& buffer, std::vector< transpose_entry<T> >& tmp) {
+			uint64 n = buffer.size();
+			uint num_chunks = std::max(1, num_threads);
+			if (n < 65536) { num_chunks = 1; }
+			std::vector<uint64> bounds(num_chunks+1);
+			for (uint i = 0; i <= num_chunks; i++) {
+				bounds[i] = n * i / num_chunks;
+			}
+			if (((uint64) num_chunks * entries_per_col.size() <= n / 4) && (n < std::numeric_limits<uint>::max())) {
+				countingSort(buffer, tmp, bounds);
+				return;
+			}
+			// the chunks of the buffer are sorted in parallel and then merged pairwise
+			#pragma omp parallel for num_threads(num_threads) schedule(static, 1)
+			for (int i = 0; i < (int) num_chunks; i++) {
+				std::sort(buffer.begin() + bounds[i], buffer.begin() + bounds[i+1]);
+			}
+			if (num_chunks == 1) { return; }
+			tmp.resize(n);
+			for (uint width = 1; width < num_chunks; width *= 2) {
+				#pragma omp parallel for num_threads(num_threads) schedule(static, 1)
+				for (int i = 0; i < (int) num_chunks; i += 2*width) {
+					uint64 from = bounds[i];
+					uint64 mid = bounds[std::min((uint) i+width, num_chunks)];
+					uint64 to = bounds[std::min((uint) i+2*width, num_chunks)];
+					std::merge(buffer.begin() + from, buffer.begin() + mid, buffer.begin() + mid, buffer.begin() + to, tmp.begin() + from);
+				}
+				buffer.swap(tmp);
+			}
+		}
+
+		// Stable counting sort by column: the entries arrive in row order, so the rows of a column
+		// stay sorted. Every chunk counts and scatters its entries in parallel.
+		void countingSort(std::vector< transpose_entry<T> >& buffer, std::vector< transpose_entry<T> >& tmp, std::vector<uint64>& bounds) {
+			uint num_chunks = bounds.size() - 1;
+			uint num_cols_seen = entries_per_col.size();
+			std::vector< std::vector<uint> > offset(num_chunks);
+			#pragma omp parallel for num_threads(num_threads) schedule(static, 1)
+			for (int p = 0; p < (int) num_chunks; p++) {
+				offset[p].assign(num_cols_seen, 0);
+				for (uint64 i = bounds[p]; i < bounds[p+1]; i++) {
+					offset[p][buffer[i].col]++;
+				}
+			}
+			uint sum = 0;
+			for (uint c = 0; c < num_cols_seen; c++) {
+				for (uint p = 0; p < num_chunks; p++) {
+					uint count = offset[p][c];
+					offset[p][c] = sum;
+					sum += count;
+				}
+			}
+			tmp.resize(buffer.size());
+			#pragma omp parallel for num_threads(num_threads) schedule(static, 1)
+			for (int p = 0; p < (int) num_chunks; p++) {
+				std::vector<uint>& pos = offset[p];
+				for (uint64 i = bounds[p]; i < bounds[p+1]; i++) {
+					tmp[pos[buffer[i].col]++] = buffer[i];
+				}
+			}
+			buffer.swap(tmp);
+		}
+
+		void writeRun(std::vector< transpose_entry<T> >& buffer, const std::string& filename) {
+			std::ofstream out(filename.c_str(), std::ios_base::out | std::ios_base::binary);
+			if (! out.is_open()) {
+				throw "could not open " + filename;
+			}
+			out.write(reinterpret_cast<char*>(&(buffer[0])), buffer.size() * sizeof(transpose_entry<T>));
+			out.close();
+			if (out.fail()) {
+				throw "error writing " + filename + " (temporary file)";
+			}
+		}
+
+		// writes the transposed matrix from entries that arrive in (col,row) order
+		class matrix_writer {
+			private:
+				transpose_writer out;
+				std::string filename;
+				uint flags;
+				uint64 num_values;
+				std::vector<uint>* entries_per_col;
+				uint current_col; // the next column whose size has to be written
+			public:
+				void open(const std::string& filename, LargeSparseMatrixTranspose<T>& t) {
+					this->filename = filename;
+					flags = t.binary ? FMATRIX_FLAG_BINARY : 0;
+					num_values = t.num_values;
+					entries_per_col = &(t.entries_per_col);
+					out.open(filename, std::min(t.memory_size / 4, (uint64) 64*1024*1024));
+					file_header fh;
+					fh.id = FMATRIX_EXPECTED_FILE_ID;
+					fh.float_size = sizeof(T);
+					fh.num_values = t.num_values;
+					fh.num_rows = t.num_cols;
+					fh.num_cols = t.num_rows;
+					out.write(&fh, sizeof(fh));
+					current_col = 0;
+				}
+				void add(const transpose_entry<T>& e) {
+					while (current_col <= e.col) {
+						out.write(&((*entries_per_col)[current_col]), sizeof(uint));
+						current_col++;
+					}
+					sparse_entry<T> se;
+					se.id = e.row;
+					se.value = e.value;
+					out.write(&se, sizeof(se));
+				}
+				void close() {
+					while (current_col < entries_per_col->size()) { // empty columns at the end
+						out.write(&((*entries_per_col)[current_col]), sizeof(uint));
+						current_col++;
+					}
+					out.close();
+					fmatrix_save_flags(filename, flags, num_values);
+				}
+		};
+
+		struct merge_item {
+			transpose_entry<T> entry;
+			uint run;
+			bool operator<(const merge_item& m) const { return m.entry < entry; } // min-heap
+		};
+
+		// merges the runs into a longer run (to_matrix == NULL) or into the transposed matrix
+		void mergeRuns(const std::vector<std::string>& runs, const std::string& run_filename, matrix_writer* to_matrix) {
+			// the output of the final merge has its own buffer of a quarter of the memory
+			uint64 buffer_entries = (memory_size - memory_size/4) / sizeof(transpose_entry<T>) / (runs.size() + 1);
+			std::vector< transpose_run_reader<T> > readers(runs.size());
+			std::priority_queue<merge_item> heap;
+			for (uint i = 0; i < runs.size(); i++) {
+				readers[i].open(runs[i], buffer_entries);
+				if (readers[i].next()) {
+					merge_item m;
+					m.entry = readers[i].current;
+					m.run = i;
+					heap.push(m);
+				}
+			}
+			transpose_writer run_out;
+			if (to_matrix == NULL) {
+				run_out.open(run_filename, buffer_entries * sizeof(transpose_entry<T>));
+			}
+			while (! heap.empty()) {
+				merge_item m = heap.top();
+				heap.pop();
+				if (to_matrix != NULL) {
+					to_matrix->add(m.entry);
+				} else {
+					run_out.write(&(m.entry), sizeof(m.entry));
+				}
+				if (readers[m.run].next()) {
+					m.entry = readers[m.run].current;
+					heap.push(m);
+				}
+			}
+			if (to_matrix == NULL) {
+				run_out.close();
+			}
+			for (uint i = 0; i < runs.size(); i++) {
+				readers[i].close();
+				std::remove(runs[i].c_str());
+			}
+		}
+
+	public:
+		uint max_fan_in;       // maximum number of runs that are merged at once
+		uint num_runs;         // sorted runs written in the first pass
+		uint num_merge_passes; // passes over the temporary data (without the final merge)
+
+		// memory_size: bytes for buffering entries; tmp_prefix: prefix of the temporary files
+		LargeSparseMatrixTranspose(uint64 memory_size, const std::string& tmp_prefix, int num_threads = 1) {
+			this->memory_size = std::max(memory_size, (uint64) 1024*1024);
+			this->tmp_prefix = tmp_prefix;
+			this->num_threads = num_threads;
+			num_tmp_files = 0;
+			num_runs = 0;
+			num_merge_passes = 0;
+			max_fan_in = TRANSPOSE_MAX_FAN_IN;
+		}
+
+		// starts a transposition; the rows are added in order with addRow and written by finish
+		void begin() {
+			num_values = 0;
+			binary = true;
+			num_runs = 0;
+			num_merge_passes = 0;
+			entries_per_col.clear();
+			runs.clear();
+			// the buffer and the sort space share the memory
+			capacity = std::max(memory_size / (2 * sizeof(transpose_entry<T>)), (uint64) 1);
+			buffer.clear();
+			buffer.reserve(std::min(capacity, (uint64) 1024*1024));
+		}
+
+		void addRow(uint row_index, const sparse_row<T>& row) {
+			if ((buffer.size() + row.size > capacity) && ! buffer.empty()) {
+				sortBuffer(buffer, tmp);
+				runs.push_back(tmpFilename());
+				writeRun(buffer, runs.back());
+				buffer.clear();
+			}
+			transpose_entry<T> e;
+			e.row = row_index;
+			for (uint j = 0; j < row.size; j++) {
+				e.col = row.data[j].id;
+				e.value = row.data[j].value;
+				binary &= (e.value == 1.0);
+				buffer.push_back(e);
+				if (e.col >= entries_per_col.size()) {
+					entries_per_col.resize(e.col + 1, 0);
+				}
+				entries_per_col[e.col]++;
+			}
+			num_values += row.size;
+		}
+
+		// writes the transposed matrix of a num_rows x num_cols matrix
+		void finish(const std::string& ofile, uint num_rows, uint num_cols) {
+			this->num_rows = num_rows;
+			this->num_cols = num_cols;
+			if (entries_per_col.size() > num_cols) {
+				throw std::string("column index out of range during transpose");
+			}
+			sortBuffer(buffer, tmp);
+			std::vector< transpose_entry<T> >().swap(tmp);
+			entries_per_col.resize(num_cols, 0); // empty columns at the end
+			if (runs.empty()) {
+				// everything fits into memory
+				matrix_writer out;
+				out.open(ofile, *this);
+				for (uint64 i = 0; i < buffer.size(); i++) {
+					out.add(buffer[i]);
+				}
+				out.close();
+				std::vector< transpose_entry<T> >().swap(buffer);
+				return;
+			}
+			if (! buffer.empty()) {
+				runs.push_back(tmpFilename());
+				writeRun(buffer, runs.back());
+			}
+			std::vector< transpose_entry<T> >().swap(buffer);
+			num_runs = runs.size();
+
+			// merge until all runs can be merged at once
+			while (runs.size() > max_fan_in) {
+				std::vector<std::string> merged;
+				for (uint i = 0; i < runs.size(); i += max_fan_in) {
+					std::vector<std::string> group(runs.begin() + i, runs.begin() + std::min((uint) runs.size(), i + max_fan_in));
+					merged.push_back(tmpFilename());
+					mergeRuns(group, merged.back(), NULL);
+				}
+				runs.swap(merged);
+				num_merge_passes++;
+			}
+
+			// final merge into the transposed matrix
+			matrix_writer out;
+			out.open(ofile, *this);
+			mergeRuns(runs, "", &out);
+			out.close();
+			runs.clear();
+		}
+
+		void transpose(LargeSparseMatrix<T>& in, const std::string& ofile) {
+			begin();
+			for (in.begin(); !in.end(); in.next()) {
+				addRow(in.getRowIndex(), in.getRow());
+			}
+			finish(ofile, in.getNumRows(), in.getNumCols());
+		}
+};
+
+#endif /*FMATRIX_TRANSPOSE_H_*/
@@ -39,10 +39,13 @@ public:
         return value[x][y];
     }
     
+    bool is_external; // the values are not owned by the matrix (see setExternal)
+    
     DMatrix(uint p_dim1, uint p_dim2) {
         dim1 = 0;
         dim2 = 0;
         value = NULL;
+        is_external = false;
         setSize(p_dim1, p_dim2);
     }
     
@@ -50,15 +53,40 @@ public:
         dim1 = 0;
         dim2 = 0;
         value = NULL;
+        is_external = false;
     }
     
     ~DMatrix() {
+        release();
+    }
+    
+    void release() {
         if (value != NULL) {
             MemoryLog::getInstance().logFree("dmatrix", sizeof(T*), dim1);
-            delete [] value[0];
-            MemoryLog::getInstance().logFree("dmatrix", sizeof(T), dim1*dim2);
+            if (! is_external) {
+                delete [] value[0];
+                MemoryLog::getInstance().logFree("dmatrix", sizeof(T), dim1*dim2);
+            }
             delete [] value;
         }
+        value = NULL;
+        dim1 = 0;
+        dim2 = 0;
+        is_external = false;
+    }
+    
+    // uses the dim1*dim2 values (row by row) at p_value as storage without copying; they are not freed by the matrix
+    void setExternal(T* p_value, uint p_dim1, uint p_dim2) {
+        release();
+        dim1 = p_dim1;
+        dim2 = p_dim2;
+        MemoryLog::getInstance().logNew("dmatrix", sizeof(T*), dim1);
+        value = new T*[dim1];
+        for (unsigned i = 0; i < dim1; i++) {
+            value[i] = p_value + (uint64) i * dim2;
+        }
+        col_names.resize(dim2);
+        is_external = true;
     }
     
     void assign(DMatrix<T>& v) {
@@ -77,15 +105,10 @@ public:
         }
     }
     void setSize(uint p_dim1, uint p_dim2) {
-        if ((p_dim1 == dim1) && (p_dim2 == dim2)) {
+        if ((p_dim1 == dim1) && (p_dim2 == dim2) && ! is_external) {
             return;
         }
-        if (value != NULL) {
-            MemoryLog::getInstance().logFree("dmatrix", sizeof(T*), dim1);
-            delete [] value[0];
-            MemoryLog::getInstance().logFree("dmatrix", sizeof(T), dim1*dim2);
-            delete [] value;
-        }
+        release();
         dim1 = p_dim1;
         dim2 = p_dim2;
         MemoryLog::getInstance().logNew("dmatrix", sizeof(T*), dim1);
@@ -200,34 +223,47 @@ template <typename T> class DVector {//Vector
 public:
     uint dim;//维度
     T* value;//值
+    bool is_external; // value is not owned by the vector (see setExternal)
     DVector() {//构造函数：维度和值
         dim = 0;
         value = NULL;
+        is_external = false;
     }
     DVector(uint p_dim) {//用维度构造vector
         dim = 0;
         value = NULL;
+        is_external = false;
         setSize(p_dim);
     }
     ~DVector() {
-        if (value != NULL) {
-            MemoryLog::getInstance().logFree("dvector", sizeof(T), dim);
-            delete [] value;
-        }
+        release();
     }
     T get(uint x) {//获取vector的第x个元素
         return value[x];
     }
     void setSize(uint p_dim) {//设置数组维度
-        if (p_dim == dim) { return; }
-        if (value != NULL) {
-            MemoryLog::getInstance().logFree("dvector", sizeof(T), dim);
-            delete [] value;
-        }
+        if ((p_dim == dim) && ! is_external) { return; }
+        release();
         dim = p_dim;
         MemoryLog::getInstance().logNew("dvector", sizeof(T), dim);
         value = new T[dim];
     }
+    // uses p_value as storage without copying (e.g. a memory mapped file); the memory is not freed by the vector
+    void setExternal(T* p_value, uint p_dim) {
+        release();
+        dim = p_dim;
+        value = p_value;
+        is_external = true;
+    }
+    void release() {
+        if ((value != NULL) && ! is_external) {
+            MemoryLog::getInstance().logFree("dvector", sizeof(T), dim);
+            delete [] value;
+        }
+        value = NULL;
+        dim = 0;
+        is_external = false;
+    }
     T& operator() (unsigned x) {//符号重载
         return value[x];
     }
@@ -315,30 +351,166 @@ public:
 };
 
 
-class DVectorDouble : public DVector<double> {
+template <typename T> class DVectorReal : public DVector<T> {
 public:
     void init_normal(double mean, double stdev) {//用x~N(μ,σ2)初始化
-        for (uint i_2 = 0; i_2 < dim; i_2++) {
-            value[i_2] = ran_gaussian(mean, stdev);
+        for (uint i_2 = 0; i_2 < this->dim; i_2++) {
+            this->value[i_2] = ran_gaussian(mean, stdev);
         }
     }
 };
 
-class DMatrixDouble : public DMatrix<double> {
+template <typename T> class DMatrixReal : public DMatrix<T> {
 public:
+    using DMatrix<T>::init;
     void init(double mean, double stdev) {	
-        for (uint i_1 = 0; i_1 < dim1; i_1++) {
-            for (uint i_2 = 0; i_2 < dim2; i_2++) {
-                value[i_1][i_2] = ran_gaussian(mean, stdev);
+        for (uint i_1 = 0; i_1 < this->dim1; i_1++) {
+            for (uint i_2 = 0; i_2 < this->dim2; i_2++) {
+                this->value[i_1][i_2] = ran_gaussian(mean, stdev);
             }
         }
     }
     void init_column(double mean, double stdev, int column) {//初始化某一列
-        for (uint i_1 = 0; i_1 < dim1; i_1++) {
-            value[i_1][column] = ran_gaussian(mean, stdev);
+        for (uint i_1 = 0; i_1 < this->dim1; i_1++) {
+            this->value[i_1][column] = ran_gaussian(mean, stdev);
         }
     }
 };
 
+typedef DVectorReal<double> DVectorDouble;
+typedef DMatrixReal<double> DMatrixDouble;
+
+
+// Dense matrix (dim1 x dim2) stored column by column: the dim1 values of a column are
+// contiguous and every column starts at a 64 byte boundary. For the factors v(f,i) of
+// an FM this keeps all factors of one attribute in one (or a few) cache lines.
+template <typename T> class DMatrixColumnMajor {
+public:
+    static const uint ALIGNMENT = 64;
+    
+    T* value; // element (x,y) is at value[y*stride+x]
+    uint dim1, dim2;
+    uint stride; // dim1 rounded up to a multiple of ALIGNMENT bytes
+    
+    DMatrixColumnMajor(uint p_dim1, uint p_dim2) {
+        dim1 = 0;
+        dim2 = 0;
+        stride = 0;
+        value = NULL;
+        memory = NULL;
+        setSize(p_dim1, p_dim2);
+    }
+    
+    DMatrixColumnMajor() {
+        dim1 = 0;
+        dim2 = 0;
+        stride = 0;
+        value = NULL;
+        memory = NULL;
+    }
+    
+    ~DMatrixColumnMajor() {
+        release();
+    }
+    
+    void release() {
+        if (memory != NULL) {
+            MemoryLog::getInstance().logFree("dmatrix", sizeof(T), (uint64) stride*dim2 + ALIGNMENT/sizeof(T));
+            delete [] memory;
+        }
+        memory = NULL;
+        value = NULL;
+        dim1 = 0;
+        dim2 = 0;
+        stride = 0;
+    }
+    
+    // uses p_value (stride*dim2 values with the layout described above) as storage without
+    // copying; the memory is not freed by the matrix
+    void setExternal(T* p_value, uint p_dim1, uint p_dim2, uint p_stride) {
+        release();
+        dim1 = p_dim1;
+        dim2 = p_dim2;
+        stride = p_stride;
+        value = p_value;
+    }
+    
+    // stride that setSize uses for dim1 rows
+    static uint stride_for(uint p_dim1) {
+        const uint per_line = ALIGNMENT / sizeof(T);
+        return ((p_dim1 + per_line - 1) / per_line) * per_line;
+    }
+    
+    T get(uint x, uint y) {
+        return value[(uint64) y*stride + x];
+    }
+    
+    void setSize(uint p_dim1, uint p_dim2) {
+        if ((p_dim1 == dim1) && (p_dim2 == dim2) && ((memory != NULL) || (value == NULL))) {
+            return;
+        }
+        release();
+        dim1 = p_dim1;
+        dim2 = p_dim2;
+        const uint per_line = ALIGNMENT / sizeof(T);
+        stride = stride_for(dim1);
+        uint64 size = (uint64) stride*dim2 + per_line;
+        MemoryLog::getInstance().logNew("dmatrix", sizeof(T), size);
+        memory = new T[size];
+        value = memory;
+        while (((size_t) value) % ALIGNMENT != 0) { value++; }
+        for (uint64 i = 0; i < size - (value - memory); i++) {
+            value[i] = 0;
+        }
+    }
+    
+    void assign(DMatrixColumnMajor<T>& v) {
+        if ((v.dim1 != dim1) || (v.dim2 != dim2)) { setSize(v.dim1, v.dim2); }
+        for (uint j = 0; j < dim2; j++) {
+            for (uint i = 0; i < dim1; i++) {
+                (*this)(i,j) = v(i,j);
+            }
+        }
+    }
+    
+    void init(T v) {
+        for (uint j = 0; j < dim2; j++) {
+            for (uint i = 0; i < dim1; i++) {
+                (*this)(i,j) = v;
+            }
+        }
+    }
+    
+    // same order of random draws as DMatrixReal::init
+    void init(double mean, double stdev) {
+        for (uint i = 0; i < dim1; i++) {
+            for (uint j = 0; j < dim2; j++) {
+                (*this)(i,j) = ran_gaussian(mean, stdev);
+            }
+        }
+    }
+    
+    void init_column(double mean, double stdev, int column) {
+        for (uint i = 0; i < dim1; i++) {
+            (*this)(i,column) = ran_gaussian(mean, stdev);
+        }
+    }
+    
+    T& operator() (unsigned x, unsigned y) {
+        return value[(uint64) y*stride + x];
+    }
+    T operator() (unsigned x, unsigned y) const {
+        return value[(uint64) y*stride + x];
+    }
+    
+    // all dim1 values of column y
+    T* column(unsigned y) const {
+        return value + (uint64) y*stride;
+    }
+    
+private:
+    T* memory;
+};
+
 
 #endif /*MATRIX_H_*/
@@ -0,0 +1,127 @@
+/*
+	Streaming metrics for binary classification
+
+	binary_metrics accumulates (probability, label) pairs in one pass with constant memory;
+	accumulators of disjoint parts of the data (e.g. one per thread) are combined with merge:
+	- accuracy: fraction of cases with (p >= 0.5) == label
+	- logloss: mean negative log-likelihood (natural log, p clipped to [1e-15, 1-1e-15])
+	- NE (normalized entropy): logloss divided by the entropy of the empirical base rate
+	- calibration: sum of the predicted probabilities divided by the number of positives
+	- AUC: approximated from histograms of the logits of positives and negatives with NUM_BINS
+	  equal bins on [-LOGIT_RANGE, LOGIT_RANGE]; a pair in the same bin counts 1/2 (like a tie)
+*/
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <limits>
+#include "util.h"
+#include "memory.h"
+
+class binary_metrics {
+	public:
+		static const uint NUM_BINS = 16384;
+		static constexpr double LOGIT_RANGE = 16.0;
+		static constexpr double MIN_PROB = 1e-15;
+
+		uint64 num_pos, num_neg, num_correct;
+		double sum_logloss, sum_prob;
+		std::vector<uint64> hist_pos, hist_neg;
+
+		binary_metrics() : hist_pos(NUM_BINS), hist_neg(NUM_BINS) { clear(); }
+
+		void clear() {
+			num_pos = num_neg = num_correct = 0;
+			sum_logloss = sum_prob = 0;
+			std::fill(hist_pos.begin(), hist_pos.end(), 0);
+			std::fill(hist_neg.begin(), hist_neg.end(), 0);
+		}
+
+		// the label predicate shared by all learners: targets > 0 are positive
+		// (+1 of -1/+1 labels, 1 of 0/1 labels), everything else is negative
+		static inline bool is_positive(double target) { return target > 0.0; }
+
+		// p is the predicted probability of the positive class
+		inline void add(double p, bool positive) {
+			if ((p >= 0.5) == positive) {
+				num_correct++;
+			}
+			sum_prob += p;
+			double pc = std::min(std::max(p, MIN_PROB), 1.0 - MIN_PROB);
+			double log_p = std::log(pc);
+			double log_q = std::log1p(-pc);
+			double logit = std::min(std::max(log_p - log_q, -LOGIT_RANGE), LOGIT_RANGE);
+			uint bin = std::min((uint) ((logit + LOGIT_RANGE) * (NUM_BINS / (2.0 * LOGIT_RANGE))), NUM_BINS - 1);
+			if (positive) {
+				num_pos++;
+				sum_logloss -= log_p;
+				hist_pos[bin]++;
+			} else {
+				num_neg++;
+				sum_logloss -= log_q;
+				hist_neg[bin]++;
+			}
+		}
+
+		void merge(const binary_metrics& other) {
+			num_pos += other.num_pos;
+			num_neg += other.num_neg;
+			num_correct += other.num_correct;
+			sum_logloss += other.sum_logloss;
+			sum_prob += other.sum_prob;
+			for (uint b = 0; b < NUM_BINS; b++) {
+				hist_pos[b] += other.hist_pos[b];
+				hist_neg[b] += other.hist_neg[b];
+			}
+		}
+
+		uint64 num_cases() const { return num_pos + num_neg; }
+
+		double accuracy() const { return (double) num_correct / num_cases(); }
+
+		double logloss() const { return sum_logloss / num_cases(); }
+
+		double normalized_entropy() const {
+			double base_rate = (double) num_pos / num_cases();
+			if ((num_pos == 0) || (num_neg == 0)) {
+				return std::numeric_limits<double>::quiet_NaN();
+			}
+			double entropy = -(base_rate * std::log(base_rate) + (1.0 - base_rate) * std::log(1.0 - base_rate));
+			return logloss() / entropy;
+		}
+
+		double calibration() const {
+			if (num_pos == 0) {
+				return std::numeric_limits<double>::quiet_NaN();
+			}
+			return sum_prob / num_pos;
+		}
+
+		double auc() const {
+			if ((num_pos == 0) || (num_neg == 0)) {
+				return std::numeric_limits<double>::quiet_NaN();
+			}
+			// sweep the bins in increasing order; every positive wins against all negatives of lower bins
+			double sum = 0;
+			uint64 neg_below = 0;
+			for (uint b = 0; b < NUM_BINS; b++) {
+				sum += hist_pos[b] * (neg_below + 0.5 * hist_neg[b]);
+				neg_below += hist_neg[b];
+			}
+			return sum / ((double) num_pos * num_neg);
+		}
+
+		// e.g. "Test(AUC)=0.8\tTest(logloss)=0.4\tTest(NE)=0.9\tTest(calib)=1.01"
+		std::string report(const std::string& name) const {
+			std::ostringstream ss;
+			ss << name << "(AUC)=" << auc() << "\t" << name << "(logloss)=" << logloss() << "\t" << name << "(NE)=" << normalized_entropy() << "\t" << name << "(calib)=" << calibration();
+			return ss.str();
+		}
+};
+
+#endif /*METRICS_H_*/
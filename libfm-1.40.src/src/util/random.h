@@ -13,8 +13,14 @@
 #include <stdlib.h>
 #include <cmath>
 #include <assert.h>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include "util.h"
 
 
+void ran_seed(unsigned long long seed);
+unsigned long long ran_bits();
 double ran_gaussian();
 double ran_gaussian(double mean, double stdev);
 double ran_left_tgaussian(double left);
@@ -32,6 +38,91 @@ double cdf_gaussian(double x);
 
 
 
+/*
+ Random engine: every thread has its own engine, so all samplers are thread-safe and a run is
+ reproducible for a given seed (ran_seed). Another engine can be plugged in with the typedef
+ ran_engine; it has to provide seed(x) and next() returning 64 random bits.
+*/
+
+// splitmix64: spreads consecutive seeds over the state space
+unsigned long long ran_mix(unsigned long long x) {
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+// xoshiro256** (Blackman and Vigna)
+class ran_xoshiro256ss {
+	private:
+		unsigned long long s[4];
+		static unsigned long long rotl(unsigned long long x, int k) {
+			return (x << k) | (x >> (64 - k));
+		}
+	public:
+		void seed(unsigned long long x) {
+			for (int i = 0; i < 4; i++) {
+				s[i] = ran_mix(x + i * 0x9e3779b97f4a7c15ULL);
+			}
+		}
+		unsigned long long next() {
+			const unsigned long long result = rotl(s[1] * 5, 7) * 9;
+			const unsigned long long t = s[1] << 17;
+			s[2] ^= s[0];
+			s[3] ^= s[1];
+			s[1] ^= s[2];
+			s[0] ^= s[3];
+			s[2] ^= t;
+			s[3] = rotl(s[3], 45);
+			return result;
+		}
+};
+
+typedef ran_xoshiro256ss ran_engine;
+
+// the threads of a parallel region are seeded from the global seed and their OpenMP thread number
+// (not from the order in which they draw first, which depends on the scheduling)
+std::atomic<unsigned long long> ran_global_seed(0);
+
+struct ran_thread_state {
+	ran_engine engine;
+	ran_engine saved; // the engine of the thread while a stream of ran_thread_seed is used
+	bool has_saved;
+	ran_thread_state() {
+		engine.seed(ran_global_seed ^ ran_mix(get_thread_num() + 1));
+		has_saved = false;
+	}
+};
+static thread_local ran_thread_state ran_thread;
+
+// seeds the engine of the calling thread (and of all threads that draw for the first time afterwards)
+void ran_seed(unsigned long long seed) {
+	ran_global_seed = seed;
+	ran_thread.engine.seed(seed);
+}
+
+// switches the calling thread to an own stream (e.g. one per feature in a parallel loop)
+// until ran_thread_release; the thread's engine continues afterwards as if nothing was drawn
+void ran_thread_seed(unsigned long long seed) {
+	if (! ran_thread.has_saved) {
+		ran_thread.saved = ran_thread.engine;
+		ran_thread.has_saved = true;
+	}
+	ran_thread.engine.seed(seed);
+}
+
+void ran_thread_release() {
+	if (ran_thread.has_saved) {
+		ran_thread.engine = ran_thread.saved;
+		ran_thread.has_saved = false;
+	}
+}
+
+unsigned long long ran_bits() {
+	return ran_thread.engine.next();
+}
+
+
 double erf(double x) {
 	double t;
 	if (x >= 0) {
@@ -136,20 +227,60 @@ double ran_gamma(double alpha, double beta) {
 }
 
 //高斯分布随机数发生器
-double ran_gaussian() {
-	// Joseph L. Leva: A fast normal Random number generator
-	double u,v, x, y, Q;
+// Ziggurat method (Marsaglia and Tsang) with 128 blocks in the variant of Doornik (2005)
+const int RAN_ZIGGURAT_C = 128;
+const double RAN_ZIGGURAT_R = 3.442619855899;      // start of the tail
+const double RAN_ZIGGURAT_V = 9.91256303526217e-3; // area of each block
+
+struct ran_ziggurat_table {
+	double x[RAN_ZIGGURAT_C + 1];
+	double r[RAN_ZIGGURAT_C]; // x[i+1]/x[i]
+	ran_ziggurat_table() {
+		double f = exp(-0.5 * RAN_ZIGGURAT_R * RAN_ZIGGURAT_R);
+		x[0] = RAN_ZIGGURAT_V / f; // the bottom block includes the tail
+		x[1] = RAN_ZIGGURAT_R;
+		x[RAN_ZIGGURAT_C] = 0;
+		for (int i = 2; i < RAN_ZIGGURAT_C; i++) {
+			x[i] = std::sqrt(-2.0 * std::log(RAN_ZIGGURAT_V / x[i-1] + f));
+			f = exp(-0.5 * x[i] * x[i]);
+		}
+		for (int i = 0; i < RAN_ZIGGURAT_C; i++) {
+			r[i] = x[i+1] / x[i];
+		}
+	}
+};
+static ran_ziggurat_table ran_ziggurat;
+
+double ran_gaussian_tail(double left, bool negative) {
+	double x, y;
 	do {
-		do {
-			u = ran_uniform();
-		} while (u == 0.0); 
-		v = 1.7156 * (ran_uniform() - 0.5);
-		x = u - 0.449871;
-		y = std::abs(v) + 0.386595;
-		Q = x*x + y*(0.19600*y-0.25472*x);
-		if (Q < 0.27597) { break; }
-	} while ((Q > 0.27846) || ((v*v) > (-4.0*u*u*std::log(u)))); 
-	return v / u;
+		x = std::log(((ran_bits() >> 11) + 0.5) * (1.0 / 9007199254740992.0)) / left;
+		y = std::log(((ran_bits() >> 11) + 0.5) * (1.0 / 9007199254740992.0));
+	} while (-2.0 * y < x * x);
+	return negative ? (x - left) : (left - x);
+}
+
+double ran_gaussian() {
+	const double* zx = ran_ziggurat.x;
+	while (true) {
+		unsigned long long bits = ran_bits();
+		double u = 2.0 * ((bits >> 11) * (1.0 / 9007199254740992.0)) - 1.0;
+		int i = bits & (RAN_ZIGGURAT_C - 1); // the low bits are not used for u
+		// inside the rectangle of block i
+		if (std::abs(u) < ran_ziggurat.r[i]) {
+			return u * zx[i];
+		}
+		if (i == 0) {
+			return ran_gaussian_tail(RAN_ZIGGURAT_R, u < 0);
+		}
+		// wedge of block i
+		double x = u * zx[i];
+		double f0 = exp(-0.5 * (zx[i] * zx[i] - x * x));
+		double f1 = exp(-0.5 * (zx[i+1] * zx[i+1] - x * x));
+		if (f1 + ran_uniform() * (f0 - f1) < 1.0) {
+			return x;
+		}
+	}
 }
 
 double ran_gaussian(double mean, double stdev) {
@@ -161,7 +292,7 @@ double ran_gaussian(double mean, double stdev) {
 }
 
 double ran_uniform() {
-	return rand()/((double)RAND_MAX + 1);
+	return (ran_bits() >> 11) * (1.0 / 9007199254740992.0); // 53 random bits in [0,1)
 }
 
 double ran_exp() {
@@ -172,4 +303,55 @@ bool ran_bernoulli(double p) {
 	return (ran_uniform() < p);
 }
 
+// draws i with probability weight(i)/sum(weight) in O(1) (alias method of Walker, construction of Vose)
+class ran_alias_table {
+	private:
+		std::vector<double> prob; // probability to keep bucket i
+		std::vector<unsigned int> alias; // otherwise alias[i] is drawn
+	public:
+		void init(const std::vector<double>& weight) {
+			unsigned int n = weight.size();
+			assert(n > 0);
+			prob.resize(n);
+			alias.resize(n);
+			double sum = 0;
+			for (unsigned int i = 0; i < n; i++) {
+				assert(weight[i] >= 0);
+				sum += weight[i];
+			}
+			assert(sum > 0);
+			std::vector<unsigned int> small, large;
+			for (unsigned int i = 0; i < n; i++) {
+				prob[i] = weight[i] * n / sum;
+				alias[i] = i;
+				if (prob[i] < 1.0) {
+					small.push_back(i);
+				} else {
+					large.push_back(i);
+				}
+			}
+			while (! small.empty() && ! large.empty()) {
+				unsigned int s = small.back(); small.pop_back();
+				unsigned int l = large.back();
+				alias[s] = l;
+				prob[l] -= 1.0 - prob[s];
+				if (prob[l] < 1.0) {
+					large.pop_back();
+					small.push_back(l);
+				}
+			}
+			// the remaining buckets are full up to rounding errors
+			for (unsigned int i = 0; i < small.size(); i++) { prob[small[i]] = 1.0; }
+			for (unsigned int i = 0; i < large.size(); i++) { prob[large[i]] = 1.0; }
+		}
+
+		unsigned int size() const { return prob.size(); }
+
+		unsigned int draw() const {
+			double u = ran_uniform() * prob.size();
+			unsigned int i = std::min((unsigned int) u, (unsigned int) prob.size() - 1);
+			return ((u - i) < prob[i]) ? i : alias[i];
+		}
+};
+
 #endif /*RANDOM_H_*/
@@ -18,6 +18,11 @@
 #include <float.h>
 #else
 #include <sys/resource.h>
+#include <sys/time.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
 #endif
 
 #include <iostream>
@@ -76,6 +81,38 @@ double getusertime4() {
 	return (double) time(NULL);
 }
 
+double getwalltime() {
+	#ifdef _WIN32
+	return getusertime3();
+	#else
+	struct timeval tim;
+	gettimeofday(&tim, NULL);
+	return (double)tim.tv_sec + (double)tim.tv_usec / 1000000.0;
+	#endif
+}
+
+int get_num_threads() {
+	#ifdef _OPENMP
+	return omp_get_max_threads();
+	#else
+	return 1;
+	#endif
+}
+
+void set_num_threads(int num_threads) {
+	#ifdef _OPENMP
+	omp_set_num_threads(num_threads);
+	#endif
+}
+
+int get_thread_num() {
+	#ifdef _OPENMP
+	return omp_get_thread_num();
+	#else
+	return 0;
+	#endif
+}
+
 bool fileexists(std::string filename) {
 	std::ifstream in_file (filename.c_str());
 	return in_file.is_open();		